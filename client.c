@@ -8,6 +8,9 @@
 *
 *            An alarm is triggered every two seconds to cause the
 *            mutation of old cells and the transmition of mutated grid.
+*            Every keyframeInterval frames the whole grid is sent, the
+*            frames in between are sent as the list of cells that were
+*            toggled, or as deltas from the last frame.
 *
 *            The main task will perform the setup and key stroke
 *            command reading for the alarm driven task.
@@ -21,18 +24,23 @@
 #include <stropts.h>
 #include <sys/conf.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <strings.h>
+#include <errno.h>
 #include "utils.h"
 
 /**************************************************************************
 *                                 Definitions
 **************************************************************************/
 #define DISPLAY_GRID    TRUE    /* True if grids will be displayed */
+#define DEFAULT_MTU     1500    /* Path MTU when it can't be queried */
+#define UDP_IP_HEADERS  28      /* IPv4 and UDP header bytes */
+#define MAX_UDP_PAYLOAD 65507   /* largest IPv4 UDP datagram payload */
 
 /**************************************************************************
 *                           Function Prototypes
@@ -40,11 +48,29 @@
 static void OnAlarm(int sig);   /* Alarm signal handler */
 void InitSocket(void);          /* Initialize UDP socket */
 void DoSend(GRID *grid);        /* Sends UDP data over socket */
+int PathDatagram(void);         /* Largest unfragmented datagram */
+int SendPacket(BYTE *packed,    /* Send packet, fragmenting it to fit */
+    int size);
 
 /**************************************************************************
 *                               Global Variables
 **************************************************************************/
 GRID *grid;                     /* Pointer to the cell grid */
+BYTE *packet;                   /* Packing array, reused every frame */
+BYTE *reference;                /* Last frame sent, base for deltas */
+BYTE *delta;                    /* Delta array, reused every frame */
+FLIP_LIST flips;                /* Cells toggled by the last mutation */
+BYTE *fragment;                 /* Fragment array, reused every frame */
+BYTE control[CONTROL_SIZE];     /* Join and leave packets */
+int packetSize;                 /* Size of the packing arrays */
+int maxDatagram;                /* Largest datagram for the path MTU */
+unsigned frameID = 0;           /* Id of last fragmented packet */
+int keyInterval = KEY_INTERVAL; /* Frames between key frames */
+int sinceKey = 0;               /* Frames sent since last key frame */
+int refValid = FALSE;           /* True if proxy may hold reference */
+int refBehind = FALSE;          /* True if a frame after reference was */
+                                /* not sent, so flips don't apply to it */
+unsigned highestSent = 0;       /* Highest sequence number sent */
 char keyPress = 0;              /* Keypad depression */
 int servPort;                   /* The port on the proxy side */
 char servHost[256];             /* Symbolic IP address of the proxy */
@@ -68,9 +94,10 @@ int main(int argc, char *argv[])
     struct itimerval tick;      /* Alarm tick interval */
 
     /* Check for correct number of arguements */
-    if (argc != 5)
+    if ((argc != 5) && (argc != 6))
     {
-        fprintf(stderr, "Syntax: %s gridRows gridCols proxy port\n",
+        fprintf(stderr,
+            "Syntax: %s gridRows gridCols proxy port [keyframeInterval]\n",
            argv[0]);
         return(1);
     }
@@ -79,9 +106,21 @@ int main(int argc, char *argv[])
     strcpy(servHost, argv[3]);
     sscanf(argv[4], "%d", &servPort);
 
+    /* 1 sends every frame as a key frame */
+    if ((argc == 6) && ((keyInterval = atoi(argv[5])) < 1))
+    {
+        keyInterval = 1;
+    }
+
     /* Setup socket to communicate with proxy service */
     InitSocket();
 
+    /* Let proxy know we are starting */
+    send(socketFD, control, PackControl(control, PKT_JOIN), 0);
+
+    /* Select grid packing kernels for this CPU */
+    InitCodec();
+
     /* Kick off periodic alarm to send data */
     tick.it_interval.tv_sec = 2;
     tick.it_interval.tv_usec = 0;
@@ -96,8 +135,31 @@ int main(int argc, char *argv[])
 
     /* Initialize grid data structure */
     grid = InitGrid(atoi(argv[1]), atoi(argv[2]));
+    if (grid == NULL)
+    {
+        CloseScreen();
+        fprintf(stderr, "Grids may have at most %d rows and columns, "
+            "and %d cells\n", MAX_DIM, MAX_CELLS);
+        return(1);
+    }
+
     gettimeofday(&grid->timeStamp, NULL);
 
+    /* Allocate the packing arrays once, DoSend reuses them */
+    packetSize = PackedBitsSize(grid->rows, grid->cols);
+    packet = (BYTE *)CountedMalloc(packetSize);
+    reference = (BYTE *)CountedMalloc(packetSize);
+    delta = (BYTE *)CountedMalloc(packetSize);
+
+    /* Fragments are never bigger than a datagram on the path */
+    maxDatagram = PathDatagram();
+    fragment = (BYTE *)CountedMalloc(MAX_DATAGRAM);
+
+    flips.size = MAX_FLIPS;
+    flips.count = 0;
+    flips.overflow = FALSE;
+    flips.cells = (int *)CountedMalloc(sizeof(int) * MAX_FLIPS);
+
     if (DISPLAY_GRID)
     {
         ShowGrid(grid);
@@ -140,10 +202,14 @@ static void OnAlarm(int sig)
         case 'q':
         case 'Q':
             FreeGrid(grid);
+            free(packet);
+            free(reference);
+            free(delta);
+            free(fragment);
+            free(flips.cells);
 
             /* Let proxy know we quit */
-            sendto(socketFD, "end", 4 * sizeof(char), 0,
-                (struct sockaddr *)&servAddr, sizeof(servAddr));
+            send(socketFD, control, PackControl(control, PKT_LEAVE), 0);
 
             CloseScreen();
             close(socketFD);
@@ -159,7 +225,7 @@ static void OnAlarm(int sig)
         /* Skip sequence number */
         case 's':
         case 'S':
-            MutateGrid(grid, DISPLAY_GRID);
+            MutateGrid(grid, DISPLAY_GRID, &flips);
             grid->sequenceNumber += 2;
             gettimeofday(&grid->timeStamp, NULL);
 
@@ -177,7 +243,7 @@ static void OnAlarm(int sig)
         /* Transpose sequence numbers */
         case 'r':
         case 'R':
-            MutateGrid(grid, DISPLAY_GRID);
+            MutateGrid(grid, DISPLAY_GRID, &flips);
             grid->sequenceNumber += 2;
             gettimeofday(&grid->timeStamp, NULL);
 
@@ -196,7 +262,7 @@ static void OnAlarm(int sig)
             break;
 
         default:
-            MutateGrid(grid, DISPLAY_GRID);
+            MutateGrid(grid, DISPLAY_GRID, &flips);
             grid->sequenceNumber++;
             gettimeofday(&grid->timeStamp, NULL);
 
@@ -225,6 +291,10 @@ static void OnAlarm(int sig)
 *                with the mixer service.  The socket number opened will
 *                be stored in the global variable socket.
 *   Parameters : None
+*                The socket is connected to the mixer, so that the
+*                kernel tracks the path MTU to it, and IP fragmentation
+*                is turned off, so that datagrams bigger than the path
+*                MTU fail instead of being fragmented.
 *   Effects    : A socket is opened, and the socket number is stored in
 *                socketFD
 *   Returned   : None
@@ -232,6 +302,9 @@ static void OnAlarm(int sig)
 void InitSocket(void)
 {
     struct hostent *hptr;
+#ifdef IP_MTU_DISCOVER
+    int discover = IP_PMTUDISC_DO;
+#endif
 
     /* Open the socket */
     socketFD = socket(AF_INET, SOCK_DGRAM, 0);
@@ -251,6 +324,117 @@ void InitSocket(void)
     servAddr.sin_family = AF_INET;
     servAddr.sin_addr.s_addr = ((struct in_addr *)(hptr->h_addr))->s_addr;
     servAddr.sin_port = htons(servPort);
+
+    if (connect(socketFD, (struct sockaddr *)&servAddr,
+        sizeof(servAddr)) != 0)
+    {
+        perror("Connecting socket");
+        exit(1);
+    }
+
+#ifdef IP_MTU_DISCOVER
+    /* Set the don't fragment bit, we fragment to fit the path */
+    setsockopt(socketFD, IPPROTO_IP, IP_MTU_DISCOVER, &discover,
+        sizeof(discover));
+#endif
+}
+
+/**************************************************************************
+*   Function   : PathDatagram
+*   Description: Finds the largest datagram that can be sent to the mixer
+*                without being fragmented by IP.
+*   Parameters : None
+*   Effects    : None
+*   Returned   : The path MTU, less the IP and UDP headers, and at most
+*                the largest payload an IPv4 UDP datagram can carry.  If
+*                the path MTU can't be queried, the Ethernet MTU is
+*                assumed.
+**************************************************************************/
+int PathDatagram(void)
+{
+    int mtu = DEFAULT_MTU;
+#ifdef IP_MTU
+    socklen_t length = sizeof(mtu);
+
+    if ((getsockopt(socketFD, IPPROTO_IP, IP_MTU, &mtu, &length) != 0) ||
+        (mtu <= UDP_IP_HEADERS))
+    {
+        mtu = DEFAULT_MTU;
+    }
+#endif
+
+    /* Loopback reports a 64K MTU, more than a datagram can carry */
+    if (mtu - UDP_IP_HEADERS > MAX_UDP_PAYLOAD)
+    {
+        return(MAX_UDP_PAYLOAD);
+    }
+
+    return(mtu - UDP_IP_HEADERS);
+}
+
+/**************************************************************************
+*   Function   : SendPacket
+*   Description: Sends a packet to the mixer.  Packets bigger than a
+*                datagram on the path to the mixer are sent as fragments,
+*                which are packed in the preallocated fragment array.  If
+*                the path MTU shrinks, the send fails with EMSGSIZE, and
+*                the packet is fragmented again for the new MTU.
+*   Parameters : packed - packet to send
+*                size - number of bytes in packed
+*   Effects    : packed is sent to the mixer.  frameID is incremented for
+*                fragmented packets.
+*   Returned   : Number of datagrams sent.  0 indicates that the packet
+*                could not be sent.
+**************************************************************************/
+int SendPacket(BYTE *packed, int size)
+{
+    int count, index, fragSize, retry;
+
+    for (retry = 0; retry < 2; retry++)
+    {
+        count = FragmentCount(size, maxDatagram);
+
+        if (count == 1)
+        {
+            if (send(socketFD, (char *)packed, size, 0) == size)
+            {
+                return(1);
+            }
+        }
+        else if (count > 1)
+        {
+            frameID++;
+
+            for (index = 0; index < count; index++)
+            {
+                fragSize = PackFragmentBuf(packed, size, frameID, index,
+                    count, fragment, MAX_DATAGRAM);
+
+                if (send(socketFD, (char *)fragment, fragSize, 0) !=
+                    fragSize)
+                {
+                    break;
+                }
+            }
+
+            if (index == count)
+            {
+                return(count);
+            }
+        }
+
+        if ((count == 0) || (errno != EMSGSIZE))
+        {
+            break;
+        }
+
+        /* Path MTU changed, try again with the new one */
+        maxDatagram = PathDatagram();
+    }
+
+    PutFormattedLine(grid->rows + 8, 0, "Unable to send %d byte frame",
+        size);
+    return(0);
 }
 
 /**************************************************************************
@@ -258,18 +442,108 @@ void InitSocket(void)
 *   Description: This function will send a packed grid to an already open
 *                Vsocket connection.  It's intended that the socket be
 *                connected to a grid mixer, but it's not a requirement.
+*                Between key frames, the cells toggled by the last
+*                mutation are sent, and the reference copy of the last
+*                frame is toggled to match, so the cost of a frame depends
+*                on the number of changes and not on the grid size.  If
+*                the flip list overflowed, the grid is sent as a delta
+*                from the last frame, if the delta is smaller.  Flips and
+*                deltas are only sent when the last frame had a new
+*                highest sequence number, otherwise the proxy will have
+*                rejected it and has a different base.  All packing is done
+*                in preallocated arrays, so sending does not use the heap.
+*                Frames bigger than a datagram are sent as fragments.  If
+*                a frame can't be sent, the proxy still holds the frame
+*                before it, so reference is left alone, and the next frame
+*                is sent as a delta or key frame instead of flips.
 *   Parameters : grid - grid to be sent to the mixer
-*   Effects    : grid is packed and sent to the mixer.
+*   Effects    : grid is packed and sent to the mixer.  reference is
+*                updated to the grid that was sent, if it was sent.
 *   Returned   : None
 **************************************************************************/
 void DoSend(GRID *grid)
 {
-    BYTE *packet;
-    int size;
+    BYTE *swap, *sent;
+    int size = 0, datagrams, isFlips = FALSE;
+    char *kind;
+
+    if (refValid && !refBehind && (sinceKey < keyInterval - 1))
+    {
+        /* Try sending just the toggled cells */
+        size = PackFlipsToBuf(grid, &flips, highestSent, delta, packetSize);
+
+        if (size)
+        {
+            sent = delta;
+            kind = "flips";
+            isFlips = TRUE;
+        }
+    }
+
+    if (!size)
+    {
+        /* Pack the whole grid, it's also the next delta reference */
+        size = PackGridToBitsBuf(grid, packet, packetSize);
+        if (!size)
+        {
+            return;
+        }
+
+        sent = packet;
+        kind = "key";
+
+        if (refValid && (sinceKey < keyInterval - 1))
+        {
+            size = PackBitsToDelta(packet, reference, delta, size);
+
+            if (size)
+            {
+                sent = delta;
+                kind = "delta";
+            }
+            else
+            {
+                size = PackedBitsSize(grid->rows, grid->cols);
+            }
+        }
+    }
 
     /* Send packet */
-    packet = PackGridToBits(grid, &size);
-    sendto(socketFD, (char *)packet, size, 0,
-        (struct sockaddr *)&servAddr, sizeof(servAddr));
-    free(packet);
+    datagrams = SendPacket(sent, size);
+
+    PutFormattedLine(grid->rows + 7, 0,
+        "Sent %s frame: %d bytes in %d datagrams", kind, size, datagrams);
+
+    if (!datagrams)
+    {
+        /* The proxy still holds reference, if it held it before */
+        refBehind = TRUE;
+    }
+    else
+    {
+        /* The frame sent is the next delta reference */
+        if (isFlips)
+        {
+            FlipPackedBits(reference, &flips, grid->sequenceNumber);
+        }
+        else
+        {
+            swap = reference;
+            reference = packet;
+            packet = swap;
+        }
+
+        refBehind = FALSE;
+        sinceKey = (sent == delta) ? sinceKey + 1 : 0;
+
+        /* Proxy only accepts frames with a new highest sequence number */
+        refValid = (grid->sequenceNumber > highestSent);
+        if (refValid)
+        {
+            highestSent = grid->sequenceNumber;
+        }
+    }
+
+    PutFormattedLine(grid->rows + 6, 0, "Mallocs this frame: %lu",
+        FrameMallocs());
 }
@@ -1,19 +1,68 @@
 #include "utils.h"
 
+#define TEST_CLIENTS    12      /* Clients in the merge check */
+#define TEST_CROWD      600     /* Clients whose sums overflow a FIXED_SUM */
+#define TEST_MIN_DIM    3       /* MutateGrid needs 5 or more cells */
+#define TEST_MAX_DIM    70      /* Largest rows or cols of a test grid */
+#define TEST_CROWD_DIM  8       /* Largest rows or cols of a crowd grid */
+#define TEST_MAX_AGE    8       /* Most merges a client goes without update */
+#define TEST_ENGINES    4       /* scalar, bitslice, vector, running sum */
+#define TEST_PAYLOAD    16      /* Most payload bytes of a hostile packet */
+#define TEST_KERNELS    4       /* scalar, swar, sse2, avx2 */
+#define TEST_KERNEL_ROWS 9      /* Rows of kernel check grids, 1 to this */
+#define TEST_KERNEL_COLS 70     /* Cols of kernel check grids, 5 to this */
+
+typedef struct          /* Hand made delta or flip packet payload */
+{
+    int type;                   /* PKT_DELTA or PKT_FLIPS */
+    int expected;               /* Apply's return, -1 for rejected */
+    int length;                 /* bytes in payload */
+    unsigned char payload[TEST_PAYLOAD];    /* varints and XOR bytes */
+} TEST_PACKET;
+
+int CheckMergeEngines(int ticks,    /* Compare merge engines */
+    int clients, int maxDim, int full);
+int CheckHostilePackets(void);      /* Feed malformed deltas and flips */
+int CheckCodecKernels(int rounds);  /* Compare pack/unpack kernels */
+int CheckRoundTrips(GRID *grid,     /* Key, delta and flips of a grid */
+    FLIP_LIST *flips);
+
 int main(int argc, char *argv[])
 {
     GRID *grid;
     BYTE *packed;
+    int ticks;
+
+    if ((argc >= 2) && !strcmp(argv[1], "-m"))
+    {
+        ticks = (argc >= 3) ? atoi(argv[2]) : 1000;
+
+        /* A crowd of full grids overflows the sums */
+        return((CheckMergeEngines(ticks, TEST_CLIENTS, TEST_MAX_DIM,
+            FALSE) && CheckMergeEngines((ticks + 9) / 10, TEST_CROWD,
+            TEST_CROWD_DIM, TRUE)) ? 0 : 1);
+    }
+
+    if ((argc >= 2) && !strcmp(argv[1], "-h"))
+    {
+        return(CheckHostilePackets() ? 0 : 1);
+    }
+
+    if ((argc >= 2) && !strcmp(argv[1], "-k"))
+    {
+        return(CheckCodecKernels((argc >= 3) ? atoi(argv[2]) : 4) ? 0 : 1);
+    }
 
     InitScreen();
+    InitCodec();
 
     grid = InitGrid(atoi(argv[1]), atoi(argv[2]));
     ShowGrid(grid);
-    MutateGrid(grid, TRUE);
+    MutateGrid(grid, TRUE, NULL);
 
     getch();
 
-    packed = PackGridToBits(grid);
+    packed = PackGridToBits(grid, NULL);
     FreeGrid(grid);
     grid = UnpackBitsToGrid(packed);
     ShowGrid(grid);
@@ -24,3 +73,563 @@ int main(int argc, char *argv[])
     return(0);
 }
 
+/**************************************************************************
+*   Function   : CheckMergeEngines
+*   Description: Feeds the same random client packets to four client
+*                stores, and checks that the scalar, bit-sliced and
+*                vector merges and the running sum all publish the same
+*                grid after every tick.  Clients are key frames, deltas
+*                and flip lists of grids of mixed sizes, some change size
+*                or leave and come back, and each skips updates for 0 to
+*                TEST_MAX_AGE ticks at a time, so every age is merged.
+*                Runs without the screen, status lines go to stderr.
+*   Parameters : ticks - number of merges to compare
+*                clients - number of clients
+*                maxDim - largest rows or cols of a client's grid
+*                full - TRUE to start every grid with all cells 1, so
+*                       many clients add to the same cells
+*   Effects    : The result is printed to stdout.
+*   Returned   : TRUE if every merge matched, FALSE otherwise.
+**************************************************************************/
+int CheckMergeEngines(int ticks, int clients, int maxDim, int full)
+{
+    static const MERGE_ENGINE engines[TEST_ENGINES - 1] =
+        {MERGE_SCALAR, MERGE_BITSLICE, MERGE_VECTOR};
+    static const char *names[TEST_ENGINES] =
+        {"scalar", "bitslice", "vector", "running sum"};
+    CLIENT_STORE stores[TEST_ENGINES];
+    ACCUMULATOR running;
+    CLIENT_KEY *keys;
+    GRID **grids;
+    BYTE **sent;                /* Last frame sent, bit packed */
+    int *skips;                 /* Ticks left without an update */
+    struct sockaddr_in addr;
+    GRID merged[TEST_ENGINES - 1], *published;
+    FIXED_SUM *sums;
+    FLIP_LIST flips;
+    BYTE *packed, *delta, *packet;
+    int flipCells[16];
+    unsigned base;
+    int size, cellsSize, tick, client, engine, length, bad, i;
+
+    StartStatusLog(stderr);
+    InitCodec();
+    srand(1);
+
+    size = PackedBitsSize(maxDim, maxDim);
+    cellsSize = maxDim * PADDED_COLS(maxDim);
+    keys = (CLIENT_KEY *)malloc(clients * sizeof(CLIENT_KEY));
+    grids = (GRID **)malloc(clients * sizeof(GRID *));
+    sent = (BYTE **)malloc(clients * sizeof(BYTE *));
+    skips = (int *)malloc(clients * sizeof(int));
+    packed = (BYTE *)malloc(size);
+    delta = (BYTE *)malloc(size);
+    sums = (FIXED_SUM *)CountedAlignedMalloc(cellsSize * sizeof(FIXED_SUM));
+    flips.cells = flipCells;
+    flips.size = 16;            /* Small, so some flip lists overflow */
+
+    for (engine = 0; engine < TEST_ENGINES; engine++)
+    {
+        InitClientStore(&stores[engine]);
+    }
+
+    for (engine = 0; engine < TEST_ENGINES - 1; engine++)
+    {
+        merged[engine].cells = (char *)malloc(cellsSize);
+    }
+
+    InitAccumulator(&running);
+
+    for (client = 0; client < clients; client++)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x7F000001);
+        addr.sin_port = htons(5000 + client);
+        MakeClientKey(&keys[client], (struct sockaddr *)&addr, 0);
+        grids[client] = NULL;
+        sent[client] = (BYTE *)malloc(size);
+        skips[client] = 0;
+    }
+
+    bad = 0;
+
+    for (tick = 0; (tick < ticks) && !bad; tick++)
+    {
+        for (client = 0; client < clients; client++)
+        {
+            if (skips[client] > 0)
+            {
+                skips[client]--;
+                continue;
+            }
+
+            skips[client] = (rand() % 4) ? 0 : (rand() % (TEST_MAX_AGE + 1));
+
+            if ((grids[client] != NULL) && ((rand() % 50) == 0))
+            {
+                /* Leave, and come back later with a new grid */
+                for (engine = 0; engine < TEST_ENGINES; engine++)
+                {
+                    RemoveClient(&stores[engine], &keys[client],
+                        (engine == TEST_ENGINES - 1) ? &running : NULL);
+                }
+
+                FreeGrid(grids[client]);
+                grids[client] = NULL;
+                continue;
+            }
+
+            if ((grids[client] == NULL) || ((rand() % 40) == 0))
+            {
+                /* New grid, or a new size, starts with a key frame */
+                if (grids[client] != NULL)
+                {
+                    FreeGrid(grids[client]);
+                }
+
+                grids[client] = InitGrid(TEST_MIN_DIM +
+                    (rand() % (maxDim - TEST_MIN_DIM + 1)),
+                    TEST_MIN_DIM + (rand() % (maxDim - TEST_MIN_DIM + 1)));
+
+                if (full)
+                {
+                    memset(grids[client]->cells, '1',
+                        grids[client]->rows * grids[client]->cols);
+                }
+
+                grids[client]->sequenceNumber = tick + 1;
+                length = PackGridToBitsBuf(grids[client], sent[client],
+                    size);
+                packet = sent[client];
+            }
+            else
+            {
+                base = grids[client]->sequenceNumber;
+                MutateGrid(grids[client], FALSE, &flips);
+                grids[client]->sequenceNumber = tick + 1;
+                length = 0;
+                packet = delta;
+
+                if ((rand() % 3) == 0)
+                {
+                    length = PackFlipsToBuf(grids[client], &flips, base,
+                        delta, size);
+                }
+
+                if (length > 0)
+                {
+                    FlipPackedBits(sent[client], &flips,
+                        grids[client]->sequenceNumber);
+                }
+                else
+                {
+                    PackGridToBitsBuf(grids[client], packed, size);
+                    length = (rand() % 2) ?
+                        PackBitsToDelta(packed, sent[client], delta, size) :
+                        0;
+                    memcpy(sent[client], packed, size);
+                    packet = (length > 0) ? delta : sent[client];
+                    length = (length > 0) ? length :
+                        PackedBitsSize(grids[client]->rows,
+                        grids[client]->cols);
+                }
+            }
+
+            for (engine = 0; engine < TEST_ENGINES; engine++)
+            {
+                UpdateClient(&stores[engine], &keys[client], packet, length,
+                    (engine == TEST_ENGINES - 1) ? &running : NULL);
+            }
+        }
+
+        if (stores[0].count == 0)
+        {
+            continue;
+        }
+
+        for (engine = 0; engine < TEST_ENGINES - 1; engine++)
+        {
+            SetMergeEngine(engines[engine]);
+            MergeBuffersInto(&stores[engine], &merged[engine], sums,
+                cellsSize);
+        }
+
+        published = PublishAccumulator(&stores[TEST_ENGINES - 1], &running);
+
+        for (engine = 1; (engine < TEST_ENGINES) && !bad; engine++)
+        {
+            GRID *grid;
+
+            grid = (engine < TEST_ENGINES - 1) ? &merged[engine] : published;
+
+            if ((grid == NULL) || (grid->rows != merged[0].rows) ||
+                (grid->cols != merged[0].cols))
+            {
+                printf("Tick %d: %s merge is not %d by %d\n", tick,
+                    names[engine], merged[0].rows, merged[0].cols);
+                bad = TRUE;
+                break;
+            }
+
+            for (i = 0; i < grid->rows * grid->cols; i++)
+            {
+                if (grid->cells[i] != merged[0].cells[i])
+                {
+                    printf("Tick %d: %s cell %d is %c, scalar %c\n", tick,
+                        names[engine], i, grid->cells[i],
+                        merged[0].cells[i]);
+                    bad = TRUE;
+                    break;
+                }
+            }
+        }
+    }
+
+    DrainStatus();
+
+    for (engine = 0; engine < TEST_ENGINES; engine++)
+    {
+        FreeClientStore(&stores[engine]);
+    }
+
+    for (client = 0; client < clients; client++)
+    {
+        if (grids[client] != NULL)
+        {
+            FreeGrid(grids[client]);
+        }
+
+        free(sent[client]);
+    }
+
+    free(keys);
+    free(grids);
+    free(sent);
+    free(skips);
+
+    for (engine = 0; engine < TEST_ENGINES - 1; engine++)
+    {
+        free(merged[engine].cells);
+    }
+
+    FreeAccumulator(&running);
+    free(sums);
+    free(packed);
+    free(delta);
+
+    if (!bad)
+    {
+        printf("%d ticks of %d clients, %s, bitslice, vector and running "
+            "sum agree\n", ticks, clients, names[0]);
+    }
+
+    return(!bad);
+}
+
+/**************************************************************************
+*   Function   : CheckHostilePackets
+*   Description: Applies hand made delta and flip packets to the buffer of
+*                an 8 by 8 grid.  Varints that are too long, truncated, or
+*                whose counts run past the grid or the packet, or wrap when
+*                added, must be rejected with the buffer unchanged.  Well
+*                formed packets must still be applied.  Built with
+*                -fsanitize=address, any write outside the buffer is
+*                caught as well.
+*   Parameters : None
+*   Effects    : The result is printed to stdout.
+*   Returned   : TRUE if every packet was handled as expected.
+**************************************************************************/
+int CheckHostilePackets(void)
+{
+    static const TEST_PACKET tests[] =
+    {
+        /* unchanged 0xFFFFFFF8 and run 8 wrap to 0 when added, so the
+         * run would be written before the buffer, then the rest of the
+         * grid is skipped to make the packet look complete */
+        {PKT_DELTA, -1, 16, {0xF8, 0xFF, 0xFF, 0xFF, 0x0F, 0x08,
+            1, 2, 3, 4, 5, 6, 7, 8, 0x08, 0x00}},
+        /* run 0xFFFFFFFF */
+        {PKT_DELTA, -1, 7, {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 1}},
+        /* run past the end of the grid */
+        {PKT_DELTA, -1, 7, {0x04, 0x05, 1, 2, 3, 4, 5}},
+        /* run past the end of the packet */
+        {PKT_DELTA, -1, 5, {0x00, 0x08, 1, 2, 3}},
+        /* more than 32 bits */
+        {PKT_DELTA, -1, 6, {0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0x00}},
+        /* varint longer than 5 bytes */
+        {PKT_DELTA, -1, 7, {0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x00}},
+        /* varint cut off by the end of the packet */
+        {PKT_DELTA, -1, 1, {0x80}},
+        /* flip count larger than the grid */
+        {PKT_FLIPS, -1, 5, {0xFF, 0xFF, 0xFF, 0xFF, 0x0F}},
+        /* flip past the last cell */
+        {PKT_FLIPS, -1, 2, {0x01, 0x40}},
+        /* last cell, then one more */
+        {PKT_FLIPS, -1, 3, {0x02, 0x3F, 0x00}},
+        /* gap 0xFFFFFFFF wraps the cell back into the grid */
+        {PKT_FLIPS, -1, 7, {0x02, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F}},
+        /* well formed: XOR byte 2 with 0xFF */
+        {PKT_DELTA, 1, 5, {0x02, 0x01, 0xFF, 0x05, 0x00}},
+        /* well formed: toggle the first and last cells */
+        {PKT_FLIPS, 2, 3, {0x02, 0x00, 0x3E}}
+    };
+    GRID *grid;
+    GRID_BUF *buffer;
+    BYTE *key, packet[CELL_POS + 4 + TEST_PAYLOAD], before[8], first[8];
+    int test, result, bad, i;
+
+    StartStatusLog(stderr);
+    InitCodec();
+    srand(1);
+
+    grid = InitGrid(8, 8);
+    grid->sequenceNumber = 7;
+    key = PackGridToBits(grid, NULL);
+    memcpy(packet, key, CELL_POS);
+    buffer = UnpackBitsToBuffer(key);
+    memcpy(first, buffer->bits, sizeof(first));
+    bad = 0;
+
+    for (test = 0; test < (int)(sizeof(tests) / sizeof(tests[0])); test++)
+    {
+        packet[TYPE_POS].byte = tests[test].type;
+        PutBigEndian(packet, LEN_POS, 4, 4 + tests[test].length);
+        PutBigEndian(packet, BASE_POS, 4, buffer->sequenceNumber);
+
+        for (i = 0; i < tests[test].length; i++)
+        {
+            packet[DELTA_POS + i].byte = tests[test].payload[i];
+        }
+
+        memcpy(before, buffer->bits, sizeof(before));
+
+        if (tests[test].type == PKT_DELTA)
+        {
+            result = ApplyDeltaToBuffer(packet,
+                DELTA_POS + tests[test].length, buffer, NULL);
+        }
+        else
+        {
+            result = ApplyFlipsToBuffer(packet,
+                DELTA_POS + tests[test].length, buffer, NULL);
+        }
+
+        if (result != tests[test].expected)
+        {
+            printf("Packet %d: applied %d, expected %d\n", test, result,
+                tests[test].expected);
+            bad = TRUE;
+        }
+        else if ((result < 0) &&
+            memcmp(before, buffer->bits, sizeof(before)))
+        {
+            printf("Packet %d: rejected, but changed the buffer\n", test);
+            bad = TRUE;
+        }
+    }
+
+    /* The two good packets changed byte 2, the first and last cells */
+    if (!bad && ((buffer->bits[2].byte != (unsigned char)~first[2].byte) ||
+        (buffer->cells[0] != (grid->cells[0] == '0' ? FIXED_ONE : 0)) ||
+        (buffer->cells[7 * buffer->stride + 7] !=
+        (grid->cells[63] == '0' ? FIXED_ONE : 0))))
+    {
+        printf("Well formed packets were applied wrongly\n");
+        bad = TRUE;
+    }
+
+    DrainStatus();
+    FreeBuffer(buffer);
+    FreeGrid(grid);
+
+    if (!bad)
+    {
+        printf("%d hostile and well formed packets handled\n", test);
+    }
+
+    return(!bad);
+}
+
+/**************************************************************************
+*   Function   : CheckCodecKernels
+*   Description: Forces each cell packing kernel this CPU has in turn, and
+*                checks that it packs random grids to the same bytes as
+*                the scalar kernel, and unpacks them to the same cells.
+*                Grids have 1 to TEST_KERNEL_ROWS rows and 5 to
+*                TEST_KERNEL_COLS columns, so every kernel meets grids
+*                that end part way through its vectors and its bytes.
+*                Each grid is also sent as a key frame, a delta and a
+*                flip list, see CheckRoundTrips.
+*   Parameters : rounds - number of random grids of each size
+*   Effects    : The result is printed to stdout.
+*   Returned   : TRUE if every kernel agrees with the scalar kernel.
+**************************************************************************/
+int CheckCodecKernels(int rounds)
+{
+    static const CODEC_KERNEL kernels[TEST_KERNELS] =
+        {CODEC_SCALAR, CODEC_SWAR, CODEC_SSE2, CODEC_AVX2};
+    static const char *names[TEST_KERNELS] = {"scalar", "swar", "sse2",
+        "avx2"};
+    GRID *grid, unpacked;
+    BYTE *expected, *packed;
+    FLIP_LIST flips;
+    int flipCells[TEST_KERNEL_ROWS * TEST_KERNEL_COLS];
+    int size, kernel, rows, cols, round, checked, bad;
+
+    StartStatusLog(stderr);
+    InitCodec();
+    srand(1);
+
+    size = PackedBitsSize(TEST_KERNEL_ROWS, TEST_KERNEL_COLS);
+    expected = (BYTE *)malloc(size);
+    packed = (BYTE *)malloc(size);
+    unpacked.cells = (char *)malloc(TEST_KERNEL_ROWS * TEST_KERNEL_COLS);
+    flips.cells = flipCells;
+    flips.size = TEST_KERNEL_ROWS * TEST_KERNEL_COLS;
+    checked = 0;
+    bad = FALSE;
+
+    for (kernel = 0; (kernel < TEST_KERNELS) && !bad; kernel++)
+    {
+        if (!SetCodecKernel(kernels[kernel]))
+        {
+            printf("No %s kernel on this CPU\n", names[kernel]);
+            continue;
+        }
+
+        for (rows = 1; (rows <= TEST_KERNEL_ROWS) && !bad; rows++)
+        {
+            for (cols = 5; (cols <= TEST_KERNEL_COLS) && !bad; cols++)
+            {
+                for (round = 0; (round < rounds) && !bad; round++)
+                {
+                    grid = InitGrid(rows, cols);
+                    SetCodecKernel(CODEC_SCALAR);
+                    PackGridToBitsBuf(grid, expected, size);
+                    SetCodecKernel(kernels[kernel]);
+                    PackGridToBitsBuf(grid, packed, size);
+
+                    if (memcmp(&expected[CELL_POS], &packed[CELL_POS],
+                        (rows * cols + 7) / 8))
+                    {
+                        printf("%s packs %d by %d differently\n",
+                            names[kernel], rows, cols);
+                        bad = TRUE;
+                    }
+                    else if (!UnpackBitsIntoGrid(packed, size, &unpacked,
+                        TEST_KERNEL_ROWS * TEST_KERNEL_COLS) ||
+                        memcmp(unpacked.cells, grid->cells, rows * cols))
+                    {
+                        printf("%s unpacks %d by %d differently\n",
+                            names[kernel], rows, cols);
+                        bad = TRUE;
+                    }
+                    else if (!CheckRoundTrips(grid, &flips))
+                    {
+                        printf("%s %d by %d round trip failed\n",
+                            names[kernel], rows, cols);
+                        bad = TRUE;
+                    }
+
+                    FreeGrid(grid);
+                    checked++;
+                }
+            }
+        }
+    }
+
+    DrainStatus();
+    free(expected);
+    free(packed);
+    free(unpacked.cells);
+
+    if (!bad)
+    {
+        printf("%d grids packed and sent the same by every kernel\n",
+            checked);
+    }
+
+    return(!bad);
+}
+
+/**************************************************************************
+*   Function   : CheckRoundTrips
+*   Description: Sends a grid to a proxy buffer as a key frame, then
+*                mutates it and sends it as a delta, then mutates it
+*                again and sends it as a flip list.  After each, the
+*                buffer must hold the grid's packed bits and cells.
+*   Parameters : grid - grid to send, at least 5 cells
+*                flips - flip list with room for every cell
+*   Effects    : grid is mutated twice.
+*   Returned   : TRUE if the buffer matched the grid after every packet.
+**************************************************************************/
+int CheckRoundTrips(GRID *grid, FLIP_LIST *flips)
+{
+    GRID_BUF *buffer;
+    BYTE *sent, *packed, *delta;
+    unsigned base;
+    int size, deltaSize, length, numCells, step, good, row, col;
+
+    numCells = grid->rows * grid->cols;
+    size = PackedBitsSize(grid->rows, grid->cols);
+    deltaSize = 4 * size;       /* Room for a run or a flip in every byte */
+    sent = (BYTE *)malloc(size);
+    packed = (BYTE *)malloc(size);
+    delta = (BYTE *)malloc(deltaSize);
+    grid->sequenceNumber = 1;
+    PackGridToBitsBuf(grid, sent, size);
+    buffer = UnpackBitsToBuffer(PackGridToBits(grid, NULL));
+    good = (buffer != NULL);
+
+    for (step = 0; (step < 3) && good; step++)
+    {
+        base = grid->sequenceNumber;
+
+        if (step == 1)
+        {
+            MutateGrid(grid, FALSE, NULL);
+            grid->sequenceNumber++;
+            PackGridToBitsBuf(grid, packed, size);
+            length = PackBitsToDelta(packed, sent, delta, deltaSize);
+            good = (length > 0) &&
+                (ApplyDeltaToBuffer(delta, length, buffer, NULL) >= 0);
+        }
+        else if (step == 2)
+        {
+            MutateGrid(grid, FALSE, flips);
+            grid->sequenceNumber++;
+            length = PackFlipsToBuf(grid, flips, base, delta, deltaSize);
+            good = (length > 0) &&
+                (ApplyFlipsToBuffer(delta, length, buffer, NULL) >= 0);
+        }
+
+        PackGridToBitsBuf(grid, sent, size);
+        good = good && !memcmp(buffer->bits, &sent[CELL_POS],
+            (numCells + 7) / 8);
+
+        for (row = 0; (row < grid->rows) && good; row++)
+        {
+            for (col = 0; col < grid->cols; col++)
+            {
+                if (buffer->cells[row * buffer->stride + col] !=
+                    ((grid->cells[row * grid->cols + col] == '1') ?
+                    FIXED_ONE : 0))
+                {
+                    good = FALSE;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (buffer != NULL)
+    {
+        FreeBuffer(buffer);
+    }
+
+    free(sent);
+    free(packed);
+    free(delta);
+    return(good);
+}
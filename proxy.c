@@ -17,6 +17,7 @@
 /**************************************************************************
 *                                Inclued Files
 **************************************************************************/
+#define _GNU_SOURCE             /* recvmmsg, where the C library has it */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stropts.h>
@@ -25,19 +26,365 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
 #include <strings.h>
+#include <pthread.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
 #include "utils.h"
 
 /**************************************************************************
 *                                 Definitions
 **************************************************************************/
+#ifdef MSG_WAITFORONE
+#define BATCH_RECEIVE           /* Receive datagrams with recvmmsg */
+#define BATCH_SEND              /* Send datagrams with sendmmsg */
+#endif
+
+#ifdef __linux__
+#define TIMER_CLOCK             /* Mix on a timerfd instead of ticks */
+#define RECEIVE_WORKERS         /* Shard clients over receive threads */
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define URING_RECEIVE           /* Receive with io_uring, if asked to */
+#endif
+
+#define DEFAULT_PERIOD  2000000 /* Microseconds between mixes */
+
+#define RECV_BATCH      32      /* Most datagrams taken by one receive */
+#define MAX_WORKERS     64      /* Most receive threads */
+
+#define QUEUE_SLOTS     256     /* Datagrams the receive thread may queue */
+                                /* ahead of the mixer, a power of 2 */
+#define CACHE_LINE      64      /* Bytes kept between producer and */
+                                /* consumer fields of a queue */
+
+#define SEND_BATCH      1024    /* Most datagrams sent by one sendmmsg */
+#define OUTPUT_DATAGRAM 1472    /* Largest datagram sent to subscribers, */
+                                /* so an Ethernet MTU needs no IP */
+                                /* fragments */
+#define MIN_SUBSCRIBERS 16      /* Subscriber addresses first allocated */
+#define MAX_SUBSCRIBERS 1024    /* Most addresses sent mixes, tiles or */
+                                /* levels */
+#define COOKIE_PERIOD   64      /* Seconds each cookie secret is used */
+#define TILE_SIZE       32      /* Rows and columns of an output tile */
+#define TILE_BYTES      (TILE_CELL_POS + (((TILE_SIZE * TILE_SIZE) + 1) / 2))
+
+#define URING_ENTRIES   4       /* Submission queue entries */
+#define URING_BUFFERS   256     /* Provided receive buffers, a power of 2 */
+#define URING_GROUP     0       /* Buffer group of the receive buffers */
+
+typedef struct          /* Preallocated buffers for a batch of datagrams */
+{
+    BYTE packets[RECV_BATCH][MAX_DATAGRAM / sizeof(BYTE)];
+    struct sockaddr_storage addrs[RECV_BATCH];  /* Client addresses */
+    int sizes[RECV_BATCH];                      /* Bytes in each packet */
+#ifdef BATCH_RECEIVE
+    struct iovec iovecs[RECV_BATCH];            /* One for each packet */
+    struct mmsghdr msgs[RECV_BATCH];            /* recvmmsg requests */
+#endif
+    unsigned long calls;                        /* Receive calls made */
+    unsigned long received;                     /* Datagrams they returned */
+} RECV_RING;
+
+typedef struct          /* Clients and merge space kept between mixes */
+{
+    CLIENT_STORE store;         /* Client grid buffers */
+    ACCUMULATOR accumulator;    /* Running sum of client cells */
+    GRID merged;                /* Merged grid, reused each mix */
+    FIXED_SUM *sums;            /* Merge scratch, reused each mix */
+    int mergedSize;             /* Cells allocated for merging */
+    int sequenceNumber;         /* Sequence number of last grid shown */
+    RECV_RING *ring;            /* Ring the clients are received into */
+} MIXER;
+
+typedef struct          /* Datagram waiting for the mixer thread */
+{
+    BYTE packet[MAX_DATAGRAM / sizeof(BYTE)];
+    struct sockaddr_storage addr;   /* Client address */
+    int size;                       /* Bytes in packet */
+    int kind;                       /* As returned by ValidateHeader */
+} QUEUE_SLOT;
+
+/* Lock-free queue with one producer, the receive thread, and one consumer,
+ * the mixer thread.  head is only written by the producer and tail by the
+ * consumer, on separate cache lines.  The doorbell is only rung when the
+ * consumer has said it is going to sleep, so a busy mixer costs the
+ * receiver no system calls. */
+typedef struct
+{
+    QUEUE_SLOT *slots;          /* QUEUE_SLOTS preallocated datagrams */
+    unsigned int head;          /* Slots ever filled */
+    unsigned int deepest;       /* Most slots in use at once */
+    unsigned long overflows;    /* Datagrams dropped with the queue full */
+    unsigned long rejected;     /* Datagrams dropped for bad headers */
+    char pad[CACHE_LINE];
+    unsigned int tail;          /* Slots ever drained */
+    int waiting;                /* Consumer is asleep on the doorbell */
+    int doorbell[2];            /* Pipe the producer writes to wake it */
+} PACKET_QUEUE;
+
+#ifdef URING_RECEIVE
+/* io_uring with one multishot recvmsg on the socket.  The kernel picks a
+ * buffer from a ring of provided buffers for each datagram, and posts a
+ * completion without the proxy making a system call.  Each buffer holds
+ * a struct io_uring_recvmsg_out, the client address and the datagram. */
+typedef struct
+{
+    int fd;                     /* From io_uring_setup, -1 if none */
+    unsigned char *rings;       /* Submission and completion rings */
+    size_t ringsSize;
+    struct io_uring_sqe *sqes;  /* Submission queue entries */
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;  /* Completion queue entries */
+    struct io_uring_buf_ring *bufRing;  /* Provided buffers */
+    unsigned short bufTail;     /* Provided buffers ever added */
+    BYTE *buffers;              /* URING_BUFFERS of bufferSize bytes */
+    size_t bufferSize;
+    struct msghdr msg;          /* Address and control lengths to use */
+} URING;
+#endif
+
+typedef struct          /* Rectangle of the mix a subscriber wants */
+{
+    int row, col;               /* First cell */
+    int rows, cols;             /* Size */
+} REGION;
+
+typedef struct          /* Subscriber sent only the tiles it wants */
+{
+    struct sockaddr_in addr;    /* Where its tiles are sent */
+    REGION regions[MAX_REGIONS];
+    int count;                  /* Rectangles in regions */
+    int fresh;                  /* Send every tile it wants, not only */
+                                /* those that changed */
+} REGION_SUBSCRIBER;
+
+typedef struct          /* Packet cut to fit OUTPUT_DATAGRAM */
+{
+    BYTE *fragments;            /* Packet cut into fragments */
+    struct iovec *datagrams;    /* Packet, or each of its fragments */
+    int fragmentsSize;          /* Fragments allocated */
+} DATAGRAMS;
+
+typedef struct          /* Subscriber to a reduced mix */
+{
+    struct sockaddr_in addr;    /* Where the level is sent */
+    int level;                  /* Halvings, 1 to MAX_LEVEL */
+} LEVEL_SUBSCRIBER;
+
+typedef struct          /* One level of the pyramid of reduced mixes */
+{
+    GRID grid;                  /* Each cell the mean of 2 x 2 below */
+    int cellsSize;              /* Bytes allocated for grid.cells */
+    char *dirty;                /* TRUE for cells in list */
+    int *list;                  /* Cells to reduce again */
+    int listCount;              /* Cells in list */
+    BYTE *packed;               /* Level packed in nibbles */
+    int packedSize;             /* Bytes allocated for packed */
+    DATAGRAMS cut;              /* packed, ready to send */
+    int count;                  /* Datagrams in cut this mix, 0 if none */
+} LEVEL;
+
+/* Where mixed grids are sent.  The mix is packed in nibbles and cut
+ * into fragments once, and every subscriber is sent the same datagrams,
+ * so only the sends grow with the number of subscribers.  With deltas
+ * on, most mixes are sent as their changes from the mix before. */
+typedef struct
+{
+    struct sockaddr_in *subscribers;    /* Unicast subscriber addresses */
+    int count;                  /* Subscribers */
+    int size;                   /* Subscriber addresses allocated */
+    struct sockaddr_in group;   /* Multicast group, sin_port 0 if none */
+    BYTE *packed;               /* Nibble packed mix, reused each mix */
+    BYTE *reference;            /* Last mix published, packed the same */
+    BYTE *delta;                /* packed coded against reference */
+    int packedSize;             /* Bytes allocated for each of the three */
+    int keyInterval;            /* Mixes per full mix, 0 for no deltas */
+    int sinceKey;               /* Mixes published since the last full one */
+    int forceKey;               /* Next mix goes out full */
+    DATAGRAMS mix;              /* Full mix or delta, ready to send */
+    unsigned frameID;           /* Id of the last fragmented packet */
+    unsigned long sent;         /* Datagrams sent */
+    unsigned long failed;       /* Datagrams the socket would not take */
+    unsigned long keys;         /* Mixes published in full */
+    unsigned long deltas;       /* Mixes published as deltas */
+    REGION_SUBSCRIBER *regionSubs;  /* Subscribers to rectangles */
+    int regionCount;            /* Subscribers to rectangles */
+    int regionSize;             /* Subscribers to rectangles allocated */
+    BYTE *tiles;                /* Each tile of the mix, TILE_BYTES apart */
+    struct iovec *tileDatagrams;    /* Each tile's packet */
+    char *changed;              /* TRUE for tiles unlike the last mix's */
+    unsigned *marks;            /* Last mark each tile was queued under */
+    unsigned mark;              /* Changes for each region subscriber */
+    int tilesDown, tilesAcross; /* Tiles in the mix */
+    int tilesSize;              /* Tiles allocated */
+    int tiledRows, tiledCols;   /* Size of the mix the tiles are from */
+    BYTE scratch[TILE_BYTES];   /* Tile being packed */
+    LEVEL_SUBSCRIBER *levelSubs;    /* Subscribers to reduced mixes */
+    int levelCount;             /* Subscribers to reduced mixes */
+    int levelSize;              /* Subscribers to levels allocated */
+    LEVEL levels[MAX_LEVEL + 1];    /* levels[0] is unused, it is the mix */
+    char *previous;             /* Mix cells the pyramid was reduced from */
+    int previousSize;           /* Bytes allocated for previous */
+    int pyramidRows, pyramidCols;   /* Size of that mix, 0 if none */
+#ifdef BATCH_SEND
+    struct mmsghdr msgs[SEND_BATCH];    /* sendmmsg requests */
+#else
+    struct msghdr msgs[SEND_BATCH];     /* sendmsg requests */
+#endif
+} OUTPUT;
+
+#ifdef BATCH_SEND
+#define OUTPUT_MSG(out, i)      ((out)->msgs[i].msg_hdr)
+#else
+#define OUTPUT_MSG(out, i)      ((out)->msgs[i])
+#endif
+
+typedef int (*DGRAM_HANDLER)(   /* Handles one kind of datagram */
+    MIXER *mixer, BYTE *packet, int size, struct sockaddr *cliAddr,
+    int ticks);
+
+#ifdef RECEIVE_WORKERS
+typedef struct          /* Receive thread with its own shard of clients */
+{
+    pthread_t thread;
+    int socketFD;               /* SO_REUSEPORT socket of this worker */
+    int wakeFD;                 /* eventfd rung when a mix is due */
+    int pollFD;                 /* epoll set of socketFD and wakeFD */
+    RECV_RING *ring;            /* Batch of whole datagrams */
+    MIXER mixer;                /* This worker's shard of the clients */
+    GRID *partial;              /* Last partial sum, NULL if none */
+    int ended;                  /* An end left this shard empty */
+} WORKER;
+#endif
 
 /**************************************************************************
 *                           Function Prototypes
 **************************************************************************/
 void InitSocket(void);          /* Make UDP connection */
 void DoReceive(void);           /* Receive and display data */
+int HandleDatagram(MIXER *mixer,    /* Update clients with datagram */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int kind,
+    int ticks);
+int HandleBad(MIXER *mixer,     /* Report a malformed datagram */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleGrid(MIXER *mixer,    /* Update client's grid */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleJoin(MIXER *mixer,    /* Add a client */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleLeave(MIXER *mixer,   /* Remove a client */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleTick(MIXER *mixer,    /* Mix if mixing on ticks */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleSubscribe(MIXER *mixer,   /* Add a subscriber */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleUnsubscribe(MIXER *mixer, /* Remove a subscriber */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleRegion(MIXER *mixer,  /* Subscribe to rectangles */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+int HandleLevel(MIXER *mixer,   /* Subscribe to a reduced mix */
+    BYTE *packet, int size, struct sockaddr *cliAddr, int ticks);
+void InitMixer(MIXER *mixer);   /* Start with no clients */
+void FreeMixer(MIXER *mixer);   /* Free clients and merge space */
+int GrowMergeSpace(MIXER *mixer, int numCells); /* Make room to merge */
+void InitRing(RECV_RING *ring); /* Point receive requests at buffers */
+int ReceiveBatch(int fd,        /* Receive waiting datagrams */
+    RECV_RING *ring);
+void MixClients(MIXER *mixer);  /* Merge and show client grids */
+void ShowMix(GRID *shown,       /* Show merged grid and statistics */
+    const char *engine, unsigned long calls, unsigned long received);
+int InitClock(struct timespec *deadline);   /* Start mixing clock */
+int ClockFired(int clockFD,                 /* Check clock, note lateness */
+    struct timespec *deadline);
+void AddUsecs(struct timespec *time, long long usecs);
+void *ReceiveThread(void *arg); /* Receive and queue datagrams */
+void QueueDatagram(BYTE *packet,    /* Check datagram and queue it */
+    int size, struct sockaddr_storage *addr);
+int InitQueue(PACKET_QUEUE *q); /* Allocate slots and doorbell */
+void FreeQueue(PACKET_QUEUE *q);    /* Free slots and doorbell */
+int Enqueue(PACKET_QUEUE *q,    /* Copy datagram into next free slot */
+    BYTE *packet, int size, struct sockaddr_storage *addr, int kind);
+void RingDoorbell(PACKET_QUEUE *q); /* Wake consumer if it is asleep */
+int QueueIdle(PACKET_QUEUE *q); /* Nothing queued, consumer may sleep */
+QUEUE_SLOT *PeekQueue(PACKET_QUEUE *q); /* Oldest queued datagram */
+void ReleaseQueue(PACKET_QUEUE *q); /* Free oldest queued datagram */
+#ifdef URING_RECEIVE
+int InitUring(URING *u);        /* Set up ring and provided buffers */
+void FreeUring(URING *u);       /* Tear down ring */
+int ArmUring(URING *u);         /* Submit the multishot recvmsg */
+void ProvideBuffer(URING *u, int id);   /* Hand a buffer to the kernel */
+void ReceiveUring(URING *u,     /* Queue datagrams as they complete */
+    RECV_RING *ring);
+#endif
+void InitCookies(void);         /* Pick the cookie secret */
+unsigned MakeCookie(struct sockaddr_in *addr,   /* Cookie for address */
+    unsigned epoch);
+int CheckCookie(BYTE *packet,   /* Check cookie, send one if it's bad */
+    struct sockaddr_in *addr);
+int CountSubscribers(OUTPUT *out);  /* Addresses sent any output */
+int FindSubscriber(OUTPUT *out,     /* Index of subscriber, or -1 */
+    struct sockaddr_in *addr);
+int AddSubscriber(OUTPUT *out,  /* Send mixes to an address */
+    struct sockaddr_in *addr);
+void RemoveSubscriber(OUTPUT *out,  /* Stop sending mixes to an address */
+    struct sockaddr_in *addr);
+void FreeOutput(OUTPUT *out);   /* Free subscribers and packed mix */
+void PublishMix(OUTPUT *out,    /* Send mixed grid to subscribers */
+    GRID *shown);
+int PackOutput(OUTPUT *out,     /* Pack and fragment mixed grid */
+    GRID *shown);
+BYTE *ChooseOutput(OUTPUT *out, /* Full mix or delta, whichever is due */
+    int *size);
+int SetRegions(OUTPUT *out,     /* Send tiles in rectangles to address */
+    struct sockaddr_in *addr, BYTE *packet, int size);
+void RemoveRegions(OUTPUT *out, /* Stop sending tiles to an address */
+    struct sockaddr_in *addr);
+int PackTiles(OUTPUT *out,      /* Pack each tile and note changes */
+    GRID *shown);
+int QueueTiles(OUTPUT *out,     /* Add wanted tiles to a send batch */
+    int batched);
+int CutDatagrams(OUTPUT *out,   /* Fragment a packet if it is too big */
+    BYTE *packet, int size, DATAGRAMS *cut);
+void FreeDatagrams(DATAGRAMS *cut); /* Free fragments */
+int SetLevel(OUTPUT *out,       /* Send a reduced mix to an address */
+    struct sockaddr_in *addr, int level);
+void RemoveLevel(OUTPUT *out,   /* Stop sending reduced mixes */
+    struct sockaddr_in *addr);
+int BuildPyramid(OUTPUT *out,   /* Reduce every cell of every level */
+    GRID *shown);
+void UpdatePyramid(OUTPUT *out, /* Reduce the cells that changed */
+    GRID *shown);
+void MarkDirty(LEVEL *level,    /* Queue a cell to be reduced again */
+    int row, int col);
+int QueueLevels(OUTPUT *out,    /* Add reduced mixes to a send batch */
+    int batched);
+void SendOutput(OUTPUT *out,    /* Send batch of output datagrams */
+    int batched);
+void DoSharded(void);           /* Receive and mix with worker threads */
+#ifdef RECEIVE_WORKERS
+void *ReceiveWorker(void *arg); /* Body of a receive thread */
+GRID *PartialSum(MIXER *mixer); /* Sum one shard for a mix */
+GRID *ReduceShards(WORKER *list,    /* Add up the partial sums */
+    MIXER *total);
+void PinThread(pthread_t thread, int core); /* Keep thread on a core */
+#endif
 
 /**************************************************************************
 *                               Global Variables
@@ -45,7 +392,53 @@ void DoReceive(void);           /* Receive and display data */
 GRID *grid;                     /* Pointer to the cell grid */
 int port;                       /* The port on the proxy side */
 int socketFD;                   /* Socket number returned by socket */
+int socketFDs[MAX_WORKERS];     /* One SO_REUSEPORT socket per worker */
 struct sockaddr_in servAddr;    /* Server Address */
+int running = TRUE;             /* Keep a running sum instead of merging */
+int batch = RECV_BATCH;         /* Most datagrams taken by one receive */
+long period = DEFAULT_PERIOD;   /* usecs between mixes, 0 to mix on ticks */
+int workers = 1;                /* Receive threads, each with a shard */
+int firstCore = -1;             /* Core for the first thread, -1 for any */
+long mixLate = -1;              /* usecs last mix ran after its deadline, */
+                                /* -1 when mixing on ticks */
+long worstLate = 0;             /* most usecs any mix has been late */
+unsigned long missedMixes = 0;  /* deadlines passed without a mix */
+PACKET_QUEUE queue;             /* Receive thread to mixer thread */
+int queued = FALSE;             /* Datagrams go through queue */
+int useUring = FALSE;           /* Receive with io_uring if supported */
+OUTPUT output;                  /* Subscribers to mixed grids */
+unsigned long long cookieSecret[2]; /* Key of subscription cookies */
+pthread_mutex_t outputLock =    /* Held to change or publish to output */
+    PTHREAD_MUTEX_INITIALIZER;
+FILE *logFile = NULL;           /* Status lines go here, with no screen */
+const char *receiveName = "recvfrom";   /* How datagrams are received */
+#ifdef URING_RECEIVE
+URING uring;                    /* Used by the receive thread */
+#endif
+
+/* Datagram handlers, indexed by the type ValidateHeader returns */
+const DGRAM_HANDLER handlers[PKT_TYPES] =
+{
+    HandleBad,                  /* 0, malformed */
+    HandleGrid,                 /* PKT_KEY */
+    HandleGrid,                 /* PKT_DELTA */
+    HandleBad,                  /* PKT_NIBBLES, only sent by the proxy */
+    HandleGrid,                 /* PKT_FLIPS */
+    HandleGrid,                 /* PKT_FRAGMENT */
+    HandleJoin,                 /* PKT_JOIN */
+    HandleLeave,                /* PKT_LEAVE */
+    HandleTick,                 /* PKT_TICK */
+    HandleSubscribe,            /* PKT_SUBSCRIBE */
+    HandleUnsubscribe,          /* PKT_UNSUBSCRIBE */
+    HandleRegion,               /* PKT_REGION */
+    HandleBad,                  /* PKT_TILE, only sent by the proxy */
+    HandleLevel,                /* PKT_LEVEL */
+    HandleBad                   /* PKT_COOKIE, only sent by the proxy */
+};
+#ifdef RECEIVE_WORKERS
+pthread_barrier_t mixBarrier;   /* Workers and mixer meet twice a mix */
+int stopping = FALSE;           /* Workers exit after this mix */
+#endif
 
 /**************************************************************************
 *                                  Functions
@@ -55,30 +448,189 @@ struct sockaddr_in servAddr;    /* Server Address */
 *   Function   : main
 *   Description: Entry point for proxy program, initializes data, curses,
 *                and UDP socket.
-*   Parameters : None
+*   Parameters : [-m running|scalar|bitslice|vector] [-b batch]
+*                [-t usecs] [-w workers] [-p core] [-u]
+*                [-g group:port] [-d mixes] [-l file] port
+*                -m chooses the merge engine.  By default a running sum
+*                is kept as clients update, instead of merging every
+*                client on every tick.
+*                -b sets the most datagrams taken by one receive call,
+*                from 1 to RECV_BATCH.  1 receives one at a time.
+*                -t sets the microseconds between mixes of the proxy's
+*                own clock.  0 turns the clock off, and the proxy mixes
+*                whenever a tick packet arrives instead.
+*                -w sets the number of receive threads, from 1 to
+*                MAX_WORKERS.  Each has its own socket on the port, and
+*                its own shard of the clients.  More than 1 needs the
+*                clock, and a running sum or the vector engine.
+*                -p pins the threads to cores, the first worker to core,
+*                the next to core + 1, and so on, and the mixer after
+*                them.
+*                -u receives with an io_uring multishot recvmsg instead
+*                of recvmmsg, on a single worker.  Kernels without it
+*                fall back to recvmmsg.
+*                -g sends every mix to an IPv4 multicast group, as well
+*                as to the clients that subscribe.
+*                -d sends mixes as deltas from the mix before, with a
+*                full mix every mixes mixes, and whenever a client
+*                subscribes, so late joiners can sync.
+*                -l runs without a screen, and appends status lines to
+*                file instead.  Either way, status lines are queued by
+*                the threads that report them, and written once a mix.
 *   Effects    : Everything is initialized
 *   Returned   : None
 **************************************************************************/
 int main(int argc, char *argv[])
 {
+    char group[64];             /* Multicast group address */
+    MERGE_ENGINE engine;        /* Engine chosen by -m */
+    int opt, groupPort;
+
+    engine = MERGE_VECTOR;
+
+    bzero(&output, sizeof(output));
+
+    while ((opt = getopt(argc, argv, "m:b:t:w:p:ug:d:l:")) != -1)
+    {
+        if ((opt == 'm') && !strcmp(optarg, "running"))
+        {
+            running = TRUE;
+        }
+        else if ((opt == 'm') && !strcmp(optarg, "scalar"))
+        {
+            engine = MERGE_SCALAR;
+            running = FALSE;
+        }
+        else if ((opt == 'm') && !strcmp(optarg, "bitslice"))
+        {
+            engine = MERGE_BITSLICE;
+            running = FALSE;
+        }
+        else if ((opt == 'm') && !strcmp(optarg, "vector"))
+        {
+            engine = MERGE_VECTOR;
+            running = FALSE;
+        }
+        else if ((opt == 'b') && (sscanf(optarg, "%d", &batch) == 1) &&
+            (batch >= 1) && (batch <= RECV_BATCH))
+        {
+            continue;
+        }
+        else if ((opt == 't') && (sscanf(optarg, "%ld", &period) == 1) &&
+            (period >= 0))
+        {
+            continue;
+        }
+        else if ((opt == 'w') && (sscanf(optarg, "%d", &workers) == 1) &&
+            (workers >= 1) && (workers <= MAX_WORKERS))
+        {
+            continue;
+        }
+        else if ((opt == 'p') && (sscanf(optarg, "%d", &firstCore) == 1) &&
+            (firstCore >= 0))
+        {
+            continue;
+        }
+        else if (opt == 'u')
+        {
+            useUring = TRUE;
+        }
+        else if ((opt == 'g') &&
+            (sscanf(optarg, "%63[^:]:%d", group, &groupPort) == 2) &&
+            (inet_pton(AF_INET, group, &output.group.sin_addr) == 1) &&
+            IN_MULTICAST(ntohl(output.group.sin_addr.s_addr)) &&
+            (groupPort > 0) && (groupPort <= 65535))
+        {
+            output.group.sin_family = AF_INET;
+            output.group.sin_port = htons(groupPort);
+        }
+        else if ((opt == 'd') &&
+            (sscanf(optarg, "%d", &output.keyInterval) == 1) &&
+            (output.keyInterval >= 1))
+        {
+            continue;
+        }
+        else if ((opt == 'l') && (logFile == NULL) &&
+            ((logFile = fopen(optarg, "a")) != NULL))
+        {
+            continue;
+        }
+        else
+        {
+            optind = argc;      /* force syntax message */
+            break;
+        }
+    }
+
     /* Check for correct number of arguements */
-    if (argc != 2)
+    if (argc - optind != 1)
+    {
+        fprintf(stderr,
+            "Syntax: %s [-m running|scalar|bitslice|vector] [-b batch] "
+            "[-t usecs] [-w workers] [-p core] [-u] [-g group:port] "
+            "[-d mixes] [-l file] port\n",
+            argv[0]);
+        return(1);
+    }
+
+#ifdef RECEIVE_WORKERS
+    if ((workers > 1) && (period == 0))
+#else
+    if (workers > 1)
+#endif
+    {
+        fprintf(stderr, "Receive workers need the proxy's clock\n");
+        return(1);
+    }
+
+    if (useUring && (workers > 1))
+    {
+        fprintf(stderr, "io_uring receives need a single worker\n");
+        return(1);
+    }
+
+    if (!running && (engine != MERGE_VECTOR) && (workers > 1))
     {
-        fprintf(stderr, "Syntax: %s port\n", argv[0]);
+        fprintf(stderr, "Receive workers merge with vector or running\n");
         return(1);
     }
 
+    SetMergeEngine(engine);
+
     /* Get proxy server parameters */
-    sscanf(argv[1], "%d", &port);
+    sscanf(argv[optind], "%d", &port);
 
     /* Connect to proxy service */
     InitSocket();
+    InitCookies();
+
+    /* Select grid unpacking kernels for this CPU */
+    InitCodec();
+
+    /* Initialize proxy's screen, status lines wait for the next mix */
+    StartStatusLog(logFile);
 
-    /* Initialize proxy's screen */
-    InitScreen();
+    if (logFile == NULL)
+    {
+        InitScreen();
+    }
 
     /* Go into infinite loop reading port */
-    DoReceive();
+    if (workers > 1)
+    {
+        DoSharded();
+    }
+    else
+    {
+        DoReceive();
+    }
+
+    FreeOutput(&output);
+
+    if (logFile != NULL)
+    {
+        fclose(logFile);
+    }
 
     return(0);
 }
@@ -87,109 +639,3029 @@ int main(int argc, char *argv[])
 *   Function   : InitSocket
 *   Description: This function is called to open and bind to the socket
 *                used for the mixer service.  The socket number opened will
-*                be stored in the global variable socketFD.
+*                be stored in the global variable socketFD.  With more than
+*                one worker, each gets its own socket bound to the port
+*                with SO_REUSEPORT, and the kernel spreads the clients over
+*                them, keeping each client on one socket.
 *   Parameters : None
-*   Effects    : A socket is opened and bound the socket number is
-*                stored in socketFD.
+*   Effects    : A socket is opened and bound for each worker, and the
+*                socket numbers are stored in socketFDs.  socketFD is the
+*                first of them.
 *   Returned   : None
 **************************************************************************/
 void InitSocket(void)
 {
-    /* Open the socket */
-    socketFD = socket(AF_INET, SOCK_DGRAM, 0);
-
-    if (socketFD == -1)
-    {
-        perror("Bad socket fd\n");
-        exit(1);
-    }
+    int i, reuse = 1;
 
     bzero(&servAddr, sizeof(servAddr));
     servAddr.sin_family = AF_INET;
     servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servAddr.sin_port = htons(port);
 
-    if(bind(socketFD, (struct sockaddr *)&servAddr, sizeof(servAddr)) != 0)
+    for (i = 0; i < workers; i++)
     {
-        perror("Bind failed");
-        exit(1);
+        /* Open the socket */
+        socketFDs[i] = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (socketFDs[i] == -1)
+        {
+            perror("Bad socket fd\n");
+            exit(1);
+        }
+
+#ifdef SO_REUSEPORT
+        if ((workers > 1) && (setsockopt(socketFDs[i], SOL_SOCKET,
+            SO_REUSEPORT, &reuse, sizeof(reuse)) != 0))
+        {
+            perror("SO_REUSEPORT failed");
+            exit(1);
+        }
+#endif
+
+        if (bind(socketFDs[i], (struct sockaddr *)&servAddr,
+            sizeof(servAddr)) != 0)
+        {
+            perror("Bind failed");
+            exit(1);
+        }
     }
+
+    socketFD = socketFDs[0];
 }
 
 /**************************************************************************
 *   Function   : DoReceive
-*   Description: This function will receive packed grids and timer ticks
-*                on a bound socket (socketFD).  On a tick, the mixing
-*                will take place.  On the receipt of a grid, the list
-*                will be updated.
+*   Description: This function will receive packed grids on a bound socket
+*                (socketFD), and mix them each time the proxy's clock
+*                fires.  Receiving is done by a thread of its own, which
+*                only receives, classifies and queues datagrams, so a slow
+*                terminal can not hold up the socket.  This thread owns
+*                the clients, and drains the queue and mixes.  It sleeps
+*                in poll on the queue's doorbell and the clock, a timerfd,
+*                only when the queue is empty.  Without a clock, the
+*                mixing takes place when a tick packet is dequeued.
+*                On the receipt of a grid, the client store will be
+*                updated.  With a running sum, the mixing is done as grids
+*                are received, and a mix just ages the clients that did
+*                not send one and shows the sum.
 *   Parameters : None
-*   Effects    : Grid list is updated and grids are mixed.
+*   Effects    : Client store is updated and grids are mixed.
 *   Returned   : None
 **************************************************************************/
 void DoReceive(void)
 {
-    BYTE *bytes;
-    char packet[1024];
-    struct sockaddr_in cliAddr;         /* Client Address */
-    int length;
-    GRID *grid;				/* Pointer to grid */
-    int sequenceNumber = 0;
-    BUF_LIST *list = NULL;              /* Pointer to client grid */
-                                        /* buffer list */
-    length = sizeof(cliAddr);
+    static RECV_RING ring;              /* Batch of whole datagrams */
+    pthread_t receiver;                 /* Fills the queue from ring */
+    QUEUE_SLOT *slot;                   /* Oldest queued datagram */
+    int count;
+    int done = FALSE;
+    int idle;                           /* Nothing is queued */
+    int clockFD;                        /* Mixing clock, -1 for ticks */
+    struct timespec deadline;           /* When the next mix is due */
+    struct pollfd events[2];            /* Doorbell and clock */
+    char rings[QUEUE_SLOTS];            /* Drained doorbell rings */
+    MIXER mixer;                        /* Clients and merge space */
 
-    while (1)
+    InitMixer(&mixer);
+    InitRing(&ring);
+    mixer.ring = &ring;
+
+    if (!InitQueue(&queue))
+    {
+        CloseScreen();
+        perror("Unable to start receive queue");
+        exit(1);
+    }
+
+    queued = TRUE;
+    clockFD = InitClock(&deadline);
+
+#ifdef URING_RECEIVE
+    uring.fd = -1;
+
+    if (useUring && !InitUring(&uring))
     {
-        recvfrom(socketFD, packet, 1024, 0,
-            (struct sockaddr *)&cliAddr, &length);
+        PutFormattedLine(23, 0, "No io_uring provided buffers, using %s",
+            (batch > 1) ? "recvmmsg" : "recvfrom");
+    }
+#endif
 
-        /* Use service name to indicate end */
-        if (!strcmp(packet, "end"))
-        {
-            /* Delete associated client */
-            /* Exit if there are no more clients */
-            RemoveClient(&list, cliAddr.sin_addr.s_addr);
+    if (pthread_create(&receiver, NULL, ReceiveThread, &ring) != 0)
+    {
+        CloseScreen();
+        perror("Unable to start receive thread");
+        exit(1);
+    }
 
-            if (list == NULL)
-            {
-                break;
-            }
-        }
-        else if (!strcmp(packet, "tick"))
+    events[0].fd = queue.doorbell[0];
+    events[0].events = POLLIN;
+    events[1].fd = clockFD;             /* poll skips -1 */
+    events[1].events = POLLIN;
+
+    while (!done)
+    {
+        /* Only block when the queue is empty */
+        idle = QueueIdle(&queue);
+
+        if (poll(events, 2, idle ? -1 : 0) > 0)
         {
-            /* We got the timer tick */
-            /* Mix packets */
-            if (list != NULL)
+            if (events[0].revents & POLLIN)
             {
-                grid = MergeBuffers(list);
+                read(queue.doorbell[0], rings, sizeof(rings));
+            }
 
-                if (grid != NULL)
-                {
-                    grid->sequenceNumber = ++sequenceNumber;
-                    gettimeofday(&grid->timeStamp, NULL);
-                    ShowGrid(grid);
-                    free(grid);
-                }
+            if ((events[1].revents & POLLIN) &&
+                ClockFired(clockFD, &deadline))
+            {
+                MixClients(&mixer);
             }
         }
-        else
-        {
-            /* We have a grid update the client list      */
-            /* NOTE: I cheat and use the adrress as an ID */
-            /*       Therefor same machine = same ID      */
-            bytes = (BYTE *)packet;
-            PutFormattedLine(23, 0, "Received %d x %d grid",
-                bytes[ROW_POS].byte, bytes[COL_POS].byte);
 
-            UpdateClient(&list, cliAddr.sin_addr.s_addr, bytes);
+        __atomic_store_n(&queue.waiting, FALSE, __ATOMIC_SEQ_CST);
+
+        /* Drain at most a queue full before checking the clock again */
+        for (count = 0; !done && (count < QUEUE_SLOTS); count++)
+        {
+            slot = PeekQueue(&queue);
 
-            if (list == NULL)
+            if (slot == NULL)
             {
-                PutFormattedLine(23, 0, "Error: NULL grid buffer list");
+                break;
             }
+
+            /* Exit, there are no more clients */
+            done = HandleDatagram(&mixer, slot->packet, slot->size,
+                (struct sockaddr *)&slot->addr, slot->kind, clockFD < 0);
+            ReleaseQueue(&queue);
         }
     }
 
+    /* The receive thread is blocked in a receive, a cancellation point */
+    pthread_cancel(receiver);
+    pthread_join(receiver, NULL);
+    queued = FALSE;
+    FreeQueue(&queue);
+
+#ifdef URING_RECEIVE
+    FreeUring(&uring);
+#endif
+
+    if (clockFD >= 0)
+    {
+        close(clockFD);
+    }
+
+    FreeMixer(&mixer);
     CloseScreen();
     close(socketFD);
 }
+
+/**************************************************************************
+*   Function   : ReceiveThread
+*   Description: Body of the receive thread of DoReceive.  Receives
+*                batches of datagrams, drops the ones with bad headers,
+*                and queues the rest for the mixer thread.  It never
+*                touches the clients.  With -u, datagrams are received
+*                with io_uring until it fails, as it does on kernels
+*                without multishot receives, and then with ReceiveBatch.
+*   Parameters : arg - the RECV_RING to receive into
+*   Effects    : Datagrams are added to queue, or counted as overflowed
+*                or rejected.
+*   Returned   : Never returns, the thread is cancelled.
+**************************************************************************/
+void *ReceiveThread(void *arg)
+{
+    RECV_RING *ring;
+    int count, next;
+
+    ring = (RECV_RING *)arg;
+
+#ifdef URING_RECEIVE
+    if (uring.fd != -1)
+    {
+        /* Only returns if the socket can not be received from this way */
+        ReceiveUring(&uring, ring);
+        FreeUring(&uring);
+        PutFormattedLine(23, 0, "io_uring receive failed, using %s",
+            (batch > 1) ? "recvmmsg" : "recvfrom");
+    }
+#endif
+
+    receiveName = (batch > 1) ? "recvmmsg" : "recvfrom";
+
+    while (1)
+    {
+        count = ReceiveBatch(socketFD, ring);
+
+        for (next = 0; next < count; next++)
+        {
+            QueueDatagram(ring->packets[next], ring->sizes[next],
+                &ring->addrs[next]);
+        }
+
+        if (count > 0)
+        {
+            RingDoorbell(&queue);
+        }
+    }
+
+    return(NULL);
+}
+
+/**************************************************************************
+*   Function   : QueueDatagram
+*   Description: Checks the header of a received datagram, and queues it
+*                for the mixer thread if it is good.
+*   Parameters : packet - the datagram
+*                size - number of bytes in packet
+*                addr - address the datagram came from
+*   Effects    : The datagram is queued, or counted as rejected or
+*                overflowed.  The doorbell is not rung.
+*   Returned   : None
+**************************************************************************/
+void QueueDatagram(BYTE *packet, int size, struct sockaddr_storage *addr)
+{
+    int kind;
+
+    kind = ValidateHeader(packet, size);
+
+    if (!kind)
+    {
+        queue.rejected++;
+        return;
+    }
+
+    Enqueue(&queue, packet, size, addr, kind);
+}
+
+/**************************************************************************
+*   Function   : HandleDatagram
+*   Description: Handles one received datagram, by jumping through
+*                handlers on the type its header was checked to have.
+*   Parameters : mixer - clients to update
+*                packet - the datagram
+*                size - number of bytes in packet
+*                cliAddr - address the datagram came from
+*                kind - as returned by ValidateHeader
+*                ticks - TRUE to mix on tick datagrams
+*   Effects    : mixer's client store is updated, and may be mixed.
+*   Returned   : TRUE if a leave left no clients, otherwise FALSE.
+**************************************************************************/
+int HandleDatagram(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int kind, int ticks)
+{
+    return(handlers[kind](mixer, packet, size, cliAddr, ticks));
+}
+
+/**************************************************************************
+*   Function   : HandleBad
+*   Description: Reports a datagram that failed ValidateHeader, or is
+*                of a type only the proxy sends.
+*   Parameters : mixer - clients, unused
+*                packet - the datagram, unused
+*                size - number of bytes in packet
+*                cliAddr - address the datagram came from, unused
+*                ticks - unused
+*   Effects    : The rejection is displayed.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleBad(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    PutFormattedLine(23, 0, "Rejected bad %d byte packet", size);
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : HandleGrid
+*   Description: Updates the sending client's grid with a grid packet, or
+*                a fragment of one.  A client is added when its first grid
+*                arrives, whether or not it sent a join.
+*   Parameters : mixer - clients to update
+*                packet - the datagram, with a checked header
+*                size - number of bytes in packet
+*                cliAddr - address the datagram came from
+*                ticks - unused
+*   Effects    : mixer's client store is updated.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleGrid(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    CLIENT_KEY key;                     /* Client address, port, session */
+
+    /* Clients are told apart by address and port  */
+    /* so several may share one machine            */
+    if (packet[TYPE_POS].byte == PKT_FRAGMENT)
+    {
+        PutFormattedLine(23, 0, "Received fragment %d of %d",
+            (int)GetBigEndian(packet, FRAG_INDEX_POS, 2) + 1,
+            (int)GetBigEndian(packet, FRAG_COUNT_POS, 2));
+    }
+    else
+    {
+        PutFormattedLine(23, 0, "Received %d x %d grid",
+            PACKED_ROWS(packet), PACKED_COLS(packet));
+    }
+
+    MakeClientKey(&key, cliAddr, 0);
+    UpdateClient(&mixer->store, &key, packet, size,
+        running ? &mixer->accumulator : NULL);
+
+    if (mixer->store.count == 0)
+    {
+        PutFormattedLine(23, 0, "Error: empty client store");
+    }
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : HandleJoin
+*   Description: Adds the sending client to the store, so the space for
+*                it is found before its first grid arrives.
+*   Parameters : mixer - clients to add to
+*                packet - the datagram, unused
+*                size - number of bytes in packet, unused
+*                cliAddr - address the datagram came from
+*                ticks - unused
+*   Effects    : The client is added if it is new.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleJoin(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    CLIENT_KEY key;                     /* Client address, port, session */
+
+    MakeClientKey(&key, cliAddr, 0);
+
+    if (AddClient(&mixer->store, &key) < 0)
+    {
+        PutFormattedLine(23, 0, "Unable to add client");
+    }
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : HandleLeave
+*   Description: Removes the sending client from the store.
+*   Parameters : mixer - clients to remove from
+*                packet - the datagram, unused
+*                size - number of bytes in packet, unused
+*                cliAddr - address the datagram came from
+*                ticks - unused
+*   Effects    : The client and its grid are deleted.
+*   Returned   : TRUE if there are no clients left, otherwise FALSE.
+**************************************************************************/
+int HandleLeave(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    CLIENT_KEY key;                     /* Client address, port, session */
+
+    MakeClientKey(&key, cliAddr, 0);
+    RemoveClient(&mixer->store, &key, running ? &mixer->accumulator : NULL);
+
+    return(mixer->store.count == 0);
+}
+
+/**************************************************************************
+*   Function   : HandleTick
+*   Description: Mixes the clients on a tick from the tick program, if the
+*                proxy has no clock of its own.
+*   Parameters : mixer - clients to mix
+*                packet - the datagram, unused
+*                size - number of bytes in packet, unused
+*                cliAddr - address the datagram came from, unused
+*                ticks - TRUE to mix on ticks
+*   Effects    : The clients may be mixed.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleTick(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    if (ticks)
+    {
+        MixClients(mixer);
+    }
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : HandleSubscribe
+*   Description: Adds the sender to the subscribers, so it is sent every
+*                mix from now on.  A sender without a good cookie is only
+*                sent one, see CheckCookie.  With receive workers, any of
+*                them may handle this while another does too, or while the
+*                mixer publishes, so output is changed under outputLock.
+*   Parameters : mixer - clients, unused
+*                packet - the datagram, with a cookie at COOKIE_POS
+*                size - number of bytes in packet, unused
+*                cliAddr - address the datagram came from
+*                ticks - unused
+*   Effects    : The sender is added to output if it is new, and there
+*                are fewer than MAX_SUBSCRIBERS.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleSubscribe(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    int added;
+
+    added = FALSE;
+
+    if ((cliAddr->sa_family == AF_INET) &&
+        !CheckCookie(packet, (struct sockaddr_in *)cliAddr))
+    {
+        return(FALSE);
+    }
+
+    if (cliAddr->sa_family == AF_INET)
+    {
+        pthread_mutex_lock(&outputLock);
+        added = AddSubscriber(&output, (struct sockaddr_in *)cliAddr);
+        pthread_mutex_unlock(&outputLock);
+    }
+
+    if (!added)
+    {
+        PutFormattedLine(23, 0, "Unable to add subscriber");
+    }
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : HandleUnsubscribe
+*   Description: Removes the sender from the subscribers, whether it
+*                wanted whole mixes, rectangles of them, or reduced mixes.
+*                output is changed under outputLock.
+*   Parameters : mixer - clients, unused
+*                packet - the datagram, unused
+*                size - number of bytes in packet, unused
+*                cliAddr - address the datagram came from
+*                ticks - unused
+*   Effects    : The sender is no longer sent mixes or tiles.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleUnsubscribe(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    if (cliAddr->sa_family == AF_INET)
+    {
+        pthread_mutex_lock(&outputLock);
+        RemoveSubscriber(&output, (struct sockaddr_in *)cliAddr);
+        RemoveRegions(&output, (struct sockaddr_in *)cliAddr);
+        RemoveLevel(&output, (struct sockaddr_in *)cliAddr);
+        pthread_mutex_unlock(&outputLock);
+    }
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : HandleRegion
+*   Description: Subscribes the sender to the rectangles of the mix in
+*                the packet, in place of any it asked for before.  Like
+*                HandleSubscribe it needs a good cookie, and changes
+*                output under outputLock.
+*   Parameters : mixer - clients, unused
+*                packet - the datagram, with a cookie and 1 to MAX_REGIONS
+*                         rectangles
+*                size - number of bytes in packet
+*                cliAddr - address the datagram came from
+*                ticks - unused
+*   Effects    : The sender is sent the tiles its rectangles touch, all
+*                of them after the next mix, then those that change.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleRegion(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    int added;
+
+    added = FALSE;
+
+    if ((cliAddr->sa_family == AF_INET) &&
+        !CheckCookie(packet, (struct sockaddr_in *)cliAddr))
+    {
+        return(FALSE);
+    }
+
+    if (cliAddr->sa_family == AF_INET)
+    {
+        pthread_mutex_lock(&outputLock);
+        added = SetRegions(&output, (struct sockaddr_in *)cliAddr, packet,
+            size);
+        pthread_mutex_unlock(&outputLock);
+    }
+
+    if (!added)
+    {
+        PutFormattedLine(23, 0, "Unable to add region subscriber");
+    }
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : HandleLevel
+*   Description: Subscribes the sender to the mix halved the number of
+*                times in the packet, in place of what it subscribed to
+*                before.  Level 0 is the whole mix, sent as to
+*                HandleSubscribe's subscribers.  Like HandleSubscribe it
+*                needs a good cookie, and changes output under outputLock.
+*   Parameters : mixer - clients, unused
+*                packet - the datagram, with a cookie and the level at
+*                         LEVEL_POS
+*                size - number of bytes in packet, unused
+*                cliAddr - address the datagram came from
+*                ticks - unused
+*   Effects    : The sender is sent the level from the next mix on.
+*   Returned   : FALSE
+**************************************************************************/
+int HandleLevel(MIXER *mixer, BYTE *packet, int size,
+    struct sockaddr *cliAddr, int ticks)
+{
+    struct sockaddr_in *addr;
+    int added;
+
+    addr = (struct sockaddr_in *)cliAddr;
+    added = (cliAddr->sa_family == AF_INET);
+
+    if (added && !CheckCookie(packet, addr))
+    {
+        return(FALSE);
+    }
+
+    pthread_mutex_lock(&outputLock);
+
+    if (added && (packet[LEVEL_POS].byte == 0))
+    {
+        RemoveLevel(&output, addr);
+        added = AddSubscriber(&output, addr);
+    }
+    else if (added)
+    {
+        RemoveSubscriber(&output, addr);
+        added = SetLevel(&output, addr, packet[LEVEL_POS].byte);
+    }
+
+    pthread_mutex_unlock(&outputLock);
+
+    if (!added)
+    {
+        PutFormattedLine(23, 0, "Unable to add level subscriber");
+    }
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : InitMixer
+*   Description: Starts a mixer with no clients and no merge space.
+*   Parameters : mixer - mixer to initialize
+*   Effects    : mixer is empty.
+*   Returned   : None
+**************************************************************************/
+void InitMixer(MIXER *mixer)
+{
+    InitClientStore(&mixer->store);
+    InitAccumulator(&mixer->accumulator);
+    mixer->merged.cells = NULL;
+    mixer->merged.rows = 0;
+    mixer->merged.cols = 0;
+    mixer->sums = NULL;
+    mixer->mergedSize = 0;
+    mixer->sequenceNumber = 0;
+    mixer->ring = NULL;
+}
+
+/**************************************************************************
+*   Function   : FreeMixer
+*   Description: Frees a mixer's clients and merge space.
+*   Parameters : mixer - mixer started by InitMixer
+*   Effects    : All of the mixer's memory is returned to the heap.
+*   Returned   : None
+**************************************************************************/
+void FreeMixer(MIXER *mixer)
+{
+    free(mixer->merged.cells);
+    free(mixer->sums);
+    FreeAccumulator(&mixer->accumulator);
+    FreeClientStore(&mixer->store);
+    InitMixer(mixer);
+}
+
+/**************************************************************************
+*   Function   : GrowMergeSpace
+*   Description: Makes sure a mixer's merged grid and sums have room for
+*                numCells cells.  They only grow when the merged grid does.
+*   Parameters : mixer - mixer to grow
+*                numCells - cells needed, as returned by MergedCells
+*   Effects    : The merge arrays are replaced by bigger ones if needed.
+*   Returned   : TRUE on success, FALSE if the arrays could not be
+*                allocated, in which case the mixer has none.
+**************************************************************************/
+int GrowMergeSpace(MIXER *mixer, int numCells)
+{
+    if (numCells <= mixer->mergedSize)
+    {
+        return(TRUE);
+    }
+
+    free(mixer->merged.cells);
+    free(mixer->sums);
+    mixer->merged.cells = (char *)CountedMalloc(numCells);
+    mixer->sums = (FIXED_SUM *)CountedAlignedMalloc(numCells *
+        sizeof(FIXED_SUM));
+    mixer->mergedSize = numCells;
+
+    if ((mixer->merged.cells == NULL) || (mixer->sums == NULL))
+    {
+        PutFormattedLine(23, 0, "Unable to allocate merge");
+        free(mixer->merged.cells);
+        free(mixer->sums);
+        mixer->merged.cells = NULL;
+        mixer->sums = NULL;
+        mixer->mergedSize = 0;
+        return(FALSE);
+    }
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : MixClients
+*   Description: Merges the buffered client grids, or publishes the
+*                running sum of them, and shows the result along with the
+*                proxy's statistics.
+*   Parameters : mixer - clients and merge space
+*   Effects    : Out of date clients are aged, stale fragments dropped,
+*                and the merged grid is shown.  The merge space grows if
+*                the merged grid does.
+*   Returned   : None
+**************************************************************************/
+void MixClients(MIXER *mixer)
+{
+    GRID *shown;                        /* Grid shown for this mix */
+
+    if (mixer->store.count == 0)
+    {
+        return;
+    }
+
+    if (ExpireFragments(&mixer->store))
+    {
+        PutFormattedLine(22, 0, "Fragmented frame timed out");
+    }
+
+    if (running)
+    {
+        shown = PublishAccumulator(&mixer->store, &mixer->accumulator);
+    }
+    else if (GrowMergeSpace(mixer, MergedCells(&mixer->store)))
+    {
+        shown = MergeBuffersInto(&mixer->store, &mixer->merged,
+            mixer->sums, mixer->mergedSize) ? &mixer->merged : NULL;
+    }
+    else
+    {
+        shown = NULL;
+    }
+
+    if (shown != NULL)
+    {
+        shown->sequenceNumber = ++mixer->sequenceNumber;
+        gettimeofday(&shown->timeStamp, NULL);
+        ShowMix(shown, running ? "running sum" : MergeEngineName(),
+            mixer->ring->calls, mixer->ring->received);
+        PublishMix(&output, shown);
+    }
+}
+
+/**************************************************************************
+*   Function   : ShowMix
+*   Description: Shows a merged grid, followed by the proxy's statistics.
+*                With a receive thread, the depth of its queue and the
+*                datagrams it has dropped are shown too, and with
+*                subscribers, the datagrams sent to them.  Status lines
+*                queued since the last mix are drawn with them, and the
+*                screen is refreshed once.  Without a screen, the
+*                statistics are written to the log after the status
+*                lines, and the grid is left out.
+*   Parameters : shown - merged grid
+*                engine - name of the way it was merged
+*                calls - receive system calls made so far
+*                received - datagrams returned by those calls
+*   Effects    : The grid and statistics are displayed.
+*   Returned   : None
+**************************************************************************/
+void ShowMix(GRID *shown, const char *engine, unsigned long calls,
+    unsigned long received)
+{
+    /* Without a screen this draws nothing, but the statistics are
+     * still queued, and written to the log with the status lines */
+    ShowGrid(shown);
+    PutFormattedLine(shown->rows + 6, 0,
+        "Mallocs this frame: %lu", FrameMallocs());
+    PutFormattedLine(shown->rows + 7, 0, "Merge engine: %s", engine);
+    PutFormattedLine(shown->rows + 8, 0,
+        "Receive calls per packet: %.3f (%s, batch %d, %d workers)",
+        received ? (double)calls / received : 0.0, receiveName, batch,
+        workers);
+
+    if (mixLate >= 0)
+    {
+        PutFormattedLine(shown->rows + 9, 0,
+            "Mix late by %ld us, worst %ld us, %lu deadlines missed",
+            mixLate, worstLate, missedMixes);
+    }
+
+    if (queued)
+    {
+        /* Counters are the receive thread's, read without a lock */
+        PutFormattedLine(shown->rows + 10, 0,
+            "Queue depth %u of %d, deepest %u, %lu overflowed, "
+            "%lu rejected",
+            queue.head - queue.tail, QUEUE_SLOTS, queue.deepest,
+            queue.overflows, queue.rejected);
+    }
+
+    /* Receive workers may be changing the subscribers */
+    pthread_mutex_lock(&outputLock);
+
+    if ((output.count > 0) || output.group.sin_port ||
+        (output.regionCount > 0) || (output.levelCount > 0))
+    {
+        PutFormattedLine(shown->rows + 11, 0,
+            "Subscribers: %d%s, %d to regions, %d to levels, "
+            "%lu datagrams sent, %lu failed, %lu full mixes, %lu deltas",
+            output.count, output.group.sin_port ? " and a group" : "",
+            output.regionCount, output.levelCount, output.sent,
+            output.failed, output.keys, output.deltas);
+    }
+
+    pthread_mutex_unlock(&outputLock);
+
+    /* Everything queued since the last mix, and one refresh */
+    DrainStatus();
+}
+
+/**************************************************************************
+*   Function   : InitRing
+*   Description: Points each receive request of a ring at its own packet
+*                and address buffer, so nothing is set up per datagram.
+*   Parameters : ring - ring of datagram buffers
+*   Effects    : ring's recvmmsg requests are ready to use, and its
+*                counts are cleared.
+*   Returned   : None
+**************************************************************************/
+void InitRing(RECV_RING *ring)
+{
+#ifdef BATCH_RECEIVE
+    int i;
+
+    memset(ring->msgs, 0, sizeof(ring->msgs));
+
+    for (i = 0; i < RECV_BATCH; i++)
+    {
+        ring->iovecs[i].iov_base = ring->packets[i];
+        ring->iovecs[i].iov_len = sizeof(ring->packets[i]);
+        ring->msgs[i].msg_hdr.msg_iov = &ring->iovecs[i];
+        ring->msgs[i].msg_hdr.msg_iovlen = 1;
+        ring->msgs[i].msg_hdr.msg_name = &ring->addrs[i];
+    }
+#endif
+
+    ring->calls = 0;
+    ring->received = 0;
+}
+
+/**************************************************************************
+*   Function   : ReceiveBatch
+*   Description: Waits for a datagram on a socket, then takes up to batch
+*                datagrams that have arrived with the same system call.
+*                Without recvmmsg, or with a batch of 1, one datagram is
+*                received with recvfrom.
+*   Parameters : fd - bound socket to receive on
+*                ring - ring of datagram buffers set up by InitRing
+*   Effects    : The first datagrams of ring are filled in, and its counts
+*                are updated.
+*   Returned   : Number of datagrams received.  0 if the receive failed.
+**************************************************************************/
+int ReceiveBatch(int fd, RECV_RING *ring)
+{
+    socklen_t length;
+    int count, i;
+
+    ring->calls++;
+
+#ifdef BATCH_RECEIVE
+    if (batch > 1)
+    {
+        for (i = 0; i < batch; i++)
+        {
+            ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->addrs[0]);
+        }
+
+        /* Block for the first datagram only */
+        count = recvmmsg(fd, ring->msgs, batch, MSG_WAITFORONE, NULL);
+
+        if (count <= 0)
+        {
+            return(0);
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            ring->sizes[i] = ring->msgs[i].msg_len;
+        }
+
+        ring->received += count;
+        return(count);
+    }
+#endif
+
+    length = sizeof(ring->addrs[0]);
+    ring->sizes[0] = recvfrom(fd, (char *)ring->packets[0],
+        sizeof(ring->packets[0]), 0, (struct sockaddr *)&ring->addrs[0],
+        &length);
+
+    if (ring->sizes[0] <= 0)
+    {
+        return(0);
+    }
+
+    ring->received++;
+    return(1);
+}
+
+/**************************************************************************
+*   Function   : InitClock
+*   Description: Starts the proxy's mixing clock, a timerfd that fires
+*                every period microseconds.  The deadlines are absolute,
+*                so a late mix does not push back the ones after it.
+*   Parameters : deadline - set to when the first mix is due
+*   Effects    : The clock is started, unless period is 0 or there are
+*                no timerfds.
+*   Returned   : File descriptor of the clock.  -1 if the proxy is to mix
+*                on tick packets instead.
+**************************************************************************/
+int InitClock(struct timespec *deadline)
+{
+#ifdef TIMER_CLOCK
+    struct itimerspec spec;
+    int clockFD;
+
+    if (period == 0)
+    {
+        return(-1);
+    }
+
+    clockFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    if (clockFD == -1)
+    {
+        PutFormattedLine(23, 0, "Unable to start clock, mixing on ticks");
+        return(-1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    AddUsecs(deadline, period);
+    spec.it_value = *deadline;
+    spec.it_interval.tv_sec = period / 1000000;
+    spec.it_interval.tv_nsec = (period % 1000000) * 1000;
+
+    if (timerfd_settime(clockFD, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+    {
+        PutFormattedLine(23, 0, "Unable to start clock, mixing on ticks");
+        close(clockFD);
+        return(-1);
+    }
+
+    mixLate = 0;
+    return(clockFD);
+#else
+    return(-1);
+#endif
+}
+
+/**************************************************************************
+*   Function   : ClockFired
+*   Description: Reads how many times the mixing clock has fired since it
+*                was last read, and measures how long after the latest of
+*                those deadlines it is now.
+*   Parameters : clockFD - clock started by InitClock
+*                deadline - deadline of the next mix
+*   Effects    : deadline moves to the deadline after the one being
+*                served.  mixLate, worstLate and missedMixes are updated.
+*   Returned   : TRUE if the clock has fired and a mix is due, otherwise
+*                FALSE.
+**************************************************************************/
+int ClockFired(int clockFD, struct timespec *deadline)
+{
+#ifdef TIMER_CLOCK
+    unsigned long long expirations;
+    struct timespec now;
+    long late;
+
+    if (read(clockFD, &expirations, sizeof(expirations)) !=
+        sizeof(expirations))
+    {
+        return(FALSE);
+    }
+
+    /* Only the latest deadline gets a mix */
+    AddUsecs(deadline, (long long)(expirations - 1) * period);
+    missedMixes += expirations - 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = ((now.tv_sec - deadline->tv_sec) * 1000000L) +
+        ((now.tv_nsec - deadline->tv_nsec) / 1000);
+    AddUsecs(deadline, period);
+
+    mixLate = (late < 0) ? 0 : late;
+
+    if (mixLate > worstLate)
+    {
+        worstLate = mixLate;
+    }
+
+    return(TRUE);
+#else
+    return(FALSE);
+#endif
+}
+
+/**************************************************************************
+*   Function   : AddUsecs
+*   Description: Adds microseconds to a time.
+*   Parameters : time - time to add to
+*                usecs - microseconds to add
+*   Effects    : time is moved forward by usecs.
+*   Returned   : None
+**************************************************************************/
+void AddUsecs(struct timespec *time, long long usecs)
+{
+    time->tv_sec += usecs / 1000000;
+    time->tv_nsec += (usecs % 1000000) * 1000;
+
+    if (time->tv_nsec >= 1000000000L)
+    {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000L;
+    }
+}
+
+/**************************************************************************
+*   Function   : InitQueue
+*   Description: Allocates the slots of an empty queue and the pipe used
+*                as its doorbell.  The slots are never reallocated.
+*   Parameters : q - queue to start
+*   Effects    : q is empty and ready to use.
+*   Returned   : TRUE on success, FALSE if the slots or pipe could not be
+*                had.
+**************************************************************************/
+int InitQueue(PACKET_QUEUE *q)
+{
+    memset(q, 0, sizeof(PACKET_QUEUE));
+    q->slots = (QUEUE_SLOT *)CountedMalloc(QUEUE_SLOTS * sizeof(QUEUE_SLOT));
+
+    if (q->slots == NULL)
+    {
+        return(FALSE);
+    }
+
+    if (pipe(q->doorbell) != 0)
+    {
+        free(q->slots);
+        q->slots = NULL;
+        return(FALSE);
+    }
+
+    /* A full pipe must not block the receive thread */
+    fcntl(q->doorbell[1], F_SETFL, O_NONBLOCK);
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : FreeQueue
+*   Description: Frees a queue's slots and closes its doorbell.  Neither
+*                thread may be using it.
+*   Parameters : q - queue started by InitQueue
+*   Effects    : Queued datagrams are discarded.
+*   Returned   : None
+**************************************************************************/
+void FreeQueue(PACKET_QUEUE *q)
+{
+    free(q->slots);
+    q->slots = NULL;
+    close(q->doorbell[0]);
+    close(q->doorbell[1]);
+}
+
+/**************************************************************************
+*   Function   : Enqueue
+*   Description: Copies a datagram into the next free slot of a queue and
+*                publishes it to the consumer.  Only the producer may
+*                call this.
+*   Parameters : q - queue to add to
+*                packet - the datagram
+*                size - number of bytes in packet
+*                addr - address the datagram came from
+*                kind - as returned by ValidateHeader
+*   Effects    : The datagram is queued, or counted as an overflow when
+*                every slot is in use.
+*   Returned   : TRUE if queued, FALSE if the queue was full.
+**************************************************************************/
+int Enqueue(PACKET_QUEUE *q, BYTE *packet, int size,
+    struct sockaddr_storage *addr, int kind)
+{
+    QUEUE_SLOT *slot;
+    unsigned int depth;
+
+    /* Slots before tail have been released by the consumer */
+    depth = q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    if (depth >= QUEUE_SLOTS)
+    {
+        q->overflows++;
+        return(FALSE);
+    }
+
+    slot = &q->slots[q->head & (QUEUE_SLOTS - 1)];
+    memcpy(slot->packet, packet, size);
+    slot->addr = *addr;
+    slot->size = size;
+    slot->kind = kind;
+
+    /* Publish the slot, ordered before RingDoorbell reads waiting */
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+
+    if (depth + 1 > q->deepest)
+    {
+        q->deepest = depth + 1;
+    }
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : RingDoorbell
+*   Description: Wakes the consumer of a queue if it has said it is about
+*                to sleep.  Only the producer may call this, after
+*                queueing.
+*   Parameters : q - queue to wake
+*   Effects    : A byte is written to the doorbell if the consumer is
+*                waiting.
+*   Returned   : None
+**************************************************************************/
+void RingDoorbell(PACKET_QUEUE *q)
+{
+    char ring = 0;
+
+    if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&q->waiting, FALSE, __ATOMIC_SEQ_CST))
+    {
+        write(q->doorbell[1], &ring, 1);
+    }
+}
+
+/**************************************************************************
+*   Function   : QueueIdle
+*   Description: Tells the producer the consumer is going to sleep, then
+*                checks whether anything was queued in the meantime.  The
+*                producer publishes head before it reads waiting, and
+*                this sets waiting before it reads head, so one of them
+*                always sees the other.  Only the consumer may call this.
+*   Parameters : q - queue to check
+*   Effects    : waiting is set if the queue is empty.
+*   Returned   : TRUE if the queue is empty and the consumer may sleep on
+*                the doorbell, otherwise FALSE.
+**************************************************************************/
+int QueueIdle(PACKET_QUEUE *q)
+{
+    __atomic_store_n(&q->waiting, TRUE, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) != q->tail)
+    {
+        __atomic_store_n(&q->waiting, FALSE, __ATOMIC_SEQ_CST);
+        return(FALSE);
+    }
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : PeekQueue
+*   Description: Finds the oldest datagram in a queue.  It stays queued
+*                until ReleaseQueue is called.  Only the consumer may
+*                call this.
+*   Parameters : q - queue to look in
+*   Effects    : None
+*   Returned   : Slot holding the datagram, NULL if the queue is empty.
+**************************************************************************/
+QUEUE_SLOT *PeekQueue(PACKET_QUEUE *q)
+{
+    if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail)
+    {
+        return(NULL);
+    }
+
+    return(&q->slots[q->tail & (QUEUE_SLOTS - 1)]);
+}
+
+/**************************************************************************
+*   Function   : ReleaseQueue
+*   Description: Hands the oldest slot of a queue back to the producer.
+*                Only the consumer may call this.
+*   Parameters : q - queue with a datagram returned by PeekQueue
+*   Effects    : The slot may be reused by the producer.
+*   Returned   : None
+**************************************************************************/
+void ReleaseQueue(PACKET_QUEUE *q)
+{
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef URING_RECEIVE
+/**************************************************************************
+*   Function   : InitUring
+*   Description: Sets up an io_uring with its rings mapped, and registers
+*                a ring of provided buffers for it to receive into.  The
+*                system calls are made directly, so no library is needed.
+*                The completion queue has room for a completion from
+*                every buffer, and for the one that stops the receive when
+*                they run out, so completions never overflow the ring and
+*                poll always means there is one to reap.
+*   Parameters : u - io_uring to set up
+*   Effects    : The ring and buffers are allocated and mapped.
+*   Returned   : TRUE on success.  FALSE if the kernel has no io_uring or
+*                no provided buffer rings, in which case u->fd is -1.
+**************************************************************************/
+int InitUring(URING *u)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t sqSize, cqSize;
+    int id;
+
+    memset(u, 0, sizeof(URING));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * URING_BUFFERS;
+
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+    if ((u->fd < 0) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        FreeUring(u);
+        return(FALSE);
+    }
+
+    /* One mapping holds the submission and completion rings */
+    sqSize = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    cqSize = params.cq_off.cqes +
+        (params.cq_entries * sizeof(struct io_uring_cqe));
+    u->ringsSize = (sqSize > cqSize) ? sqSize : cqSize;
+    u->rings = mmap(NULL, u->ringsSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+        IORING_OFF_SQES);
+
+    /* The buffer ring must be page aligned, so it is mapped too */
+    u->bufferSize = sizeof(struct io_uring_recvmsg_out) +
+        sizeof(struct sockaddr_storage) + MAX_DATAGRAM;
+    u->bufRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = mmap(NULL, URING_BUFFERS * u->bufferSize,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if ((u->rings == MAP_FAILED) || (u->sqes == MAP_FAILED) ||
+        (u->bufRing == MAP_FAILED) || (u->buffers == MAP_FAILED))
+    {
+        FreeUring(u);
+        return(FALSE);
+    }
+
+    u->sqTail = (unsigned *)(u->rings + params.sq_off.tail);
+    u->sqMask = (unsigned *)(u->rings + params.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(u->rings + params.sq_off.array);
+    u->cqHead = (unsigned *)(u->rings + params.cq_off.head);
+    u->cqTail = (unsigned *)(u->rings + params.cq_off.tail);
+    u->cqMask = (unsigned *)(u->rings + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(u->rings + params.cq_off.cqes);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1) != 0)
+    {
+        FreeUring(u);
+        return(FALSE);
+    }
+
+    for (id = 0; id < URING_BUFFERS; id++)
+    {
+        ProvideBuffer(u, id);
+    }
+
+    __atomic_store_n(&u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE);
+
+    /* Every buffer is laid out with room for a whole address */
+    u->msg.msg_namelen = sizeof(struct sockaddr_storage);
+    u->msg.msg_controllen = 0;
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : FreeUring
+*   Description: Closes an io_uring, which cancels its receive, and unmaps
+*                its rings and buffers.  Safe to call more than once.
+*   Parameters : u - io_uring set up by InitUring, or partly set up
+*   Effects    : u->fd is -1, and nothing is mapped.
+*   Returned   : None
+**************************************************************************/
+void FreeUring(URING *u)
+{
+    if (u->fd >= 0)
+    {
+        close(u->fd);
+    }
+
+    if ((u->rings != NULL) && (u->rings != MAP_FAILED))
+    {
+        munmap(u->rings, u->ringsSize);
+    }
+
+    if ((u->sqes != NULL) && (u->sqes != MAP_FAILED))
+    {
+        munmap(u->sqes, URING_ENTRIES * sizeof(struct io_uring_sqe));
+    }
+
+    if ((u->bufRing != NULL) && (u->bufRing != MAP_FAILED))
+    {
+        munmap(u->bufRing, URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+
+    if ((u->buffers != NULL) && (u->buffers != MAP_FAILED))
+    {
+        munmap(u->buffers, URING_BUFFERS * u->bufferSize);
+    }
+
+    memset(u, 0, sizeof(URING));
+    u->fd = -1;
+}
+
+/**************************************************************************
+*   Function   : ArmUring
+*   Description: Submits a multishot recvmsg on socketFD, which goes on
+*                posting a completion for every datagram until it runs
+*                out of buffers or fails.
+*   Parameters : u - io_uring set up by InitUring
+*   Effects    : The receive is submitted.
+*   Returned   : TRUE if the kernel took the submission, otherwise FALSE.
+**************************************************************************/
+int ArmUring(URING *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+
+    tail = *u->sqTail;
+    sqe = &u->sqes[tail & *u->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socketFD;
+    sqe->addr = (unsigned long)&u->msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    u->sqArray[tail & *u->sqMask] = tail & *u->sqMask;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    return(syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) == 1);
+}
+
+/**************************************************************************
+*   Function   : ProvideBuffer
+*   Description: Adds a receive buffer to the end of the provided buffer
+*                ring.  The kernel does not see it until the ring's tail
+*                is stored.
+*   Parameters : u - io_uring set up by InitUring
+*                id - buffer number, from 0 to URING_BUFFERS - 1
+*   Effects    : u->bufTail is advanced.
+*   Returned   : None
+**************************************************************************/
+void ProvideBuffer(URING *u, int id)
+{
+    struct io_uring_buf *buf;
+
+    buf = &u->bufRing->bufs[u->bufTail & (URING_BUFFERS - 1)];
+    buf->addr = (unsigned long)(u->buffers + (id * u->bufferSize));
+    buf->len = u->bufferSize;
+    buf->bid = id;
+    u->bufTail++;
+}
+
+/**************************************************************************
+*   Function   : ReceiveUring
+*   Description: Queues datagrams for the mixer thread as their
+*                completions are posted.  Completions are reaped in
+*                batches straight from the completion ring, and their
+*                buffers handed back together, so a busy socket costs no
+*                system calls.  When the ring is empty, the thread sleeps
+*                in poll on the io_uring, which is a cancellation point.
+*                The receive is resubmitted whenever it stops, which it
+*                does if the buffers run out.
+*   Parameters : u - io_uring set up by InitUring
+*                ring - receive counters to update
+*   Effects    : Datagrams are added to queue.  ring->calls counts the
+*                system calls made, and ring->received the datagrams.
+*   Returned   : Only if the receive fails for any reason but running out
+*                of buffers, such as a kernel without multishot recvmsg.
+*                Datagrams completed before the failure are queued.
+**************************************************************************/
+void ReceiveUring(URING *u, RECV_RING *ring)
+{
+    struct io_uring_cqe *cqe;
+    struct io_uring_recvmsg_out *out;
+    struct pollfd wait;
+    BYTE *buf;
+    unsigned head, tail;
+    int armed, received, id;
+
+    receiveName = "io_uring";
+    wait.fd = u->fd;
+    wait.events = POLLIN;
+    armed = FALSE;
+
+    while (1)
+    {
+        if (!armed)
+        {
+            ring->calls++;
+
+            if (!ArmUring(u))
+            {
+                return;
+            }
+
+            armed = TRUE;
+        }
+
+        head = *u->cqHead;
+        tail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            ring->calls++;
+            poll(&wait, 1, -1);
+            continue;
+        }
+
+        for (received = 0; head != tail; head++)
+        {
+            cqe = &u->cqes[head & *u->cqMask];
+
+            /* The receive stops after its last completion */
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                armed = FALSE;
+            }
+
+            if (cqe->res < 0)
+            {
+                /* Out of buffers is the only failure worth retrying, any
+                 * other would fail again as soon as it is rearmed */
+                if (cqe->res != -ENOBUFS)
+                {
+                    __atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+                    ring->received += received;
+
+                    if (received > 0)
+                    {
+                        RingDoorbell(&queue);
+                    }
+
+                    return;
+                }
+
+                continue;
+            }
+
+            id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            buf = u->buffers + (id * u->bufferSize);
+            out = (struct io_uring_recvmsg_out *)buf;
+
+            if (!(out->flags & MSG_TRUNC))
+            {
+                QueueDatagram(buf + sizeof(struct io_uring_recvmsg_out) +
+                    u->msg.msg_namelen + u->msg.msg_controllen,
+                    out->payloadlen, (struct sockaddr_storage *)(out + 1));
+                received++;
+            }
+
+            ProvideBuffer(u, id);
+        }
+
+        /* Hand back the completions and their buffers together */
+        __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+        __atomic_store_n(&u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE);
+        ring->received += received;
+
+        if (received > 0)
+        {
+            RingDoorbell(&queue);
+        }
+    }
+}
+#endif
+
+/**************************************************************************
+*   Function   : InitCookies
+*   Description: Picks the secret that subscription cookies are made
+*                with, from /dev/urandom, or from the time and process id
+*                if it can't be read.
+*   Parameters : None
+*   Effects    : cookieSecret is set.
+*   Returned   : None
+**************************************************************************/
+void InitCookies(void)
+{
+    struct timeval now;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+
+    if ((fd < 0) ||
+        (read(fd, cookieSecret, sizeof(cookieSecret)) !=
+        sizeof(cookieSecret)))
+    {
+        gettimeofday(&now, NULL);
+        cookieSecret[0] = ((unsigned long long)now.tv_sec << 32) ^
+            now.tv_usec;
+        cookieSecret[1] = ((unsigned long long)getpid() << 32) ^
+            (unsigned long long)(size_t)&now;
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/**************************************************************************
+*   Function   : MakeCookie
+*   Description: Makes the cookie an address must repeat to subscribe.
+*                The address, port and epoch are mixed with the secret,
+*                so only the proxy can make it and nothing is stored per
+*                address.  The mix is not a cryptographic MAC, it only
+*                has to keep a sender that can't receive at an address
+*                from guessing the address's cookie.
+*   Parameters : addr - address and port the cookie is for
+*                epoch - COOKIE_PERIOD seconds the cookie was made in
+*   Effects    : None
+*   Returned   : The cookie
+**************************************************************************/
+unsigned MakeCookie(struct sockaddr_in *addr, unsigned epoch)
+{
+    unsigned long long x;
+
+    x = cookieSecret[0] ^ ((unsigned long long)addr->sin_addr.s_addr << 16) ^
+        addr->sin_port ^ ((unsigned long long)epoch << 48);
+    x *= 0x9E3779B97F4A7C15ULL;
+    x ^= (x >> 32) ^ cookieSecret[1];
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 29;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 32;
+
+    return((unsigned)x);
+}
+
+/**************************************************************************
+*   Function   : CheckCookie
+*   Description: Checks the cookie of a subscribe, region or level packet.
+*                A cookie made for the sender in this COOKIE_PERIOD or the
+*                last is good.  Otherwise the sender is sent its cookie in
+*                a PKT_COOKIE packet, no bigger than the request, and must
+*                ask again with it.  So a request with a forged source
+*                address can't make the proxy send more than it got to
+*                that address.
+*   Parameters : packet - subscribe, region or level packet
+*                addr - address the packet came from
+*   Effects    : A cookie is sent to addr if the packet's is not good.
+*   Returned   : TRUE if the cookie is good, otherwise FALSE.
+**************************************************************************/
+int CheckCookie(BYTE *packet, struct sockaddr_in *addr)
+{
+    BYTE reply[COOKIE_SIZE];
+    unsigned cookie, epoch;
+
+    cookie = GetBigEndian(packet, COOKIE_POS, 4);
+    epoch = time(NULL) / COOKIE_PERIOD;
+
+    if ((cookie == MakeCookie(addr, epoch)) ||
+        (cookie == MakeCookie(addr, epoch - 1)))
+    {
+        return(TRUE);
+    }
+
+    PackControl(reply, PKT_COOKIE);
+    PutBigEndian(reply, COOKIE_POS, 4, MakeCookie(addr, epoch));
+    sendto(socketFD, (char *)reply, COOKIE_SIZE, 0, (struct sockaddr *)addr,
+        sizeof(*addr));
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : CountSubscribers
+*   Description: Counts the addresses sent mixes, tiles or levels.  An
+*                address is only in one of the lists at a time, unless it
+*                asked for rectangles and whole mixes.
+*   Parameters : out - subscribers
+*   Effects    : None
+*   Returned   : Number of subscribers in all the lists
+**************************************************************************/
+int CountSubscribers(OUTPUT *out)
+{
+    return(out->count + out->regionCount + out->levelCount);
+}
+
+/**************************************************************************
+*   Function   : FindSubscriber
+*   Description: Looks for an address in the subscribers.  Only done when
+*                subscribers come and go, never per mix.
+*   Parameters : out - subscribers
+*                addr - address and port to look for
+*   Effects    : None
+*   Returned   : Index of the subscriber, -1 if it is not subscribed.
+**************************************************************************/
+int FindSubscriber(OUTPUT *out, struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < out->count; i++)
+    {
+        if ((out->subscribers[i].sin_addr.s_addr == addr->sin_addr.s_addr) &&
+            (out->subscribers[i].sin_port == addr->sin_port))
+        {
+            return(i);
+        }
+    }
+
+    return(-1);
+}
+
+/**************************************************************************
+*   Function   : AddSubscriber
+*   Description: Adds an address to the subscribers, doubling the list
+*                when it is full.
+*   Parameters : out - subscribers
+*                addr - address and port to send mixes to
+*   Effects    : addr is subscribed, if it was not already, and the next
+*                mix goes out in full for it to start from.
+*   Returned   : TRUE on success, FALSE if the list could not grow or
+*                MAX_SUBSCRIBERS addresses are already sent output.
+**************************************************************************/
+int AddSubscriber(OUTPUT *out, struct sockaddr_in *addr)
+{
+    struct sockaddr_in *grown;
+    int size;
+
+    if (FindSubscriber(out, addr) >= 0)
+    {
+        return(TRUE);
+    }
+
+    if (CountSubscribers(out) >= MAX_SUBSCRIBERS)
+    {
+        return(FALSE);
+    }
+
+    if (out->count == out->size)
+    {
+        size = (out->size == 0) ? MIN_SUBSCRIBERS : 2 * out->size;
+        grown = (struct sockaddr_in *)CountedMalloc(size *
+            sizeof(struct sockaddr_in));
+
+        if (grown == NULL)
+        {
+            return(FALSE);
+        }
+
+        if (out->count > 0)
+        {
+            memcpy(grown, out->subscribers,
+                out->count * sizeof(struct sockaddr_in));
+        }
+
+        free(out->subscribers);
+        out->subscribers = grown;
+        out->size = size;
+    }
+
+    out->subscribers[out->count] = *addr;
+    out->count++;
+    out->forceKey = TRUE;
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : RemoveSubscriber
+*   Description: Removes an address from the subscribers.  The last
+*                subscriber takes its place.
+*   Parameters : out - subscribers
+*                addr - address and port to stop sending mixes to
+*   Effects    : addr is unsubscribed, if it was subscribed.
+*   Returned   : None
+**************************************************************************/
+void RemoveSubscriber(OUTPUT *out, struct sockaddr_in *addr)
+{
+    int i;
+
+    i = FindSubscriber(out, addr);
+
+    if (i >= 0)
+    {
+        out->count--;
+        out->subscribers[i] = out->subscribers[out->count];
+    }
+}
+
+/**************************************************************************
+*   Function   : FreeOutput
+*   Description: Frees the subscribers and the arrays a mix, its tiles
+*                and its reduced levels are packed in.  The mix sent last
+*                is forgotten, so the next goes out full.
+*   Parameters : out - subscribers
+*   Effects    : out has no subscribers, and nothing allocated.
+*   Returned   : None
+**************************************************************************/
+void FreeOutput(OUTPUT *out)
+{
+    LEVEL *level;
+    int i;
+
+    for (i = 1; i <= MAX_LEVEL; i++)
+    {
+        level = &out->levels[i];
+        free(level->grid.cells);
+        free(level->dirty);
+        free(level->list);
+        free(level->packed);
+        FreeDatagrams(&level->cut);
+        bzero(level, sizeof(LEVEL));
+    }
+
+    free(out->levelSubs);
+    free(out->previous);
+    out->levelSubs = NULL;
+    out->previous = NULL;
+    out->levelCount = 0;
+    out->levelSize = 0;
+    out->previousSize = 0;
+    out->pyramidRows = 0;
+
+    free(out->subscribers);
+    free(out->packed);
+    free(out->reference);
+    free(out->delta);
+    FreeDatagrams(&out->mix);
+    free(out->regionSubs);
+    free(out->tiles);
+    free(out->tileDatagrams);
+    free(out->changed);
+    free(out->marks);
+    out->subscribers = NULL;
+    out->packed = NULL;
+    out->reference = NULL;
+    out->delta = NULL;
+    out->count = 0;
+    out->size = 0;
+    out->packedSize = 0;
+    out->forceKey = TRUE;
+    out->regionSubs = NULL;
+    out->tiles = NULL;
+    out->tileDatagrams = NULL;
+    out->changed = NULL;
+    out->marks = NULL;
+    out->regionCount = 0;
+    out->regionSize = 0;
+    out->tilesSize = 0;
+}
+
+/**************************************************************************
+*   Function   : PublishMix
+*   Description: Sends a mixed grid to the multicast group, if there is
+*                one, and to every subscriber, the tiles they want to
+*                subscribers to rectangles, and reduced grids to
+*                subscribers to levels.  The grid, its tiles and its
+*                levels are packed once, however many subscribers there
+*                are, and the datagrams for all of them are sent in
+*                batches of SEND_BATCH, each with one sendmmsg.  Holds
+*                outputLock, so receive workers can't change the
+*                subscribers while they are being sent to.
+*   Parameters : out - subscribers
+*                shown - mixed grid
+*   Effects    : The grid's datagrams are sent, and counted in out.
+*   Returned   : None
+**************************************************************************/
+void PublishMix(OUTPUT *out, GRID *shown)
+{
+    struct sockaddr_in *addr;
+    int count, batched, first, i, j;
+
+    pthread_mutex_lock(&outputLock);
+    batched = 0;
+
+    if ((out->count > 0) || out->group.sin_port)
+    {
+        count = PackOutput(out, shown);
+
+        /* The group, if there is one, goes before the subscribers */
+        first = out->group.sin_port ? -1 : 0;
+
+        for (i = first; (count > 0) && (i < out->count); i++)
+        {
+            addr = (i < 0) ? &out->group : &out->subscribers[i];
+
+            for (j = 0; j < count; j++)
+            {
+                OUTPUT_MSG(out, batched).msg_name = addr;
+                OUTPUT_MSG(out, batched).msg_iov =
+                    &out->mix.datagrams[j];
+                batched++;
+
+                if (batched == SEND_BATCH)
+                {
+                    SendOutput(out, batched);
+                    batched = 0;
+                }
+            }
+        }
+    }
+
+    if ((out->regionCount > 0) && PackTiles(out, shown))
+    {
+        batched = QueueTiles(out, batched);
+    }
+
+    if (out->levelCount > 0)
+    {
+        UpdatePyramid(out, shown);
+        batched = QueueLevels(out, batched);
+    }
+
+    SendOutput(out, batched);
+    pthread_mutex_unlock(&outputLock);
+}
+
+/**************************************************************************
+*   Function   : PackOutput
+*   Description: Packs a mixed grid in nibbles, codes it as a delta if
+*                ChooseOutput says so, and cuts the result with
+*                CutDatagrams.  The arrays only grow when the grid does.
+*   Parameters : out - subscribers, with the arrays to pack into
+*                shown - mixed grid
+*   Effects    : out->mix points at the whole packet, or at each of its
+*                fragments.  The packed mix becomes out->reference for
+*                the next delta, unless it can't be sent, in which case
+*                the next mix is sent in full.
+*   Returned   : Number of datagrams to send.  0 if the grid could not be
+*                packed.
+**************************************************************************/
+int PackOutput(OUTPUT *out, GRID *shown)
+{
+    BYTE *packet;
+    int size, count;
+
+    size = PackedNibblesSize(shown->rows, shown->cols);
+
+    if (size > out->packedSize)
+    {
+        free(out->packed);
+        free(out->reference);
+        free(out->delta);
+        out->packed = (BYTE *)CountedMalloc(size);
+        out->reference = (BYTE *)CountedMalloc(size);
+        out->delta = (BYTE *)CountedMalloc(size);
+        out->packedSize = size;
+        out->forceKey = TRUE;
+
+        if ((out->packed == NULL) || (out->reference == NULL) ||
+            (out->delta == NULL))
+        {
+            free(out->packed);
+            free(out->reference);
+            free(out->delta);
+            out->packed = NULL;
+            out->reference = NULL;
+            out->delta = NULL;
+            out->packedSize = 0;
+        }
+    }
+
+    if (!PackGridToNibblesBuf(shown, out->packed, out->packedSize))
+    {
+        PutFormattedLine(23, 0, "Unable to pack mix for subscribers");
+        out->forceKey = TRUE;
+        return(0);
+    }
+
+    packet = ChooseOutput(out, &size);
+    count = CutDatagrams(out, packet, size, &out->mix);
+
+    if (count == 0)
+    {
+        /* Nobody gets this mix, so the next can't be a delta from it */
+        out->forceKey = TRUE;
+    }
+
+    return(count);
+}
+
+/**************************************************************************
+*   Function   : ChooseOutput
+*   Description: Decides whether a packed mix goes out in full or as a
+*                delta from the last mix published.  A delta is sent when
+*                deltas are on, a full mix is not due, and the delta is
+*                smaller than the mix.  Subscribers rebuild each mix from
+*                the one before, so a full mix is sent every keyInterval
+*                mixes, and after anything that could leave a subscriber
+*                without the delta's base.
+*   Parameters : out - subscribers, with the mix in out->packed
+*                size - bytes in out->packed, set to bytes in the packet
+*   Effects    : The delta, if chosen, is coded into out->delta.
+*                out->packed and out->reference are swapped, so the mix
+*                is the reference for the next delta, and counted as a
+*                full mix or delta.
+*   Returned   : The packet to send, in out->reference or out->delta.
+**************************************************************************/
+BYTE *ChooseOutput(OUTPUT *out, int *size)
+{
+    BYTE *packet, *swap;
+    int deltaSize;
+
+    deltaSize = 0;
+
+    if ((out->keyInterval > 0) && !out->forceKey &&
+        (out->sinceKey < out->keyInterval))
+    {
+        deltaSize = PackNibblesToDelta(out->packed, out->reference,
+            out->delta, *size);
+    }
+
+    swap = out->reference;
+    out->reference = out->packed;
+    out->packed = swap;
+    out->forceKey = FALSE;
+
+    if (deltaSize > 0)
+    {
+        packet = out->delta;
+        *size = deltaSize;
+        out->sinceKey++;
+        out->deltas++;
+    }
+    else
+    {
+        packet = out->reference;
+        out->sinceKey = 1;
+        out->keys++;
+    }
+
+    return(packet);
+}
+
+/**************************************************************************
+*   Function   : CutDatagrams
+*   Description: Cuts a packet into fragments if it does not fit in an
+*                OUTPUT_DATAGRAM.  The fragments only grow when packets
+*                do.
+*   Parameters : out - subscribers, with the last frame id used
+*                packet - packet to send
+*                size - bytes in packet
+*                cut - fragments to cut packet into
+*   Effects    : cut->datagrams points at the whole packet, or at each
+*                of its fragments in cut->fragments.
+*   Returned   : Number of datagrams to send.  0 if there was no memory
+*                for the fragments.
+**************************************************************************/
+int CutDatagrams(OUTPUT *out, BYTE *packet, int size, DATAGRAMS *cut)
+{
+    int count, i;
+
+    count = FragmentCount(size, OUTPUT_DATAGRAM);
+
+    if (count > cut->fragmentsSize)
+    {
+        FreeDatagrams(cut);
+        cut->fragments = (BYTE *)CountedMalloc(count * OUTPUT_DATAGRAM);
+        cut->datagrams = (struct iovec *)CountedMalloc(count *
+            sizeof(struct iovec));
+        cut->fragmentsSize = count;
+
+        if ((cut->fragments == NULL) || (cut->datagrams == NULL))
+        {
+            FreeDatagrams(cut);
+        }
+    }
+
+    if ((count == 0) || (count > cut->fragmentsSize))
+    {
+        PutFormattedLine(23, 0, "Unable to fragment for subscribers");
+        return(0);
+    }
+
+    if (count == 1)
+    {
+        cut->datagrams[0].iov_base = packet;
+        cut->datagrams[0].iov_len = size;
+        return(1);
+    }
+
+    out->frameID++;
+
+    for (i = 0; i < count; i++)
+    {
+        cut->datagrams[i].iov_base = &cut->fragments[i * OUTPUT_DATAGRAM];
+        cut->datagrams[i].iov_len = PackFragmentBuf(packet, size,
+            out->frameID, i, count, cut->datagrams[i].iov_base,
+            OUTPUT_DATAGRAM);
+    }
+
+    return(count);
+}
+
+/**************************************************************************
+*   Function   : FreeDatagrams
+*   Description: Frees the fragments a packet is cut into.
+*   Parameters : cut - fragments
+*   Effects    : cut has nothing allocated.
+*   Returned   : None
+**************************************************************************/
+void FreeDatagrams(DATAGRAMS *cut)
+{
+    free(cut->fragments);
+    free(cut->datagrams);
+    cut->fragments = NULL;
+    cut->datagrams = NULL;
+    cut->fragmentsSize = 0;
+}
+
+/**************************************************************************
+*   Function   : SetRegions
+*   Description: Subscribes an address to rectangles of the mix, in place
+*                of any it had, growing the list like AddSubscriber.
+*                Empty rectangles are ignored.
+*   Parameters : out - subscribers
+*                addr - address and port to send tiles to
+*                packet - region packet passed by ValidateHeader
+*                size - number of bytes in packet
+*   Effects    : addr is sent every tile touching its rectangles after
+*                the next mix, then only those that changed.
+*   Returned   : TRUE on success, FALSE if the list could not grow or
+*                MAX_SUBSCRIBERS addresses are already sent output.
+**************************************************************************/
+int SetRegions(OUTPUT *out, struct sockaddr_in *addr, BYTE *packet,
+    int size)
+{
+    REGION_SUBSCRIBER *sub, *grown;
+    REGION *region;
+    int i, pos;
+
+    for (i = 0; i < out->regionCount; i++)
+    {
+        if ((out->regionSubs[i].addr.sin_addr.s_addr ==
+            addr->sin_addr.s_addr) &&
+            (out->regionSubs[i].addr.sin_port == addr->sin_port))
+        {
+            break;
+        }
+    }
+
+    if ((i == out->regionCount) &&
+        (CountSubscribers(out) >= MAX_SUBSCRIBERS))
+    {
+        return(FALSE);
+    }
+
+    if (i == out->regionSize)
+    {
+        out->regionSize = (out->regionSize == 0) ? MIN_SUBSCRIBERS :
+            2 * out->regionSize;
+        grown = (REGION_SUBSCRIBER *)CountedMalloc(out->regionSize *
+            sizeof(REGION_SUBSCRIBER));
+
+        if (grown == NULL)
+        {
+            out->regionSize = out->regionCount;
+            return(FALSE);
+        }
+
+        if (out->regionCount > 0)
+        {
+            memcpy(grown, out->regionSubs,
+                out->regionCount * sizeof(REGION_SUBSCRIBER));
+        }
+
+        free(out->regionSubs);
+        out->regionSubs = grown;
+    }
+
+    if (i == out->regionCount)
+    {
+        out->regionCount++;
+    }
+
+    sub = &out->regionSubs[i];
+    sub->addr = *addr;
+    sub->count = 0;
+    sub->fresh = TRUE;
+
+    for (pos = REGION_POS; pos + REGION_SIZE <= size; pos += REGION_SIZE)
+    {
+        region = &sub->regions[sub->count];
+        region->row = GetBigEndian(packet, pos, 2);
+        region->col = GetBigEndian(packet, pos + 2, 2);
+        region->rows = GetBigEndian(packet, pos + 4, 2);
+        region->cols = GetBigEndian(packet, pos + 6, 2);
+
+        if ((region->rows > 0) && (region->cols > 0) &&
+            (sub->count < MAX_REGIONS))
+        {
+            sub->count++;
+        }
+    }
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : RemoveRegions
+*   Description: Removes an address from the subscribers to rectangles.
+*                The last of them takes its place.
+*   Parameters : out - subscribers
+*                addr - address and port to stop sending tiles to
+*   Effects    : addr is not sent tiles, if it was.
+*   Returned   : None
+**************************************************************************/
+void RemoveRegions(OUTPUT *out, struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < out->regionCount; i++)
+    {
+        if ((out->regionSubs[i].addr.sin_addr.s_addr ==
+            addr->sin_addr.s_addr) &&
+            (out->regionSubs[i].addr.sin_port == addr->sin_port))
+        {
+            out->regionCount--;
+            out->regionSubs[i] = out->regionSubs[out->regionCount];
+            return;
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : PackTiles
+*   Description: Cuts a mixed grid into TILE_SIZE by TILE_SIZE tiles,
+*                packs each in nibbles, and notes which differ from the
+*                tile of the mix before.  Every tile is packed once a mix,
+*                however many subscribers want it.  The arrays only grow
+*                when the grid does, and every tile counts as changed when
+*                its size does.
+*   Parameters : out - subscribers, with the arrays to pack into
+*                shown - mixed grid
+*   Effects    : out->tiles holds each packed tile, with its packet in
+*                out->tileDatagrams, and out->changed is TRUE for each
+*                tile that changed.
+*   Returned   : TRUE if the tiles were packed, FALSE if there was no
+*                memory for them.
+**************************************************************************/
+int PackTiles(OUTPUT *out, GRID *shown)
+{
+    BYTE *tile;
+    int count, allChanged, size, i;
+
+    out->tilesDown = (shown->rows + TILE_SIZE - 1) / TILE_SIZE;
+    out->tilesAcross = (shown->cols + TILE_SIZE - 1) / TILE_SIZE;
+    count = out->tilesDown * out->tilesAcross;
+    allChanged = (shown->rows != out->tiledRows) ||
+        (shown->cols != out->tiledCols);
+
+    if (count > out->tilesSize)
+    {
+        free(out->tiles);
+        free(out->tileDatagrams);
+        free(out->changed);
+        free(out->marks);
+        out->tiles = (BYTE *)CountedMalloc(count * TILE_BYTES);
+        out->tileDatagrams = (struct iovec *)CountedMalloc(count *
+            sizeof(struct iovec));
+        out->changed = (char *)CountedMalloc(count);
+        out->marks = (unsigned *)CountedMalloc(count * sizeof(unsigned));
+        out->tilesSize = count;
+
+        if ((out->tiles == NULL) || (out->tileDatagrams == NULL) ||
+            (out->changed == NULL) || (out->marks == NULL))
+        {
+            free(out->tiles);
+            free(out->tileDatagrams);
+            free(out->changed);
+            free(out->marks);
+            out->tiles = NULL;
+            out->tileDatagrams = NULL;
+            out->changed = NULL;
+            out->marks = NULL;
+            out->tilesSize = 0;
+            out->tiledRows = 0;
+            PutFormattedLine(23, 0, "Unable to pack tiles for subscribers");
+            return(FALSE);
+        }
+
+        memset(out->marks, 0, count * sizeof(unsigned));
+        allChanged = TRUE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        tile = &out->tiles[i * TILE_BYTES];
+        size = PackTileToNibblesBuf(shown,
+            (i / out->tilesAcross) * TILE_SIZE,
+            (i % out->tilesAcross) * TILE_SIZE, TILE_SIZE, TILE_SIZE,
+            out->scratch, TILE_BYTES);
+
+        /* Time stamps and sequence numbers always differ */
+        out->changed[i] = allChanged ||
+            memcmp(&out->scratch[TILE_ROW_POS], &tile[TILE_ROW_POS],
+            size - TILE_ROW_POS);
+
+        memcpy(tile, out->scratch, size);
+        out->tileDatagrams[i].iov_base = tile;
+        out->tileDatagrams[i].iov_len = size;
+    }
+
+    out->tiledRows = shown->rows;
+    out->tiledCols = shown->cols;
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : QueueTiles
+*   Description: Adds the tiles each subscriber to rectangles wants to a
+*                batch of datagrams, sending the batch whenever it fills.
+*                A subscriber is sent each tile its rectangles touch once,
+*                however many touch it, and only if the tile changed,
+*                unless the subscriber is fresh.
+*   Parameters : out - subscribers, with tiles packed by PackTiles
+*                batched - datagrams already in the batch
+*   Effects    : The tiles are queued or sent, and no subscriber is
+*                fresh.
+*   Returned   : Datagrams left in the batch.
+**************************************************************************/
+int QueueTiles(OUTPUT *out, int batched)
+{
+    REGION_SUBSCRIBER *sub;
+    REGION *region;
+    int i, j, row, col, lastRow, lastCol, tile;
+
+    for (i = 0; i < out->regionCount; i++)
+    {
+        sub = &out->regionSubs[i];
+        out->mark++;
+
+        for (j = 0; j < sub->count; j++)
+        {
+            region = &sub->regions[j];
+            lastRow = (region->row + region->rows - 1) / TILE_SIZE;
+            lastCol = (region->col + region->cols - 1) / TILE_SIZE;
+            lastRow = (lastRow < out->tilesDown) ? lastRow :
+                (out->tilesDown - 1);
+            lastCol = (lastCol < out->tilesAcross) ? lastCol :
+                (out->tilesAcross - 1);
+
+            for (row = region->row / TILE_SIZE; row <= lastRow; row++)
+            {
+                for (col = region->col / TILE_SIZE; col <= lastCol; col++)
+                {
+                    tile = (row * out->tilesAcross) + col;
+
+                    if ((out->marks[tile] == out->mark) ||
+                        (!out->changed[tile] && !sub->fresh))
+                    {
+                        continue;
+                    }
+
+                    out->marks[tile] = out->mark;
+                    OUTPUT_MSG(out, batched).msg_name = &sub->addr;
+                    OUTPUT_MSG(out, batched).msg_iov =
+                        &out->tileDatagrams[tile];
+                    batched++;
+
+                    if (batched == SEND_BATCH)
+                    {
+                        SendOutput(out, batched);
+                        batched = 0;
+                    }
+                }
+            }
+        }
+
+        sub->fresh = FALSE;
+    }
+
+    return(batched);
+}
+
+/**************************************************************************
+*   Function   : SetLevel
+*   Description: Subscribes an address to the mix halved level times in
+*                each direction, in place of any level it had, growing
+*                the list like AddSubscriber.
+*   Parameters : out - subscribers
+*                addr - address and port to send the level to
+*                level - 1 to MAX_LEVEL
+*   Effects    : addr is sent the level after every mix.
+*   Returned   : TRUE on success, FALSE if the list could not grow or
+*                MAX_SUBSCRIBERS addresses are already sent output.
+**************************************************************************/
+int SetLevel(OUTPUT *out, struct sockaddr_in *addr, int level)
+{
+    LEVEL_SUBSCRIBER *grown;
+    int i;
+
+    for (i = 0; i < out->levelCount; i++)
+    {
+        if ((out->levelSubs[i].addr.sin_addr.s_addr ==
+            addr->sin_addr.s_addr) &&
+            (out->levelSubs[i].addr.sin_port == addr->sin_port))
+        {
+            break;
+        }
+    }
+
+    if ((i == out->levelCount) &&
+        (CountSubscribers(out) >= MAX_SUBSCRIBERS))
+    {
+        return(FALSE);
+    }
+
+    if (i == out->levelSize)
+    {
+        out->levelSize = (out->levelSize == 0) ? MIN_SUBSCRIBERS :
+            2 * out->levelSize;
+        grown = (LEVEL_SUBSCRIBER *)CountedMalloc(out->levelSize *
+            sizeof(LEVEL_SUBSCRIBER));
+
+        if (grown == NULL)
+        {
+            out->levelSize = out->levelCount;
+            return(FALSE);
+        }
+
+        if (out->levelCount > 0)
+        {
+            memcpy(grown, out->levelSubs,
+                out->levelCount * sizeof(LEVEL_SUBSCRIBER));
+        }
+
+        free(out->levelSubs);
+        out->levelSubs = grown;
+    }
+
+    if (i == out->levelCount)
+    {
+        out->levelCount++;
+    }
+
+    out->levelSubs[i].addr = *addr;
+    out->levelSubs[i].level = level;
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : RemoveLevel
+*   Description: Removes an address from the subscribers to levels.  The
+*                last of them takes its place.
+*   Parameters : out - subscribers
+*                addr - address and port to stop sending levels to
+*   Effects    : addr is not sent a level, if it was.
+*   Returned   : None
+**************************************************************************/
+void RemoveLevel(OUTPUT *out, struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < out->levelCount; i++)
+    {
+        if ((out->levelSubs[i].addr.sin_addr.s_addr ==
+            addr->sin_addr.s_addr) &&
+            (out->levelSubs[i].addr.sin_port == addr->sin_port))
+        {
+            out->levelCount--;
+            out->levelSubs[i] = out->levelSubs[out->levelCount];
+            return;
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : BuildPyramid
+*   Description: Sizes every level of the pyramid for a mix, and reduces
+*                every cell of every level from the one below.  Only done
+*                for the first mix, and when the mix changes size.  The
+*                arrays only grow when the grid does.
+*   Parameters : out - subscribers, with the pyramid
+*                shown - mixed grid
+*   Effects    : Each level is (rows + 1) / 2 by (cols + 1) / 2 of the
+*                one below, and out->previous holds shown's cells.
+*   Returned   : TRUE on success, FALSE if there was no memory.
+**************************************************************************/
+int BuildPyramid(OUTPUT *out, GRID *shown)
+{
+    LEVEL *level;
+    GRID *fine;
+    int numCells, i, row, col;
+
+    out->pyramidRows = 0;
+    numCells = shown->rows * shown->cols;
+
+    if (numCells > out->previousSize)
+    {
+        free(out->previous);
+        out->previous = (char *)CountedMalloc(numCells);
+        out->previousSize = (out->previous == NULL) ? 0 : numCells;
+
+        if (out->previous == NULL)
+        {
+            return(FALSE);
+        }
+    }
+
+    memcpy(out->previous, shown->cells, numCells);
+    fine = shown;
+
+    for (i = 1; i <= MAX_LEVEL; i++)
+    {
+        level = &out->levels[i];
+        level->grid.rows = (fine->rows + 1) / 2;
+        level->grid.cols = (fine->cols + 1) / 2;
+        level->listCount = 0;
+        numCells = level->grid.rows * level->grid.cols;
+
+        if (numCells > level->cellsSize)
+        {
+            free(level->grid.cells);
+            free(level->dirty);
+            free(level->list);
+            level->grid.cells = (char *)CountedMalloc(numCells);
+            level->dirty = (char *)CountedMalloc(numCells);
+            level->list = (int *)CountedMalloc(numCells * sizeof(int));
+            level->cellsSize = numCells;
+
+            if ((level->grid.cells == NULL) || (level->dirty == NULL) ||
+                (level->list == NULL))
+            {
+                free(level->grid.cells);
+                free(level->dirty);
+                free(level->list);
+                level->grid.cells = NULL;
+                level->dirty = NULL;
+                level->list = NULL;
+                level->cellsSize = 0;
+                return(FALSE);
+            }
+        }
+
+        memset(level->dirty, FALSE, numCells);
+
+        for (row = 0; row < level->grid.rows; row++)
+        {
+            for (col = 0; col < level->grid.cols; col++)
+            {
+                ReduceCell(fine, &level->grid, row, col);
+            }
+        }
+
+        fine = &level->grid;
+    }
+
+    out->pyramidRows = shown->rows;
+    out->pyramidCols = shown->cols;
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : UpdatePyramid
+*   Description: Brings the pyramid up to date with a new mix.  The mix
+*                is compared with the cells the pyramid was reduced from
+*                a word at a time, and only the cells above those that
+*                changed are reduced again, level by level, stopping
+*                where a reduced cell comes out the same.  A few changes
+*                in a large mix cost little more than the compare.
+*   Parameters : out - subscribers, with the pyramid
+*                shown - mixed grid
+*   Effects    : Every level is reduced from shown, and each level's
+*                grid has shown's time stamp and sequence number.
+*   Returned   : None
+**************************************************************************/
+void UpdatePyramid(OUTPUT *out, GRID *shown)
+{
+    unsigned long long word, previousWord;
+    LEVEL *level;
+    GRID *fine;
+    int numCells, cell, end, i, j;
+
+    if ((shown->rows != out->pyramidRows) ||
+        (shown->cols != out->pyramidCols))
+    {
+        if (!BuildPyramid(out, shown))
+        {
+            PutFormattedLine(23, 0, "Unable to reduce mix for subscribers");
+        }
+    }
+    else
+    {
+        /* Find the changed cells, whole words first */
+        numCells = shown->rows * shown->cols;
+        level = &out->levels[1];
+
+        for (cell = 0; cell < numCells; cell = end)
+        {
+            end = cell + sizeof(word);
+
+            if (end <= numCells)
+            {
+                memcpy(&word, &shown->cells[cell], sizeof(word));
+                memcpy(&previousWord, &out->previous[cell], sizeof(word));
+
+                if (word == previousWord)
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                end = numCells;
+            }
+
+            for (i = cell; i < end; i++)
+            {
+                if (shown->cells[i] != out->previous[i])
+                {
+                    out->previous[i] = shown->cells[i];
+                    MarkDirty(level, (i / shown->cols) / 2,
+                        (i % shown->cols) / 2);
+                }
+            }
+        }
+
+        /* Reduce them, and the cells above the ones that changed */
+        fine = shown;
+
+        for (i = 1; i <= MAX_LEVEL; i++)
+        {
+            level = &out->levels[i];
+
+            for (j = 0; j < level->listCount; j++)
+            {
+                cell = level->list[j];
+                level->dirty[cell] = FALSE;
+
+                if (ReduceCell(fine, &level->grid, cell / level->grid.cols,
+                    cell % level->grid.cols) && (i < MAX_LEVEL))
+                {
+                    MarkDirty(&out->levels[i + 1],
+                        (cell / level->grid.cols) / 2,
+                        (cell % level->grid.cols) / 2);
+                }
+            }
+
+            level->listCount = 0;
+            fine = &level->grid;
+        }
+    }
+
+    for (i = 1; i <= MAX_LEVEL; i++)
+    {
+        out->levels[i].grid.timeStamp = shown->timeStamp;
+        out->levels[i].grid.sequenceNumber = shown->sequenceNumber;
+        out->levels[i].count = 0;
+    }
+}
+
+/**************************************************************************
+*   Function   : MarkDirty
+*   Description: Queues a cell of a level to be reduced again, if it is
+*                not already queued.
+*   Parameters : level - level of the pyramid
+*                row - row of the cell
+*                col - column of the cell
+*   Effects    : The cell is in level->list.
+*   Returned   : None
+**************************************************************************/
+void MarkDirty(LEVEL *level, int row, int col)
+{
+    int cell;
+
+    cell = (row * level->grid.cols) + col;
+
+    if (!level->dirty[cell])
+    {
+        level->dirty[cell] = TRUE;
+        level->list[level->listCount] = cell;
+        level->listCount++;
+    }
+}
+
+/**************************************************************************
+*   Function   : QueueLevels
+*   Description: Adds the level each subscriber to levels wants to a
+*                batch of datagrams, sending the batch whenever it fills.
+*                A level is packed in nibbles the first time a subscriber
+*                wants it in a mix, and the same datagrams are queued for
+*                every subscriber that wants it after.
+*   Parameters : out - subscribers, with the pyramid updated by
+*                      UpdatePyramid
+*                batched - datagrams already in the batch
+*   Effects    : The levels are packed, and queued or sent.
+*   Returned   : Datagrams left in the batch.
+**************************************************************************/
+int QueueLevels(OUTPUT *out, int batched)
+{
+    LEVEL *level;
+    int size, i, j;
+
+    if (out->pyramidRows == 0)
+    {
+        return(batched);
+    }
+
+    for (i = 0; i < out->levelCount; i++)
+    {
+        level = &out->levels[out->levelSubs[i].level];
+
+        if (level->count == 0)
+        {
+            size = PackedNibblesSize(level->grid.rows, level->grid.cols);
+
+            if (size > level->packedSize)
+            {
+                free(level->packed);
+                level->packed = (BYTE *)CountedMalloc(size);
+                level->packedSize = (level->packed == NULL) ? 0 : size;
+            }
+
+            size = PackGridToNibblesBuf(&level->grid, level->packed,
+                level->packedSize);
+            level->count = (size == 0) ? 0 :
+                CutDatagrams(out, level->packed, size, &level->cut);
+        }
+
+        for (j = 0; j < level->count; j++)
+        {
+            OUTPUT_MSG(out, batched).msg_name = &out->levelSubs[i].addr;
+            OUTPUT_MSG(out, batched).msg_iov = &level->cut.datagrams[j];
+            batched++;
+
+            if (batched == SEND_BATCH)
+            {
+                SendOutput(out, batched);
+                batched = 0;
+            }
+        }
+    }
+
+    return(batched);
+}
+
+/**************************************************************************
+*   Function   : SendOutput
+*   Description: Sends a batch of datagrams set up by PublishMix.  A
+*                datagram the socket will not take is counted as failed
+*                and skipped, and the rest of the batch is still sent.
+*                A subscriber that misses any datagram of a mix can't
+*                apply a delta from it, so if one of the mix's datagrams
+*                fails, the next mix goes out in full.
+*   Parameters : out - subscribers, with the batch in out->msgs
+*                batched - datagrams in the batch
+*   Effects    : The datagrams are sent on socketFD, and counted as sent
+*                or failed.  out->forceKey is set if a datagram of
+*                out->mix failed.
+*   Returned   : None
+**************************************************************************/
+void SendOutput(OUTPUT *out, int batched)
+{
+    struct iovec *iov;
+    int done, sent, i;
+
+    for (i = 0; i < batched; i++)
+    {
+        OUTPUT_MSG(out, i).msg_iovlen = 1;
+        OUTPUT_MSG(out, i).msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    for (done = 0; done < batched; done += sent)
+    {
+#ifdef BATCH_SEND
+        sent = sendmmsg(socketFD, &out->msgs[done], batched - done, 0);
+#else
+        sent = (sendmsg(socketFD, &out->msgs[done], 0) < 0) ? -1 : 1;
+#endif
+
+        if (sent <= 0)
+        {
+            /* Skip the datagram that failed */
+            iov = OUTPUT_MSG(out, done).msg_iov;
+            out->failed++;
+            sent = 1;
+
+            if ((iov >= out->mix.datagrams) &&
+                (iov < out->mix.datagrams + out->mix.fragmentsSize))
+            {
+                out->forceKey = TRUE;
+            }
+        }
+        else
+        {
+            out->sent += sent;
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : DoSharded
+*   Description: Receives and mixes with a thread for each socket in
+*                socketFDs.  Each worker keeps its own shard of the
+*                clients, so workers never share a client or a lock while
+*                receiving grids.  Only subscription changes take
+*                outputLock.  When the clock fires, every worker is woken
+*                to make a partial sum of its shard, the workers and this
+*                thread meet at a barrier, and this thread adds the
+*                partial sums up, rounds them and shows the result.  The
+*                workers wait at a second barrier until the partial sums
+*                have been read.
+*   Parameters : None
+*   Effects    : Clients are updated and mixed until leaving clients have
+*                emptied every shard.
+*   Returned   : None
+**************************************************************************/
+void DoSharded(void)
+{
+#ifdef RECEIVE_WORKERS
+    WORKER *list;                       /* One for each socket */
+    MIXER total;                        /* Sum of the partial sums */
+    GRID *shown;                        /* Grid shown for this mix */
+    struct timespec deadline;           /* When the next mix is due */
+    struct epoll_event events[2];       /* Socket and wake up */
+    struct pollfd clock;
+    unsigned long long wake = 1;
+    unsigned long calls, received;
+    int i, empty, ended;
+
+    InitMixer(&total);
+    list = (WORKER *)CountedMalloc(workers * sizeof(WORKER));
+
+    if (list == NULL)
+    {
+        CloseScreen();
+        perror("Unable to allocate workers");
+        exit(1);
+    }
+
+    pthread_barrier_init(&mixBarrier, NULL, workers + 1);
+
+    for (i = 0; i < workers; i++)
+    {
+        list[i].socketFD = socketFDs[i];
+        list[i].wakeFD = eventfd(0, EFD_NONBLOCK);
+        list[i].pollFD = epoll_create1(0);
+        list[i].ring = (RECV_RING *)CountedMalloc(sizeof(RECV_RING));
+        list[i].partial = NULL;
+        list[i].ended = FALSE;
+        InitMixer(&list[i].mixer);
+
+        events[0].events = EPOLLIN;
+        events[0].data.fd = list[i].socketFD;
+        events[1].events = EPOLLIN;
+        events[1].data.fd = list[i].wakeFD;
+
+        if ((list[i].wakeFD == -1) || (list[i].pollFD == -1) ||
+            (list[i].ring == NULL) ||
+            (epoll_ctl(list[i].pollFD, EPOLL_CTL_ADD, list[i].socketFD,
+                &events[0]) != 0) ||
+            (epoll_ctl(list[i].pollFD, EPOLL_CTL_ADD, list[i].wakeFD,
+                &events[1]) != 0))
+        {
+            CloseScreen();
+            perror("Unable to start receive worker");
+            exit(1);
+        }
+
+        InitRing(list[i].ring);
+        list[i].mixer.ring = list[i].ring;
+    }
+
+    clock.fd = InitClock(&deadline);
+    clock.events = POLLIN;
+
+    if (clock.fd == -1)
+    {
+        CloseScreen();
+        fprintf(stderr, "Receive workers need the proxy's clock\n");
+        exit(1);
+    }
+
+    for (i = 0; i < workers; i++)
+    {
+        if (pthread_create(&list[i].thread, NULL, ReceiveWorker,
+            &list[i]) != 0)
+        {
+            CloseScreen();
+            perror("Unable to start receive worker");
+            exit(1);
+        }
+
+        if (firstCore >= 0)
+        {
+            PinThread(list[i].thread, firstCore + i);
+        }
+    }
+
+    if (firstCore >= 0)
+    {
+        PinThread(pthread_self(), firstCore + workers);
+    }
+
+    while (!stopping)
+    {
+        if ((poll(&clock, 1, -1) <= 0) || !ClockFired(clock.fd, &deadline))
+        {
+            continue;
+        }
+
+        for (i = 0; i < workers; i++)
+        {
+            write(list[i].wakeFD, &wake, sizeof(wake));
+        }
+
+        /* Partial sums are ready */
+        pthread_barrier_wait(&mixBarrier);
+
+        shown = ReduceShards(list, &total);
+        calls = 0;
+        received = 0;
+        empty = TRUE;
+        ended = FALSE;
+
+        for (i = 0; i < workers; i++)
+        {
+            calls += list[i].ring->calls;
+            received += list[i].ring->received;
+            empty = empty && (list[i].mixer.store.count == 0);
+            ended = ended || list[i].ended;
+            list[i].ended = FALSE;
+        }
+
+        if (shown != NULL)
+        {
+            shown->sequenceNumber = ++total.sequenceNumber;
+            gettimeofday(&shown->timeStamp, NULL);
+            ShowMix(shown,
+                running ? "sharded running sum" : "sharded vector",
+                calls, received);
+            PublishMix(&output, shown);
+        }
+
+        /* Stop once an end has left every shard empty */
+        stopping = empty && ended;
+
+        /* Partial sums have been read */
+        pthread_barrier_wait(&mixBarrier);
+    }
+
+    for (i = 0; i < workers; i++)
+    {
+        pthread_join(list[i].thread, NULL);
+        close(list[i].wakeFD);
+        close(list[i].pollFD);
+        close(list[i].socketFD);
+        free(list[i].ring);
+        FreeMixer(&list[i].mixer);
+    }
+
+    pthread_barrier_destroy(&mixBarrier);
+    close(clock.fd);
+    free(list);
+    FreeMixer(&total);
+    CloseScreen();
+#endif
+}
+
+#ifdef RECEIVE_WORKERS
+/**************************************************************************
+*   Function   : ReceiveWorker
+*   Description: Body of a receive thread.  Receives datagrams on the
+*                worker's own socket into its own shard of the clients,
+*                until it is woken for a mix.  Then it makes a partial sum
+*                of its shard and meets the mixer at the mix barriers.
+*   Parameters : arg - the thread's WORKER
+*   Effects    : The worker's shard is updated and summed.
+*   Returned   : NULL, once the mixer is stopping.
+**************************************************************************/
+void *ReceiveWorker(void *arg)
+{
+    WORKER *worker;
+    struct epoll_event events[2];
+    unsigned long long value;
+    BYTE *packet;
+    int ready, readable, wake, count, next, size, i;
+
+    worker = (WORKER *)arg;
+
+    while (1)
+    {
+        ready = epoll_wait(worker->pollFD, events, 2, -1);
+        readable = FALSE;
+        wake = FALSE;
+
+        for (i = 0; i < ready; i++)
+        {
+            if (events[i].data.fd == worker->wakeFD)
+            {
+                wake = TRUE;
+            }
+            else
+            {
+                readable = TRUE;
+            }
+        }
+
+        if (wake && (read(worker->wakeFD, &value, sizeof(value)) > 0))
+        {
+            worker->partial = PartialSum(&worker->mixer);
+
+            /* Partial sum is ready, wait for it to be read */
+            pthread_barrier_wait(&mixBarrier);
+            pthread_barrier_wait(&mixBarrier);
+
+            if (stopping)
+            {
+                break;
+            }
+        }
+
+        count = readable ? ReceiveBatch(worker->socketFD, worker->ring) : 0;
+
+        for (next = 0; next < count; next++)
+        {
+            packet = worker->ring->packets[next];
+            size = worker->ring->sizes[next];
+
+            if (HandleDatagram(&worker->mixer, packet, size,
+                (struct sockaddr *)&worker->ring->addrs[next],
+                ValidateHeader(packet, size), FALSE))
+            {
+                worker->ended = TRUE;
+            }
+        }
+    }
+
+    return(NULL);
+}
+
+/**************************************************************************
+*   Function   : PartialSum
+*   Description: Sums one shard's clients for a mix, without rounding, so
+*                the shards can be added up.  With a running sum, the sum
+*                is published, otherwise the clients are summed into the
+*                shard's merge space.
+*   Parameters : mixer - the shard's clients and merge space
+*   Effects    : Out of date clients are aged, and stale fragments
+*                dropped.
+*   Returned   : Grid with the dimensions of the partial sum.  NULL if the
+*                shard has no clients with grids.
+**************************************************************************/
+GRID *PartialSum(MIXER *mixer)
+{
+    if (mixer->store.count == 0)
+    {
+        return(NULL);
+    }
+
+    if (ExpireFragments(&mixer->store))
+    {
+        PutFormattedLine(22, 0, "Fragmented frame timed out");
+    }
+
+    if (running)
+    {
+        return(PublishAccumulator(&mixer->store, &mixer->accumulator));
+    }
+
+    if (!GrowMergeSpace(mixer, MergedCells(&mixer->store)))
+    {
+        return(NULL);
+    }
+
+    return(MergeBufferSums(&mixer->store, &mixer->merged, mixer->sums,
+        mixer->mergedSize) ? &mixer->merged : NULL);
+}
+
+/**************************************************************************
+*   Function   : ReduceShards
+*   Description: Adds up the partial sums of every worker, and rounds the
+*                total into a merged grid as big as the biggest of them.
+*   Parameters : list - the workers, each with its partial sum made
+*                total - merge space for the total
+*   Effects    : total's merge space grows if needed.
+*   Returned   : The merged grid, NULL if no worker has a partial sum.
+**************************************************************************/
+GRID *ReduceShards(WORKER *list, MIXER *total)
+{
+    int rows = 0, cols = 0, stride, i;
+
+    for (i = 0; i < workers; i++)
+    {
+        if (list[i].partial != NULL)
+        {
+            if (rows < list[i].partial->rows)
+            {
+                rows = list[i].partial->rows;
+            }
+
+            if (cols < list[i].partial->cols)
+            {
+                cols = list[i].partial->cols;
+            }
+        }
+    }
+
+    stride = PADDED_COLS(cols);
+
+    if ((rows == 0) || !GrowMergeSpace(total, rows * stride))
+    {
+        return(NULL);
+    }
+
+    total->merged.rows = rows;
+    total->merged.cols = cols;
+    memset(total->sums, 0, rows * stride * sizeof(FIXED_SUM));
+
+    for (i = 0; i < workers; i++)
+    {
+        if (list[i].partial == NULL)
+        {
+            continue;
+        }
+
+        if (running)
+        {
+            AddAccumulatorSums(total->sums, stride,
+                &list[i].mixer.accumulator);
+        }
+        else
+        {
+            AddMergedSums(total->sums, stride, list[i].mixer.sums,
+                list[i].partial->rows, list[i].partial->cols);
+        }
+    }
+
+    RoundSumsInto(&total->merged, total->sums);
+    return(&total->merged);
+}
+
+/**************************************************************************
+*   Function   : PinThread
+*   Description: Keeps a thread on one core.  Cores past the last one wrap
+*                around to the first.
+*   Parameters : thread - thread to pin
+*                core - core number, from 0
+*   Effects    : The thread's CPU affinity is set.
+*   Returned   : None
+**************************************************************************/
+void PinThread(pthread_t thread, int core)
+{
+    cpu_set_t cpus;
+    long cores;
+
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_ZERO(&cpus);
+    CPU_SET(core % ((cores > 0) ? cores : 1), &cpus);
+
+    if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+    {
+        PutFormattedLine(23, 0, "Unable to pin thread to core %d", core);
+    }
+}
+#endif
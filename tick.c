@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <strings.h>
+#include "utils.h"
 
 /**************************************************************************
 *                                 Definitions
@@ -95,8 +96,11 @@ int main(int argc, char *argv[])
     /* Set alarm for 1 sec & every sec there after */
     setitimer(ITIMER_REAL, &tick, NULL);
 
-    /* Loop forever */
-    while (1);
+    /* Sleep until each alarm, forever */
+    while (1)
+    {
+        pause();
+    }
 
     return(0);
 }
@@ -159,17 +163,18 @@ void InitSocket(void)
 *   Function   : SendTick
 *   Description: This function will send  tick to an already open UDP
 *                socket.  It's intended that the socket be bound to by
-*                a grid mixer, but it's not a requirement.
+*                a grid mixer, but it's not a requirement.  The tick is
+*                a bare header, packed here so tick needs no utils.o.
 *   Parameters : None
 *   Effects    : Tick is sent to the mixer proxy server.
 *   Returned   : None
 **************************************************************************/
 void SendTick(void)
 {
-    const char tick[5] = "tick";
+    const unsigned char tick[CONTROL_SIZE] = {WIRE_VERSION, PKT_TICK};
 
     /* Send packet */
-    sendto(socketFD, tick, 5 * sizeof(char), 0,
+    sendto(socketFD, tick, CONTROL_SIZE, 0,
         (struct sockaddr *)&servAddr, sizeof(servAddr));
 #ifdef SHOW_TICK
     printf("Sent tick.\n");
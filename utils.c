@@ -8,23 +8,52 @@
 /**************************************************************************
 *                                Inclued Files
 **************************************************************************/
+#include <arpa/inet.h>
+#include <pthread.h>
 #include "utils.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define X86_KERNELS             /* Build the SSE2 and AVX2 codec kernels */
+#include <immintrin.h>
+#endif
+
 /**************************************************************************
 *                                 Definitions
 **************************************************************************/
+#define SWAR_LSBS       0x0101010101010101ULL   /* Low bit of each byte */
+#define SWAR_GATHER     0x8040201008040201ULL   /* Byte i bit 0 -> bit 7-i */
+#define SWAR_SPREAD     0x0102040810204080ULL   /* Bit 7-i -> byte i */
+#define SWAR_HIGHS      0x7F7F7F7F7F7F7F7FULL   /* Carries bit into bit 7 */
+#define SWAR_ZEROS      0x3030303030303030ULL   /* '0' in every byte */
 
-typedef union           /* Union for converting timestamp into bytes */
-{
-    struct timeval timeStamp;                   /* time stamp */
-    unsigned char byte[sizeof(struct timeval)]; /* view in bytes */
-} TIME_CNV;
+#define KEY_HASH_MULT   0x9E3779B97F4A7C15ULL   /* 2^64 / golden ratio */
+#define MIN_TABLE_SIZE  16      /* Client hash table entries to start with */
+
+#define KERNEL_TEST_CELLS 203   /* Self test length, not a multiple of 8 */
 
-typedef union           /* Union for converting seq num into bytes */
+#define DRAW_GAP        4       /* Unchanged cells ShowGrid redraws rather */
+                                /* than move the cursor past them */
+
+#define STATUS_RECORDS  256     /* Lines queued for DrainStatus, a power */
+                                /* of 2 */
+#define STATUS_TEXT     129     /* Longest line, with its terminator */
+
+typedef void (*PACK_KERNEL)(const char *cells, BYTE *packed, int numCells);
+typedef void (*UNPACK_KERNEL)(const BYTE *packed, char *cells, int numCells);
+typedef void (*ADD_KERNEL)(FIXED_SUM *sums, const FIXED *cells, int count,
+    int shift);
+typedef void (*ROUND_KERNEL)(const FIXED_SUM *sums, char *cells, int count);
+
+typedef struct          /* Line queued by PutFormattedLine */
 {
-    unsigned sequenceNumber;                    /* sequnece number */
-    unsigned char byte[sizeof(unsigned)];       /* view in bytes */
-} SN_CNV;
+    unsigned sequence;          /* Index + 1 when full, index + */
+                                /* STATUS_RECORDS when free again */
+    int row, col;               /* Where it is drawn */
+    char text[STATUS_TEXT];
+} STATUS_RECORD;
+
+/* The wire format counts on BYTE being exactly one octet */
+typedef char BYTE_IS_AN_OCTET[(sizeof(BYTE) == 1) ? 1 : -1];
 
 /**************************************************************************
 *                               Global Variables
@@ -33,16 +62,458 @@ int seeded = FALSE;     /* True if the random number generator is seeded */
 int Rows;		/* Number of screen rows */
 int Cols;               /* Number of screen cloumns */
 
+static unsigned char BitReverse[256];   /* Byte with its bits reversed */
+static unsigned char CellMask[8];       /* Mask of cell n in a packed byte */
+static unsigned long mallocCount = 0;   /* Number of CountedMalloc calls */
+static unsigned long frameMallocs = 0;  /* mallocCount at last FrameMallocs */
+static pthread_mutex_t screenLock =     /* One thread at a time on curses */
+    PTHREAD_MUTEX_INITIALIZER;
+static char *drawnCells = NULL;         /* Grid cells ShowGrid last drew */
+static int drawnSize = 0;               /* Bytes allocated for drawnCells */
+static int drawnRows = 0;               /* Rows drawn, 0 to draw them all */
+static int drawnCols = 0;               /* Columns drawn */
+static STATUS_RECORD statusRing[STATUS_RECORDS];    /* Queued lines */
+static unsigned statusHead = 0;         /* Records ever claimed */
+static unsigned statusTail = 0;         /* Records ever drained */
+static unsigned long statusDropped = 0; /* Lines lost to a full ring */
+static unsigned long statusShown = 0;   /* statusDropped last drained */
+static int statusLogging = FALSE;       /* PutFormattedLine queues lines */
+static FILE *statusFile = NULL;         /* Headless, lines go here */
+
 /**************************************************************************
 *                           Function Prototypes
 **************************************************************************/
 char RandomCell(void);                  /* Return a random '0' or '1' */
-unsigned RoundFloat(float value);       /* Rounds floating point value */
+unsigned RoundFixed(FIXED_SUM value);   /* Rounds fixed point value */
+static int KernelsMatch(PACK_KERNEL pack,   /* Test kernels against scalar */
+                        UNPACK_KERNEL unpack);
+static int PutVarint(BYTE *packed, int pos, /* Store variable length uint */
+                     int limit, unsigned value);
+static int GetVarint(BYTE *packed, int pos, /* Read variable length uint */
+                     int limit, unsigned max, unsigned *value);
+static int AsciiToNibble(char cell);        /* Cell value, 0 to 15 */
+static void DrawGrid(GRID *grid);           /* Draw cells unlike last */
+static void DrawRun(int row, int col,       /* Draw changed cells of a */
+    char *cells, char *drawn, int count);   /* row */
+static void ShowLine(int row, int col,      /* PutFormattedLine without */
+    char *fmt, ...);                        /* refresh */
+static void DrawFormattedLine(int row,      /* Format and draw a line */
+    int col, char *fmt, va_list argptr);
+static void DrawLine(int row, int col,      /* Draw a line, clear the */
+    char *str);                             /* rest */
+static void LogStatus(int row, int col,     /* Queue a formatted line */
+    char *fmt, va_list argptr);
+static int PackDelta(BYTE *packed,          /* Code payload bytes as */
+    BYTE *reference, BYTE *delta,           /* XOR runs */
+    int size, int numBytes);
+static void StoreHeader(BYTE *packed,      /* Store packet type and */
+    int type, GRID *grid, int length);      /* grid header */
+static void LoadHeader(BYTE *packed,        /* Read time stamp and */
+    struct timeval *timeStamp,              /* sequence number */
+    unsigned *sequenceNumber);
+static int ReassembleFragment(REASSEMBLY **frame,   /* Collect fragment */
+    BYTE *fragment, int size);
+static void FreeReassembly(REASSEMBLY *frame);  /* Free reassembly buffers */
+static long ElapsedUsecs(struct timeval *start, /* usecs from start to now */
+    struct timeval *now);
+static void AgeBuffer(GRID_BUF *buffer);    /* Count a merge missed */
+static void MergeScalar(CLIENT_STORE *store,    /* Sum buffers cell by cell */
+    GRID *grid, FIXED_SUM *sums);
+static void MergeBitSliced(CLIENT_STORE *store, /* Sum buffers as bit */
+    GRID *grid);                                /* planes */
+static unsigned long long LoadCellWord(     /* Get 64 packed cells */
+    const BYTE *bits, int first, int count);
+static void AddToPlanes(unsigned long long *planes, /* Add bits to a */
+    int plane, unsigned long long bits);            /* bit sliced sum */
+static void MergeVector(CLIENT_STORE *store,    /* Sum buffers a vector at */
+    GRID *grid, FIXED_SUM *sums);           /* a time */
+static void SumVector(CLIENT_STORE *store,  /* Sum buffers, unrounded */
+    GRID *grid, FIXED_SUM *sums);
+static void MergedDims(CLIENT_STORE *store, /* Size of merged grid */
+    int *rows, int *cols);
+static void ExpandBits(GRID_BUF *buffer,    /* Expand bits to 0 and */
+    int first, int count);                  /* FIXED_ONE */
+static void UpdateKeyFrame(CLIENT_STORE *store, /* Unpack key frame into */
+    int slot, BYTE *packed, int size,           /* a client's slot */
+    ACCUMULATOR *sum);
+static int GrowSlots(CLIENT_STORE *store);      /* Double the slots */
+static int PlaceSlot(CLIENT_STORE *store,       /* Give a slot an extent */
+    int slot, int cells);                       /* of the slabs */
+static int PackSlabs(CLIENT_STORE *store,       /* Copy extents in use to */
+    int slot, int cells);                       /* new slabs */
+static unsigned int HashClientKey(          /* Hash of a client key */
+    const CLIENT_KEY *key);
+static int FindEntry(CLIENT_STORE *store,   /* Hash table entry of key */
+    const CLIENT_KEY *key);
+static int GrowTable(CLIENT_STORE *store);  /* Double the hash table */
+static int CellWeight(int age);             /* Value of a 1 cell at age */
+static void AccumulateCell(ACCUMULATOR *sum,    /* Add to one running sum */
+    int cell, int weight);
+static void AccumulateByte(ACCUMULATOR *sum,    /* Add the changed cells */
+    GRID_BUF *buffer, int index,                /* of a packed byte */
+    unsigned char change, unsigned char now);
+static void AccumulateFrame(ACCUMULATOR *sum,   /* Add the cells a key */
+    GRID_BUF *buffer, BYTE *bits);              /* frame changes */
+static void AccumulateBuffer(ACCUMULATOR *sum,  /* Add weight for every */
+    GRID_BUF *buffer, int weight,               /* 1 cell of a buffer */
+    unsigned *counts, int count);
+static int AgeClass(const ACCUMULATOR *sum,     /* Age class of a buffer */
+    int age);
+static void AccountBuffer(ACCUMULATOR *sum,     /* Put a buffer in a sum */
+    GRID_BUF *buffer, int sign);                /* or take it out */
+static void AgeClasses(ACCUMULATOR *sum);       /* Age every age class */
+static int RebuildAccumulator(CLIENT_STORE *store,  /* Sum every buffer */
+    ACCUMULATOR *sum, int rows, int cols);          /* again */
+
+/* Cell packing kernels, each handles numCells '0'/'1' cells */
+static void PackCellsScalar(const char *cells, BYTE *packed, int numCells);
+static void UnpackCellsScalar(const BYTE *packed, char *cells, int numCells);
+static void PackCellsSwar(const char *cells, BYTE *packed, int numCells);
+static void UnpackCellsSwar(const BYTE *packed, char *cells, int numCells);
+
+/* Merge kernels, count is a multiple of CELL_ALIGN for add */
+static void AddCellsScalar(FIXED_SUM *sums, const FIXED *cells, int count,
+    int shift);
+static void RoundCellsScalar(const FIXED_SUM *sums, char *cells, int count);
+#ifdef X86_KERNELS
+static void PackCellsSse2(const char *cells, BYTE *packed, int numCells);
+static void UnpackCellsSse2(const BYTE *packed, char *cells, int numCells);
+static void PackCellsAvx2(const char *cells, BYTE *packed, int numCells);
+static void UnpackCellsAvx2(const BYTE *packed, char *cells, int numCells);
+static void AddCellsSse2(FIXED_SUM *sums, const FIXED *cells, int count,
+    int shift);
+static void RoundCellsSse2(const FIXED_SUM *sums, char *cells, int count);
+static void AddCellsAvx2(FIXED_SUM *sums, const FIXED *cells, int count,
+    int shift);
+static void RoundCellsAvx2(const FIXED_SUM *sums, char *cells, int count);
+#endif
+
+/* Kernels used by the codec, replaced by InitCodec */
+static PACK_KERNEL PackCells = PackCellsScalar;
+static UNPACK_KERNEL UnpackCells = UnpackCellsScalar;
+static const char *kernelName = "scalar";
+
+/* Kernels used by MERGE_VECTOR, replaced by InitCodec */
+static ADD_KERNEL AddCells = AddCellsScalar;
+static ROUND_KERNEL RoundCells = RoundCellsScalar;
+static const char *vectorName = "vector scalar";
+
+/* Merge engine used by MergeBuffersInto, replaced by SetMergeEngine */
+static MERGE_ENGINE mergeEngine = MERGE_VECTOR;
 
 /**************************************************************************
 *                                  Functions
 **************************************************************************/
 
+/**************************************************************************
+*   Function   : InitCodec
+*   Description: Selects the fastest cell packing and unpacking kernels
+*                supported by this CPU.  Each candidate is run against the
+*                bitfield based scalar kernels on a test pattern before it
+*                is used, so a kernel that does not reproduce the OCTET
+*                bit order of this compiler is never selected.  The
+*                kernels used by the MERGE_VECTOR engine are chosen from
+*                the same instruction sets.  Until this function is called,
+*                the scalar kernels are used, and flip lists can not be
+*                packed or applied.
+*   Parameters : None
+*   Effects    : The kernels used by the grid codec are set.
+*   Returned   : None
+**************************************************************************/
+void InitCodec(void)
+{
+    int value, bit;
+    char tail[8];
+    BYTE mask;
+
+    /* Build bit reversal table for the movemask kernels */
+    for (value = 0; value < 256; value++)
+    {
+        BitReverse[value] = 0;
+
+        for (bit = 0; bit < 8; bit++)
+        {
+            if (value & (1 << bit))
+            {
+                BitReverse[value] |= 0x80 >> bit;
+            }
+        }
+    }
+
+    /* Find where the OCTET bit fields put each cell of a byte */
+    for (bit = 0; bit < 8; bit++)
+    {
+        memset(tail, '0', sizeof(tail));
+        tail[bit] = '1';
+        PackCellsScalar(tail, &mask, 8);
+        CellMask[bit] = mask.byte;
+    }
+
+    PackCells = PackCellsScalar;
+    UnpackCells = UnpackCellsScalar;
+    kernelName = "scalar";
+
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        AddCells = AddCellsAvx2;
+        RoundCells = RoundCellsAvx2;
+        vectorName = "vector avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        AddCells = AddCellsSse2;
+        RoundCells = RoundCellsSse2;
+        vectorName = "vector sse2";
+    }
+
+    if (__builtin_cpu_supports("avx2") &&
+        KernelsMatch(PackCellsAvx2, UnpackCellsAvx2))
+    {
+        PackCells = PackCellsAvx2;
+        UnpackCells = UnpackCellsAvx2;
+        kernelName = "avx2";
+        return;
+    }
+
+    if (__builtin_cpu_supports("sse2") &&
+        KernelsMatch(PackCellsSse2, UnpackCellsSse2))
+    {
+        PackCells = PackCellsSse2;
+        UnpackCells = UnpackCellsSse2;
+        kernelName = "sse2";
+        return;
+    }
+#endif
+
+    if (KernelsMatch(PackCellsSwar, UnpackCellsSwar))
+    {
+        PackCells = PackCellsSwar;
+        UnpackCells = UnpackCellsSwar;
+        kernelName = "swar";
+    }
+}
+
+/**************************************************************************
+*   Function   : CodecKernelName
+*   Description: Returns the name of the cell packing kernels selected by
+*                InitCodec.
+*   Parameters : None
+*   Effects    : None
+*   Returned   : "avx2", "sse2", "swar", or "scalar".
+**************************************************************************/
+const char *CodecKernelName(void)
+{
+    return(kernelName);
+}
+
+/**************************************************************************
+*   Function   : SetCodecKernel
+*   Description: Forces the cell packing and unpacking kernels, in place
+*                of the ones InitCodec picked, so each can be checked
+*                against the scalar kernels.  Unlike InitCodec, the
+*                kernels are not tested first.  InitCodec must have been
+*                called.
+*   Parameters : kernel - kernels to use
+*   Effects    : Later packs and unpacks use kernel, if this CPU has it.
+*   Returned   : TRUE if the kernels are in use, FALSE if this CPU or
+*                build doesn't have them.
+**************************************************************************/
+int SetCodecKernel(CODEC_KERNEL kernel)
+{
+    if (kernel == CODEC_SCALAR)
+    {
+        PackCells = PackCellsScalar;
+        UnpackCells = UnpackCellsScalar;
+        kernelName = "scalar";
+        return(TRUE);
+    }
+
+    if (kernel == CODEC_SWAR)
+    {
+        PackCells = PackCellsSwar;
+        UnpackCells = UnpackCellsSwar;
+        kernelName = "swar";
+        return(TRUE);
+    }
+
+#ifdef X86_KERNELS
+    if ((kernel == CODEC_SSE2) && __builtin_cpu_supports("sse2"))
+    {
+        PackCells = PackCellsSse2;
+        UnpackCells = UnpackCellsSse2;
+        kernelName = "sse2";
+        return(TRUE);
+    }
+
+    if ((kernel == CODEC_AVX2) && __builtin_cpu_supports("avx2"))
+    {
+        PackCells = PackCellsAvx2;
+        UnpackCells = UnpackCellsAvx2;
+        kernelName = "avx2";
+        return(TRUE);
+    }
+#endif
+
+    return(FALSE);
+}
+
+/**************************************************************************
+*   Function   : PutBigEndian
+*   Description: Stores an unsigned value in a packet, most significant
+*                byte first, so that it reads the same on every host.
+*   Parameters : packed - packet to store value in
+*                pos - position of the value's first byte
+*                bytes - number of bytes to store, the value is truncated
+*                        to fit
+*                value - value to store
+*   Effects    : packed[pos .. pos + bytes - 1] are written.
+*   Returned   : None
+**************************************************************************/
+void PutBigEndian(BYTE *packed, int pos, int bytes, unsigned long long value)
+{
+    int i;
+
+    for (i = bytes - 1; i >= 0; i--)
+    {
+        packed[pos + i].byte = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+/**************************************************************************
+*   Function   : GetBigEndian
+*   Description: Reads an unsigned value stored by PutBigEndian.
+*   Parameters : packed - packet to read value from
+*                pos - position of the value's first byte
+*                bytes - number of bytes in the value
+*   Effects    : None
+*   Returned   : The value.
+**************************************************************************/
+unsigned long long GetBigEndian(BYTE *packed, int pos, int bytes)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for (i = 0; i < bytes; i++)
+    {
+        value = (value << 8) | packed[pos + i].byte;
+    }
+
+    return(value);
+}
+
+/**************************************************************************
+*   Function   : ValidateHeader
+*   Description: Checks a received packet's header against the number of
+*                bytes received, before anything reads its payload.  Only
+*                the header is examined, so a bad packet is rejected in
+*                constant time no matter what size it claims to be.  The
+*                payload of key and nibble frames must be exactly the size
+*                of their grid, and deltas and flips must at least hold a
+*                base sequence number.  Fragments are checked further when
+*                they are reassembled.  Join, leave, tick and unsubscribe
+*                packets are only a header of CONTROL_SIZE bytes.
+*                Subscribe and cookie packets add a cookie to it, region
+*                packets add whole rectangles after the cookie, and level
+*                packets a level up to MAX_LEVEL.  Tiles must hold their
+*                placement and exactly their cells.
+*   Parameters : packed - received packet
+*                size - number of bytes received
+*   Effects    : None
+*   Returned   : The packet type.  0 indicates the packet is malformed,
+*                from another wire version, or of an unknown type.
+**************************************************************************/
+int ValidateHeader(BYTE *packed, int size)
+{
+    unsigned long long length, numCells;
+    int type, regions;
+
+    if ((size <= TYPE_POS) || (packed[VERSION_POS].byte != WIRE_VERSION))
+    {
+        return(0);
+    }
+
+    type = packed[TYPE_POS].byte;
+
+    if (type == PKT_FRAGMENT)
+    {
+        return((size > FRAG_DATA_POS) ? type : 0);
+    }
+    else if (type == PKT_REGION)
+    {
+        regions = (size - REGION_POS) / REGION_SIZE;
+        return(((size - REGION_POS == regions * REGION_SIZE) &&
+            (regions >= 1) && (regions <= MAX_REGIONS)) ? type : 0);
+    }
+    else if (type == PKT_LEVEL)
+    {
+        return(((size == LEVEL_SIZE) &&
+            (packed[LEVEL_POS].byte <= MAX_LEVEL)) ? type : 0);
+    }
+    else if ((type == PKT_SUBSCRIBE) || (type == PKT_COOKIE))
+    {
+        return((size == COOKIE_SIZE) ? type : 0);
+    }
+    else if ((type > LAST_GRID_TYPE) && (type < PKT_REGION))
+    {
+        return((size == CONTROL_SIZE) ? type : 0);
+    }
+
+    if (size < CELL_POS)
+    {
+        return(0);
+    }
+
+    length = GetBigEndian(packed, LEN_POS, 4);
+    numCells = (unsigned long long)PACKED_ROWS(packed) * PACKED_COLS(packed);
+
+    if ((length != (unsigned long long)(size - CELL_POS)) ||
+        (numCells == 0) || (numCells > MAX_CELLS))
+    {
+        return(0);
+    }
+
+    switch (type)
+    {
+        case PKT_KEY:
+            return((length == (numCells + 7) / 8) ? type : 0);
+
+        case PKT_NIBBLES:
+            return((length == (numCells + 1) / 2) ? type : 0);
+
+        case PKT_DELTA:
+        case PKT_FLIPS:
+            return((length >= DELTA_POS - BASE_POS) ? type : 0);
+
+        case PKT_TILE:
+            return((length == (TILE_CELL_POS - CELL_POS) +
+                ((numCells + 1) / 2)) ? type : 0);
+
+        default:
+            return(0);
+    }
+}
+
+/**************************************************************************
+*   Function   : PackControl
+*   Description: Packs a control packet, such as a join, leave or tick.
+*                They have no payload, so they are just the version and
+*                the type.
+*   Parameters : packed - array of at least CONTROL_SIZE bytes
+*                type - PKT_JOIN, PKT_LEAVE, PKT_TICK or PKT_UNSUBSCRIBE
+*   Effects    : The packet is written to packed.
+*   Returned   : Number of bytes in the packet, CONTROL_SIZE.
+**************************************************************************/
+int PackControl(BYTE *packed, int type)
+{
+    packed[VERSION_POS].byte = WIRE_VERSION;
+    packed[TYPE_POS].byte = type;
+    return(CONTROL_SIZE);
+}
+
 /**************************************************************************
 *   Function   : InitGrid
 *   Description: Creates a rows by cols grid and fills it parameter with
@@ -64,20 +535,21 @@ GRID *InitGrid(int rows, int cols)
     GRID *grid;
     struct timeval seed;
 
-    if ((rows > 255) || (cols > 255))
+    if ((rows < 1) || (cols < 1) || (rows > MAX_DIM) || (cols > MAX_DIM) ||
+        ((long)rows * cols > MAX_CELLS))
     {
         PutFormattedLine(Rows - 2, 0, "Grid dimensions too large");
         return(NULL);
     }
 
-    grid = (GRID *)malloc(sizeof(GRID));
+    grid = (GRID *)CountedMalloc(sizeof(GRID));
     if (grid == NULL)
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate grid");
         return(NULL);
     }
 
-    grid->cells = (char *)malloc(sizeof(char) * (rows * cols));
+    grid->cells = (char *)CountedMalloc(sizeof(char) * (rows * cols));
     if (grid->cells == NULL)
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate cell array");
@@ -110,13 +582,26 @@ GRID *InitGrid(int rows, int cols)
     return(grid);
 }
 
+/**************************************************************************
+*   Function   : PackedBitsSize
+*   Description: Computes the size of a rows by cols grid packed by
+*                PackGridToBits, so that callers may allocate a packing
+*                array once and reuse it.
+*   Parameters : rows - number of grid rows
+*                cols - number of grid cols
+*   Effects    : None
+*   Returned   : Size of the packed grid in bytes.
+**************************************************************************/
+int PackedBitsSize(int rows, int cols)
+{
+    return(sizeof(BYTE) * ((((rows * cols) + 7) / 8) + CELL_POS));
+}
+
 /**************************************************************************
 *   Function   : PackGridToBits
 *   Description: Packs each cell from a rows by col grid into a single
-*                single bit. '0' is packed as 0, '1' is packed as 1,
-*                anything else is compiler dependent.  For grid sizes
-*                not evenly divided by eight, the packed grid is padded
-*                with garbage values.
+*                single bit, in a newly malloced array.  See
+*                PackGridToBitsBuf for the packed format.
 *   Parameters : grid - pointer to cell grid structure containing it's
 *                       dimensions and a character array of grid cells.
 *                size - pointer to integer where the size of the malloced
@@ -124,15 +609,7 @@ GRID *InitGrid(int rows, int cols)
 *   Effects    : If DEBUG is defined the packed cells will be written
 *                to stdout.
 *   Returned   : BYTE* - a pointer to a malloced array of BYTEs,
-*                        containing the grid information.  The grid gets
-*                        packed as follows:
-*                        [TS_POS .. SN_POS - 1]     Timestamp
-*                        [SN_POS .. ROW_POS - 1]    Sequence number
-*                        [ROW_POS]                  Number of rows
-*                        [COL_POS]                  Number of columns
-*                        [CELL_POS ...]             Cell data packed so
-*                                                   each cell is 1 bit
-*
+*                        containing the grid information.
 *                        It is the job of the calling routine to free
 *                        the array pointed to by the pointer.
 *                        NULL value return indicates failure.
@@ -140,19 +617,11 @@ GRID *InitGrid(int rows, int cols)
 BYTE *PackGridToBits(GRID *grid, int *size)
 {
     BYTE *packed;
-    int cell, numCells, packedCell;
-    TIME_CNV timeStamp;
-    SN_CNV sequenceNumber;
-
-    numCells = (grid->rows * grid->cols);
+    int packedSize;
 
-    /* make sure there's an even multiple of 8 cells */
-    if (numCells % 8)
-    {
-        numCells += 8 - (numCells % 8);
-    }
+    packedSize = PackedBitsSize(grid->rows, grid->cols);
 
-    packed = (BYTE *)malloc(sizeof(BYTE) * ((numCells / 8) + CELL_POS));
+    packed = (BYTE *)CountedMalloc(packedSize);
     if (packed == NULL)
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate packed array");
@@ -162,47 +631,65 @@ BYTE *PackGridToBits(GRID *grid, int *size)
     /* Store size */
     if (size != NULL)
     {
-        *size = sizeof(BYTE) * ((numCells / 8) + CELL_POS);
-    } 
-
-    /* Store timestamp */
-    timeStamp.timeStamp = grid->timeStamp;
-    for(cell = TS_POS; cell < SN_POS; cell++)
-    {
-        packed[cell].byte = timeStamp.byte[cell - TS_POS];
+        *size = packedSize;
     }
 
-    /* Store sequence number */
-    sequenceNumber.sequenceNumber = grid->sequenceNumber;
-    for(; cell < ROW_POS; cell++)
-    {
-        packed[cell].byte = sequenceNumber.byte[cell - SN_POS];
-    }
+    PackGridToBitsBuf(grid, packed, packedSize);
+    return(packed);
+}
+
+/**************************************************************************
+*   Function   : PackGridToBitsBuf
+*   Description: Packs each cell from a rows by col grid into a single
+*                single bit, in an array provided by the caller. '0' is
+*                packed as 0, '1' is packed as 1, anything else is packed
+*                as its low bit.  For grid sizes not evenly divided by
+*                eight, the packed grid is padded with 0 bits.  The packing
+*                kernel is chosen by InitCodec.
+*   Parameters : grid - pointer to cell grid structure containing it's
+*                       dimensions and a character array of grid cells.
+*                packed - array to hold the packed grid.
+*                size - size of the packed array in bytes.  Use
+*                       PackedBitsSize to find the size needed.
+*   Effects    : If DEBUG is defined the packed cells will be written
+*                to stdout.  The grid gets packed as follows:
+*                [VERSION_POS]              WIRE_VERSION
+*                [TYPE_POS]                 PKT_KEY
+*                [TS_POS .. SN_POS - 1]     Timestamp in ns
+*                [SN_POS .. ROW_POS - 1]    Sequence number
+*                [ROW_POS .. COL_POS - 1]   Number of rows
+*                [COL_POS .. LEN_POS - 1]   Number of columns
+*                [LEN_POS .. CELL_POS - 1]  Bytes of cell data
+*                [CELL_POS ...]             Cell data packed so
+*                                           each cell is 1 bit
+*   Returned   : Number of bytes written to packed.  0 indicates the
+*                array is too small.
+**************************************************************************/
+int PackGridToBitsBuf(GRID *grid, BYTE *packed, int size)
+{
+    int packedSize;
+#ifdef DEBUG
+    int packedCell;
+#endif
 
-    /* Store grid dimensions */
-    packed[ROW_POS].byte = (unsigned char)grid->rows;
-    packed[COL_POS].byte = (unsigned char)grid->cols;
+    packedSize = PackedBitsSize(grid->rows, grid->cols);
 
-    for (cell = 0; cell < numCells;)
+    if (size < packedSize)
     {
-        packedCell = (cell / 8) + CELL_POS;    /* Index into packed grid */
-
-        /* Fill packed grid */
-        packed[packedCell].bit.bit0 = grid->cells[cell++] - '0';
-        packed[packedCell].bit.bit1 = grid->cells[cell++] - '0';
-        packed[packedCell].bit.bit2 = grid->cells[cell++] - '0';
-        packed[packedCell].bit.bit3 = grid->cells[cell++] - '0';
-        packed[packedCell].bit.bit4 = grid->cells[cell++] - '0';
-        packed[packedCell].bit.bit5 = grid->cells[cell++] - '0';
-        packed[packedCell].bit.bit6 = grid->cells[cell++] - '0';
-        packed[packedCell].bit.bit7 = grid->cells[cell++] - '0';
+        PutFormattedLine(Rows - 2, 0, "Packed array is too small");
+        return(0);
     }
 
+    StoreHeader(packed, PKT_KEY, grid, packedSize - CELL_POS);
+
+    /* Fill packed grid */
+    PackCells(grid->cells, &packed[CELL_POS], grid->rows * grid->cols);
+
 #ifdef DEBUG
         printf("Packed grid:");
 
         for (packedCell = 0;
-             packedCell < ((packed[ROW_POS].byte * packed[COL_POS].byte) / 8);
+             packedCell < ((PACKED_ROWS(packed) * PACKED_COLS(packed)) / 8);
              packedCell++)
         {
             if (!(packedCell % 10))
@@ -212,229 +699,451 @@ BYTE *PackGridToBits(GRID *grid, int *size)
         }
 #endif
 
-    return(packed);
+    return(packedSize);
 }
 
 /**************************************************************************
-*   Function   : UnpackBitsToGrid
-*   Description: Unpacks each bit from a packed grid into a character byte
-*                in a cell in a newly malloced grid. 0 is unpacked as '0',
-*                1 is unpacked as '1'.
-*   Parameters : packed - packed grid
-*   Effects    : packed is freed on sucessful returns.
-*   Returned   : GRID* - a pointer to a malloced GRID structure.
-*                        It is the job of the calling routine to use
-*                        FreeGrid to free the structure pointed to by the
-*                        returned pointer.
-*                        NULL value return indicates failure.
+*   Function   : PackBitsToDelta
+*   Description: Codes a grid packed by PackGridToBitsBuf as the XOR of
+*                its cells with the cells of a reference grid of the same
+*                dimensions, normally the last grid sent.  Only a few cells
+*                change between frames, so the XOR is mostly zero bytes.
+*                See PackDelta for how it is coded.
+*   Parameters : packed - grid packed by PackGridToBitsBuf
+*                reference - earlier grid packed by PackGridToBitsBuf
+*                delta - array to hold the delta packet
+*                size - size of the delta array in bytes
+*   Effects    : The delta packet is stored as described in PackDelta.
+*   Returned   : Number of bytes written to delta.  0 indicates that the
+*                grids differ in size, or the delta does not fit in size
+*                bytes, in which case the packed grid should be sent.
 **************************************************************************/
-GRID *UnpackBitsToGrid(BYTE *packed)
+int PackBitsToDelta(BYTE *packed, BYTE *reference, BYTE *delta, int size)
 {
-    int packedCell, packedCells, cell, overflow;
-    GRID *grid;
-    TIME_CNV timeStamp;
-    SN_CNV sequenceNumber;
+    return(PackDelta(packed, reference, delta, size,
+        ((PACKED_ROWS(packed) * PACKED_COLS(packed)) + 7) / 8));
+}
 
-    grid = (GRID *)malloc(sizeof(GRID));
-    if (grid == NULL)
-    {
-        PutFormattedLine(Rows - 2, 0, "Unable to allocate grid");
-        return(NULL);
-    }
+/**************************************************************************
+*   Function   : PackNibblesToDelta
+*   Description: Codes a grid packed by PackGridToNibblesBuf as the XOR of
+*                its cells with the cells of a reference grid of the same
+*                dimensions, the same way PackBitsToDelta does for bits.
+*                The delta says nothing of how its base was packed, so the
+*                receiver must hold the base packed in nibbles.
+*   Parameters : packed - grid packed by PackGridToNibblesBuf
+*                reference - earlier grid packed by PackGridToNibblesBuf
+*                delta - array to hold the delta packet
+*                size - size of the delta array in bytes
+*   Effects    : The delta packet is stored as described in PackDelta.
+*   Returned   : Number of bytes written to delta.  0 indicates that the
+*                grids differ in size, or the delta does not fit in size
+*                bytes, in which case the packed grid should be sent.
+**************************************************************************/
+int PackNibblesToDelta(BYTE *packed, BYTE *reference, BYTE *delta,
+    int size)
+{
+    return(PackDelta(packed, reference, delta, size,
+        ((PACKED_ROWS(packed) * PACKED_COLS(packed)) + 1) / 2));
+}
 
-    grid->cells = (char *)malloc(sizeof(char) *
-        (packed[ROW_POS].byte * packed[COL_POS].byte));
+/**************************************************************************
+*   Function   : PackDelta
+*   Description: Codes the payload of a packed grid as its XOR with the
+*                payload of a reference grid of the same dimensions.  The
+*                XOR is run length coded as pairs of variable length
+*                counts: the number of unchanged bytes, then the number of
+*                changed bytes followed by their XOR values.  The pairs
+*                continue until every payload byte is covered.  Unchanged
+*                runs are skipped a 64 bit word at a time, so the cost of
+*                a delta mostly depends on how much changed, not on the
+*                size of the grid.
+*   Parameters : packed - packed grid
+*                reference - earlier grid, packed the same way
+*                delta - array to hold the delta packet
+*                size - size of the delta array in bytes
+*                numBytes - payload bytes of packed and reference
+*   Effects    : The delta packet is stored as follows:
+*                [VERSION_POS .. LEN_POS - 1]   Same as packed, type
+*                                               PKT_DELTA
+*                [LEN_POS .. CELL_POS - 1]  Bytes after the header
+*                [BASE_POS .. DELTA_POS - 1]    Sequence number of
+*                                               reference
+*                [DELTA_POS ...]            XOR runs
+*   Returned   : Number of bytes written to delta.  0 indicates that the
+*                grids differ in size, or the delta does not fit in size
+*                bytes, in which case the packed grid should be sent.
+**************************************************************************/
+static int PackDelta(BYTE *packed, BYTE *reference, BYTE *delta, int size,
+    int numBytes)
+{
+    unsigned long long word, refWord;
+    int pos, limit, cell, run;
 
-    if (grid->cells == NULL)
+    if ((PACKED_ROWS(packed) != PACKED_ROWS(reference)) ||
+        (PACKED_COLS(packed) != PACKED_COLS(reference)))
     {
-        PutFormattedLine(Rows - 2, 0, "Unable to allocate cell array");
-        free(grid);
-        return(NULL);
+        return(0);
     }
 
-    /* Get timestamp */
-    for(cell = TS_POS; cell < SN_POS; cell++)
+    limit = size / sizeof(BYTE);
+    if (limit < DELTA_POS)
     {
-        timeStamp.byte[cell - TS_POS] = packed[cell].byte;
+        return(0);
     }
-    grid->timeStamp = timeStamp.timeStamp;
 
-    /* Get sequence number */
-    for(; cell < ROW_POS; cell++)
+    /* Same header as the packed grid, plus the base sequence number */
+    for (pos = 0; pos < CELL_POS; pos++)
     {
-        sequenceNumber.byte[cell - SN_POS] = packed[cell].byte;
+        delta[pos] = packed[pos];
     }
-    grid->sequenceNumber = sequenceNumber.sequenceNumber;
-
-    /* Get dimensions */
-    grid->rows = packed[ROW_POS].byte;
-    grid->cols = packed[COL_POS].byte;
+    delta[TYPE_POS].byte = PKT_DELTA;
 
-    packedCells = (packed[ROW_POS].byte * packed[COL_POS].byte) / 8;
+    PutBigEndian(delta, BASE_POS, 4, GetBigEndian(reference, SN_POS, 4));
+    pos = DELTA_POS;
 
-    /* Make sure to account for non-even number of bits */
-    overflow = ((packed[ROW_POS].byte * packed[COL_POS].byte) % 8);
+    packed += CELL_POS;
+    reference += CELL_POS;
 
-    /* Unpack each byte */
-    for (packedCell = CELL_POS, cell = 0;
-         packedCell < (packedCells + CELL_POS);
-         packedCell++)
+    for (cell = 0; cell < numBytes;)
     {
-        grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-        grid->cells[cell++] = packed[packedCell].bit.bit1 + '0';
-        grid->cells[cell++] = packed[packedCell].bit.bit2 + '0';
-        grid->cells[cell++] = packed[packedCell].bit.bit3 + '0';
-        grid->cells[cell++] = packed[packedCell].bit.bit4 + '0';
-        grid->cells[cell++] = packed[packedCell].bit.bit5 + '0';
-        grid->cells[cell++] = packed[packedCell].bit.bit6 + '0';
-        grid->cells[cell++] = packed[packedCell].bit.bit7 + '0';
-    }
+        /* Count unchanged bytes, whole words first */
+        run = cell;
 
-    /* Fill overflow bits */
-    switch (overflow)
-    {
-        case 0:                 /* There are no extra bits */
-            break;
+        while (cell + (int)sizeof(word) <= numBytes)
+        {
+            memcpy(&word, &packed[cell], sizeof(word));
+            memcpy(&refWord, &reference[cell], sizeof(refWord));
 
-        case 1:
-            grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-            break;
+            if (word != refWord)
+            {
+                break;
+            }
 
-        case 2:
-            grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit1 + '0';
-            break;
+            cell += sizeof(word);
+        }
 
-        case 3:
-            grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit1 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit2 + '0';
-            break;
+        for (;
+             (cell < numBytes) && (packed[cell].byte == reference[cell].byte);
+             cell++);
 
-        case 4:
-            grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit1 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit2 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit3 + '0';
-            break;
+        pos = PutVarint(delta, pos, limit, cell - run);
 
-        case 5:
-            grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit1 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit2 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit3 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit4 + '0';
-            break;
+        /* Count changed bytes */
+        for (run = cell;
+             (cell < numBytes) && (packed[cell].byte != reference[cell].byte);
+             cell++);
 
-        case 6:
-            grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit1 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit2 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit3 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit4 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit5 + '0';
-            break;
+        pos = PutVarint(delta, pos, limit, cell - run);
 
-        case 7:
-            grid->cells[cell++] = packed[packedCell].bit.bit0 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit1 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit2 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit3 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit4 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit5 + '0';
-            grid->cells[cell++] = packed[packedCell].bit.bit6 + '0';
-            break;
+        if ((pos < 0) || ((pos + (cell - run)) > limit))
+        {
+            return(0);
+        }
 
-        default:
-            PutFormattedLine(Rows - 2, 0, "Error in grid size calculation");
-            FreeGrid(grid);
-            return(NULL);
+        for (; run < cell; run++, pos++)
+        {
+            delta[pos].byte = packed[run].byte ^ reference[run].byte;
+        }
     }
 
-    free(packed);
-    return(grid);
+    PutBigEndian(delta, LEN_POS, 4, pos - CELL_POS);
+    return(pos * sizeof(BYTE));
 }
 
 /**************************************************************************
-*   Function   : PackGridToNibbles
-*   Description: Packs each cell from a rows by col grid into a four bit
-*                nibble.  Mod 16 of the value of each cell is placed in
-*                the nibble.  Making this algorithm only good for values
-*                between 0 and 15.  For grid sizes not evenly divided by
-*                2, the packed grid is padded with garbage values.
-*   Parameters : grid - pointer to cell grid structure containing it's
-*                       dimensions and a character array of grid cells.
-*   Effects    : If DEBUG is defined the packed cells will be written
-*                to stdout.
-*   Returned   : BYTE* - a pointer to a malloced array of BYTEs,
-*                        containing the grid information.  The grid gets
-*                        packed as follows:
-*                        [TS_POS .. SN_POS - 1]     Timestamp
-*                        [SN_POS .. ROW_POS - 1]    Sequence number
-*                        [ROW_POS]                  Number of rows
-*                        [COL_POS]                  Number of columns
-*                        [CELL_POS ...]             Cell data packed so
-*                                                   each cell is 4 bits
-*
-*                        It is the job of the calling routine to free
-*                        the array pointed to by the pointer.
-*                        NULL value return indicates failure.
+*   Function   : PackFlipsToBuf
+*   Description: Codes the cells toggled by MutateGrid as a flip list.  The
+*                list holds the number of toggled cells followed by the gap
+*                before each one, stored as variable length counts.  The
+*                size of a flip list depends only on the number of cells
+*                toggled, not on the size of the grid.
+*   Parameters : grid - grid after mutation
+*                flips - cells toggled by MutateGrid
+*                baseSequence - sequence number of the frame the cells
+*                               were toggled from
+*                packed - array to hold the flip packet
+*                size - size of the packed array in bytes
+*   Effects    : The flip packet is stored as follows:
+*                [VERSION_POS .. LEN_POS - 1]   As in PackGridToBitsBuf,
+*                                               type PKT_FLIPS
+*                [LEN_POS .. CELL_POS - 1]  Bytes after the header
+*                [BASE_POS .. DELTA_POS - 1]    baseSequence
+*                [DELTA_POS ...]            Number of flips, then the
+*                                           number of cells skipped before
+*                                           each flip
+*   Returned   : Number of bytes written to packed.  0 indicates that the
+*                flip list overflowed, or does not fit in size bytes, in
+*                which case another kind of packet should be sent.
 **************************************************************************/
-BYTE *PackGridToNibbles(GRID *grid)
+int PackFlipsToBuf(GRID *grid, FLIP_LIST *flips, unsigned baseSequence,
+    BYTE *packed, int size)
 {
-    BYTE *packed;
-    int cell, numCells, packedCell;
-    TIME_CNV timeStamp;
-    SN_CNV sequenceNumber;
-
-    numCells = (grid->rows * grid->cols);
-
-    /* make sure there's an even multiple of 8 cells */
-    numCells += (numCells % 2);
+    int pos, flip, next = 0, limit;
 
-    packed = (BYTE *)malloc(sizeof(BYTE) * ((numCells / 2) + CELL_POS));
+    limit = size / sizeof(BYTE);
 
-    if (packed == NULL)
+    if (flips->overflow || (limit < DELTA_POS))
     {
-        PutFormattedLine(Rows - 2, 0, "Unable to allocate packed array");
-        return(NULL);
+        return(0);
     }
 
-    /* Store size */
-    packed[SIZE_POS].byte = sizeof(BYTE) * ((numCells / 2) + CELL_POS);
+    StoreHeader(packed, PKT_FLIPS, grid, 0);
+
+    /* Store base sequence number */
+    PutBigEndian(packed, BASE_POS, 4, baseSequence);
+    pos = DELTA_POS;
+
+    /* Store the flips as gaps from the cell after the last flip */
+    pos = PutVarint(packed, pos, limit, flips->count);
+
+    for (flip = 0; flip < flips->count; flip++)
+    {
+        pos = PutVarint(packed, pos, limit, flips->cells[flip] - next);
+        next = flips->cells[flip] + 1;
+    }
+
+    if (pos < 0)
+    {
+        return(0);
+    }
+
+    PutBigEndian(packed, LEN_POS, 4, pos - CELL_POS);
+    return(pos * sizeof(BYTE));
+}
+
+/**************************************************************************
+*   Function   : FlipPackedBits
+*   Description: Toggles the cells in a flip list in a grid packed by
+*                PackGridToBitsBuf, so that a packed copy of the last frame
+*                can be kept up to date without packing the whole grid.
+*   Parameters : packed - grid packed by PackGridToBitsBuf
+*                flips - cells toggled by MutateGrid
+*                sequenceNumber - new sequence number for packed
+*   Effects    : The cells in flips and the sequence number of packed are
+*                changed.
+*   Returned   : None
+**************************************************************************/
+void FlipPackedBits(BYTE *packed, FLIP_LIST *flips, unsigned sequenceNumber)
+{
+    int flip, cell;
+
+    for (flip = 0; flip < flips->count; flip++)
+    {
+        cell = flips->cells[flip];
+        packed[CELL_POS + (cell / 8)].byte ^= CellMask[cell % 8];
+    }
+
+    PutBigEndian(packed, SN_POS, 4, sequenceNumber);
+}
+
+/**************************************************************************
+*   Function   : FragmentCount
+*   Description: Computes the number of fragments a packet must be cut
+*                into, so that no fragment is bigger than a datagram.
+*   Parameters : size - number of bytes in the packet
+*                maxDatagram - largest datagram that may be sent without
+*                              IP fragmentation, in bytes
+*   Effects    : None
+*   Returned   : Number of fragments.  1 indicates the packet fits in a
+*                datagram and should be sent as is, 0 indicates it can't
+*                be fragmented to fit.
+**************************************************************************/
+int FragmentCount(int size, int maxDatagram)
+{
+    int chunk;
+
+    if (size <= maxDatagram)
+    {
+        return(1);
+    }
+
+    chunk = maxDatagram - (FRAG_DATA_POS * sizeof(BYTE));
+    if ((chunk <= 0) || (((size + chunk - 1) / chunk) > MAX_FRAGMENTS))
+    {
+        return(0);
+    }
+
+    return((size + chunk - 1) / chunk);
+}
+
+/**************************************************************************
+*   Function   : PackFragmentBuf
+*   Description: Copies one fragment of a packet into an array provided
+*                by the caller.  The packet is cut into count pieces of
+*                equal size, except for the last piece, which may be
+*                shorter.
+*   Parameters : packed - packet to fragment
+*                size - number of bytes in packed
+*                frameID - id shared by all fragments of packed
+*                index - index of the fragment to pack
+*                count - number of fragments, from FragmentCount
+*                fragment - array to hold the fragment
+*                fragSize - size of the fragment array in bytes
+*   Effects    : The fragment is stored as follows:
+*                [VERSION_POS]              WIRE_VERSION
+*                [TYPE_POS]                 PKT_FRAGMENT
+*                [FRAG_ID_POS ..]           Frame id
+*                [FRAG_INDEX_POS ..]        Fragment index
+*                [FRAG_COUNT_POS ..]        Fragment count
+*                [FRAG_LEN_POS ..]          Bytes in packed
+*                [FRAG_DATA_POS ...]        Piece of packed
+*   Returned   : Number of bytes written to fragment.  0 indicates the
+*                fragment array is too small.
+**************************************************************************/
+int PackFragmentBuf(BYTE *packed, int size, unsigned frameID, int index,
+    int count, BYTE *fragment, int fragSize)
+{
+    int chunk, offset, piece;
+
+    chunk = (size + count - 1) / count;
+    offset = index * chunk;
+    piece = ((size - offset) < chunk) ? (size - offset) : chunk;
+
+    if ((piece <= 0) ||
+        (fragSize < (int)(FRAG_DATA_POS * sizeof(BYTE)) + piece))
+    {
+        return(0);
+    }
+
+    fragment[VERSION_POS].byte = WIRE_VERSION;
+    fragment[TYPE_POS].byte = PKT_FRAGMENT;
+    PutBigEndian(fragment, FRAG_ID_POS, 4, frameID);
+    PutBigEndian(fragment, FRAG_INDEX_POS, 2, index);
+    PutBigEndian(fragment, FRAG_COUNT_POS, 2, count);
+    PutBigEndian(fragment, FRAG_LEN_POS, 4, size);
+
+    memcpy(&fragment[FRAG_DATA_POS], (char *)packed + offset, piece);
+
+    return((FRAG_DATA_POS * sizeof(BYTE)) + piece);
+}
+
+/**************************************************************************
+*   Function   : UnpackBitsToGrid
+*   Description: Unpacks each bit from a packed grid into a character byte
+*                in a cell in a newly malloced grid. 0 is unpacked as '0',
+*                1 is unpacked as '1'.
+*   Parameters : packed - packed grid
+*   Effects    : packed is freed on sucessful returns.
+*   Returned   : GRID* - a pointer to a malloced GRID structure.
+*                        It is the job of the calling routine to use
+*                        FreeGrid to free the structure pointed to by the
+*                        returned pointer.
+*                        NULL value return indicates failure.
+**************************************************************************/
+GRID *UnpackBitsToGrid(BYTE *packed)
+{
+    GRID *grid;
+    int numCells;
+
+    grid = (GRID *)CountedMalloc(sizeof(GRID));
+    if (grid == NULL)
+    {
+        PutFormattedLine(Rows - 2, 0, "Unable to allocate grid");
+        return(NULL);
+    }
 
-	/* Store timestamp */
-    timeStamp.timeStamp = grid->timeStamp;
-    for(cell = TS_POS; cell < SN_POS; cell++)
+    numCells = PACKED_ROWS(packed) * PACKED_COLS(packed);
+    grid->cells = (char *)CountedMalloc(sizeof(char) * numCells);
+
+    if (grid->cells == NULL)
     {
-        packed[cell].byte = timeStamp.byte[cell - TS_POS];
+        PutFormattedLine(Rows - 2, 0, "Unable to allocate cell array");
+        free(grid);
+        return(NULL);
     }
 
-    /* Store sequence number */
-    sequenceNumber.sequenceNumber = grid->sequenceNumber;
-    for(; cell < ROW_POS; cell++)
+    UnpackBitsIntoGrid(packed,
+        PackedBitsSize(PACKED_ROWS(packed), PACKED_COLS(packed)),
+        grid, numCells);
+
+    free(packed);
+    return(grid);
+}
+
+/**************************************************************************
+*   Function   : UnpackBitsIntoGrid
+*   Description: Unpacks each bit from a packed grid into a character byte
+*                in a cell of a grid provided by the caller. 0 is unpacked
+*                as '0', 1 is unpacked as '1'.  The unpacking kernel is
+*                chosen by InitCodec.
+*   Parameters : packed - packed grid
+*                size - number of bytes in packed
+*                grid - grid to unpack into.  grid->cells must already
+*                       point to an array of cellsSize characters.
+*                cellsSize - number of cells in grid->cells
+*   Effects    : grid gets the packed time stamp, sequence number,
+*                dimensions, and cells.  packed is not freed.
+*   Returned   : Number of bytes written to grid->cells.  0 indicates that
+*                packed is too short for its dimensions or that
+*                grid->cells is too small.
+**************************************************************************/
+int UnpackBitsIntoGrid(BYTE *packed, int size, GRID *grid, int cellsSize)
+{
+    int numCells;
+
+    if (size < CELL_POS * (int)sizeof(BYTE))
     {
-        packed[cell].byte = sequenceNumber.byte[cell - SN_POS];
+        return(0);
     }
 
-    /* Store grid dimensions */
-    packed[ROW_POS].byte = (unsigned char)grid->rows;
-    packed[COL_POS].byte = (unsigned char)grid->cols;
+    numCells = PACKED_ROWS(packed) * PACKED_COLS(packed);
 
-    for (cell = 0; cell < numCells;)
+    if ((size < PackedBitsSize(PACKED_ROWS(packed), PACKED_COLS(packed)))
+        || (cellsSize < numCells))
     {
-        packedCell = (cell / 2) + CELL_POS;     /* Index into packed grid */
+        return(0);
+    }
+
+    LoadHeader(packed, &grid->timeStamp, &grid->sequenceNumber);
+    grid->rows = PACKED_ROWS(packed);
+    grid->cols = PACKED_COLS(packed);
+
+    /* Unpack each cell */
+    UnpackCells(&packed[CELL_POS], grid->cells, numCells);
+
+    return(sizeof(char) * numCells);
+}
+
+/**************************************************************************
+*   Function   : PackGridToNibbles
+*   Description: Packs each cell from a rows by col grid into a four bit
+*                nibble, in a newly malloced array.  See
+*                PackGridToNibblesBuf for the packed format.
+*   Parameters : grid - pointer to cell grid structure containing it's
+*                       dimensions and a character array of grid cells.
+*   Effects    : If DEBUG is defined the packed cells will be written
+*                to stdout.
+*   Returned   : BYTE* - a pointer to a malloced array of BYTEs,
+*                        containing the grid information.
+*                        It is the job of the calling routine to free
+*                        the array pointed to by the pointer.
+*                        NULL value return indicates failure.
+**************************************************************************/
+BYTE *PackGridToNibbles(GRID *grid)
+{
+    BYTE *packed;
+    int packedSize;
+#ifdef DEBUG
+    int packedCell;
+#endif
+
+    packedSize = PackedNibblesSize(grid->rows, grid->cols);
+    packed = (BYTE *)CountedMalloc(packedSize);
 
-        /* Fill packed grid */
-        packed[packedCell].nibble.nibble0 = (grid->cells[cell++] % 16) - '0';
-        packed[packedCell].nibble.nibble1 = (grid->cells[cell++] % 16) - '0';
+    if (packed == NULL)
+    {
+        PutFormattedLine(Rows - 2, 0, "Unable to allocate packed array");
+        return(NULL);
     }
 
+    PackGridToNibblesBuf(grid, packed, packedSize);
+
 #ifdef DEBUG
         printf("Packed grid:");
 
         for (packedCell = 0;
-             packedCell < ((packed[ROW_POS].byte * packed[COL_POS].byte) / 2);
+             packedCell < ((PACKED_ROWS(packed) * PACKED_COLS(packed)) / 2);
              packedCell++)
         {
             if (!(packedCell % 40))
@@ -449,6 +1158,248 @@ BYTE *PackGridToNibbles(GRID *grid)
     return(packed);
 }
 
+/**************************************************************************
+*   Function   : PackedNibblesSize
+*   Description: Returns the number of bytes a rows by cols grid packs to
+*                with PackGridToNibblesBuf.
+*   Parameters : rows - number of grid rows
+*                cols - number of grid cols
+*   Effects    : None
+*   Returned   : Size of the packed grid in bytes.
+**************************************************************************/
+int PackedNibblesSize(int rows, int cols)
+{
+    return(sizeof(BYTE) * ((((rows * cols) + 1) / 2) + CELL_POS));
+}
+
+/**************************************************************************
+*   Function   : PackGridToNibblesBuf
+*   Description: Packs each cell from a rows by col grid into a four bit
+*                nibble, in an array provided by the caller.  Cells are
+*                read as NibbleToAscii writes them, '0' - '9' as 0 - 9 and
+*                'A'+ as 10+, and values over 15 are stored as 15.  For
+*                grid sizes not evenly divided by 2, the last nibble is 0.
+*   Parameters : grid - pointer to cell grid structure containing it's
+*                       dimensions and a character array of grid cells.
+*                packed - array of at least PackedNibblesSize bytes
+*                size - size of packed in bytes
+*   Effects    : packed is filled in as follows:
+*                [VERSION_POS .. LEN_POS - 1]   As in PackGridToBitsBuf,
+*                                               type PKT_NIBBLES
+*                [LEN_POS .. CELL_POS - 1]      Bytes of cell data
+*                [CELL_POS ...]                 Cell data packed so each
+*                                               cell is 4 bits
+*   Returned   : Number of bytes packed.  0 indicates packed is too small.
+**************************************************************************/
+int PackGridToNibblesBuf(GRID *grid, BYTE *packed, int size)
+{
+    int cell, numCells, packedSize, value;
+    BYTE *nibbles;
+
+    numCells = grid->rows * grid->cols;
+    packedSize = PackedNibblesSize(grid->rows, grid->cols);
+
+    if (size < packedSize)
+    {
+        return(0);
+    }
+
+    StoreHeader(packed, PKT_NIBBLES, grid, (numCells + 1) / 2);
+    nibbles = &packed[CELL_POS];
+
+    if (numCells & 1)
+    {
+        nibbles[numCells / 2].byte = 0; /* Pad an odd cell with 0 */
+    }
+
+    for (cell = 0; cell < numCells; cell++)
+    {
+        value = AsciiToNibble(grid->cells[cell]);
+
+        if (cell & 1)
+        {
+            nibbles[cell / 2].nibble.nibble1 = value;
+        }
+        else
+        {
+            nibbles[cell / 2].nibble.nibble0 = value;
+        }
+    }
+
+    return(packedSize);
+}
+
+
+/**************************************************************************
+*   Function   : PackedTileSize
+*   Description: Returns the number of bytes PackTileToNibblesBuf needs
+*                for a rows by cols tile.
+*   Parameters : rows - number of rows in the tile
+*                cols - number of columns in the tile
+*   Effects    : None
+*   Returned   : Size of the packed tile in bytes
+**************************************************************************/
+int PackedTileSize(int rows, int cols)
+{
+    return(TILE_CELL_POS + (((rows * cols) + 1) / 2));
+}
+
+/**************************************************************************
+*   Function   : PackTileToNibblesBuf
+*   Description: Packs the cells of a rectangle of a grid into four bit
+*                nibbles, the way PackGridToNibblesBuf packs a whole grid,
+*                so a receiver that only wants part of a large grid is
+*                only sent that part.  The rectangle is cut off at the
+*                edges of the grid.
+*   Parameters : grid - pointer to cell grid structure containing it's
+*                       dimensions and a character array of grid cells.
+*                row - first row of the tile
+*                col - first column of the tile
+*                rows - number of rows in the tile
+*                cols - number of columns in the tile
+*                packed - array of at least PackedTileSize bytes
+*                size - size of packed in bytes
+*   Effects    : packed is filled in as follows:
+*                [VERSION_POS .. LEN_POS - 1]   As in PackGridToBitsBuf,
+*                                               type PKT_TILE, with the
+*                                               tile's rows and columns
+*                [LEN_POS .. CELL_POS - 1]      Bytes after the header
+*                [TILE_ROW_POS .. TILE_COL_POS - 1]     row
+*                [TILE_COL_POS .. GRID_ROWS_POS - 1]    col
+*                [GRID_ROWS_POS .. GRID_COLS_POS - 1]   Rows of grid
+*                [GRID_COLS_POS .. TILE_CELL_POS - 1]   Columns of grid
+*                [TILE_CELL_POS ...]            Tile's cells, row by row,
+*                                               4 bits each
+*   Returned   : Number of bytes packed.  0 indicates the tile is not in
+*                the grid, or packed is too small.
+**************************************************************************/
+int PackTileToNibblesBuf(GRID *grid, int row, int col, int rows, int cols,
+    BYTE *packed, int size)
+{
+    int r, c, cell, packedSize, value;
+    BYTE *nibbles;
+    char *cells;
+
+    if ((row < 0) || (col < 0) || (row >= grid->rows) ||
+        (col >= grid->cols) || (rows <= 0) || (cols <= 0))
+    {
+        return(0);
+    }
+
+    rows = (rows < grid->rows - row) ? rows : (grid->rows - row);
+    cols = (cols < grid->cols - col) ? cols : (grid->cols - col);
+    packedSize = PackedTileSize(rows, cols);
+
+    if (size < packedSize)
+    {
+        return(0);
+    }
+
+    StoreHeader(packed, PKT_TILE, grid, packedSize - CELL_POS);
+    PutBigEndian(packed, ROW_POS, 2, rows);
+    PutBigEndian(packed, COL_POS, 2, cols);
+    PutBigEndian(packed, TILE_ROW_POS, 2, row);
+    PutBigEndian(packed, TILE_COL_POS, 2, col);
+    PutBigEndian(packed, GRID_ROWS_POS, 2, grid->rows);
+    PutBigEndian(packed, GRID_COLS_POS, 2, grid->cols);
+    nibbles = &packed[TILE_CELL_POS];
+
+    if ((rows * cols) & 1)
+    {
+        nibbles[(rows * cols) / 2].byte = 0;    /* Pad an odd cell with 0 */
+    }
+
+    cell = 0;
+
+    for (r = 0; r < rows; r++)
+    {
+        cells = &grid->cells[((row + r) * grid->cols) + col];
+
+        for (c = 0; c < cols; c++, cell++)
+        {
+            value = AsciiToNibble(cells[c]);
+
+            if (cell & 1)
+            {
+                nibbles[cell / 2].nibble.nibble1 = value;
+            }
+            else
+            {
+                nibbles[cell / 2].nibble.nibble0 = value;
+            }
+        }
+    }
+
+    return(packedSize);
+}
+
+/**************************************************************************
+*   Function   : ReduceCell
+*   Description: Sets a cell of a grid half the size of another, in each
+*                direction, to the rounded mean of the 2 x 2 cells it
+*                covers.  Cells past the edge of the fine grid are left
+*                out of the mean, so odd sizes round up.
+*   Parameters : fine - grid to reduce
+*                coarse - grid of (fine->rows + 1) / 2 by
+*                         (fine->cols + 1) / 2 cells
+*                row - row of the coarse cell
+*                col - column of the coarse cell
+*   Effects    : The coarse cell is set, as NibbleToAscii writes it.
+*   Returned   : TRUE if the coarse cell changed, otherwise FALSE.
+**************************************************************************/
+int ReduceCell(GRID *fine, GRID *coarse, int row, int col)
+{
+    int r, c, sum, count;
+    char cell;
+
+    sum = 0;
+    count = 0;
+
+    for (r = 2 * row; (r < 2 * row + 2) && (r < fine->rows); r++)
+    {
+        for (c = 2 * col; (c < 2 * col + 2) && (c < fine->cols); c++)
+        {
+            sum += AsciiToNibble(fine->cells[(r * fine->cols) + c]);
+            count++;
+        }
+    }
+
+    cell = NibbleToAscii((sum + (count / 2)) / count);
+
+    if (coarse->cells[(row * coarse->cols) + col] == cell)
+    {
+        return(FALSE);
+    }
+
+    coarse->cells[(row * coarse->cols) + col] = cell;
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : AsciiToNibble
+*   Description: Reads a cell the way NibbleToAscii writes it, '0' - '9'
+*                as 0 - 9 and 'A'+ as 10+.  Values over 15 are read as 15.
+*   Parameters : cell - ASCII cell
+*   Effects    : None
+*   Returned   : Value of the cell, 0 to 15
+**************************************************************************/
+static int AsciiToNibble(char cell)
+{
+    int value;
+
+    value = (cell <= '9') ? (cell - '0') : (cell - 'A' + 10);
+
+    if (value > 15)
+    {
+        value = 15;
+    }
+    else if (value < 0)
+    {
+        value = 0;
+    }
+
+    return(value);
+}
 
 /**************************************************************************
 *   Function   : UnpackNibblesToGrid
@@ -467,10 +1418,8 @@ GRID *UnpackNibblesToGrid(BYTE *packed)
 {
     int packedCell, packedCells, cell, overflow;
     GRID *grid;
-    TIME_CNV timeStamp;
-    SN_CNV sequenceNumber;
 
-    grid = (GRID *)malloc(sizeof(GRID));
+    grid = (GRID *)CountedMalloc(sizeof(GRID));
 
     if (grid == NULL)
     {
@@ -478,8 +1427,8 @@ GRID *UnpackNibblesToGrid(BYTE *packed)
         return(NULL);
     }
 
-    grid->cells = (char *)malloc(sizeof(char) *
-        (packed[ROW_POS].byte * packed[COL_POS].byte));
+    grid->cells = (char *)CountedMalloc(sizeof(char) *
+        (PACKED_ROWS(packed) * PACKED_COLS(packed)));
 
     if (grid->cells == NULL)
     {
@@ -489,28 +1438,14 @@ GRID *UnpackNibblesToGrid(BYTE *packed)
         return(NULL);
     }
 
-    /* Get timestamp */
-    for(cell = TS_POS; cell < SN_POS; cell++)
-    {
-        timeStamp.byte[cell - TS_POS] = packed[cell].byte;
-    }
-    grid->timeStamp = timeStamp.timeStamp;
-
-    /* Get sequence number */
-    for(; cell < ROW_POS; cell++)
-    {
-        sequenceNumber.byte[cell - SN_POS] = packed[cell].byte;
-    }
-    grid->sequenceNumber = sequenceNumber.sequenceNumber;
-
-    /* Get dimensions */
-    grid->rows = packed[ROW_POS].byte;
-    grid->cols = packed[COL_POS].byte;
+    LoadHeader(packed, &grid->timeStamp, &grid->sequenceNumber);
+    grid->rows = PACKED_ROWS(packed);
+    grid->cols = PACKED_COLS(packed);
 
-    packedCells = (packed[ROW_POS].byte * packed[COL_POS].byte) / 2;
+    packedCells = (PACKED_ROWS(packed) * PACKED_COLS(packed)) / 2;
 
     /* Make sure to account for non-even number of nibbles */
-    overflow = ((packed[ROW_POS].byte * packed[COL_POS].byte) % 2);
+    overflow = ((PACKED_ROWS(packed) * PACKED_COLS(packed)) % 2);
 
     /* Unpack each byte */
     for (packedCell = CELL_POS, cell = 0;
@@ -579,13 +1514,21 @@ void FreeGrid(GRID *grid)
 *   Parameters : grid - pointer to cell grid structure containing it's
 *                       dimensions and a character array of grid cells.
 *                display - non-zero to display results.
-*   Effects    : Random grid cell values are mutated.
+*                flips - list to record the mutated cells in, or NULL.
+*   Effects    : Random grid cell values are mutated.  If flips is not
+*                NULL, it is set to the mutated cells in ascending order.
 *   Returned   : None
 **************************************************************************/
-void MutateGrid(GRID *grid, int display)
+void MutateGrid(GRID *grid, int display, FLIP_LIST *flips)
 {
     int cell, range;
 
+    if (flips != NULL)
+    {
+        flips->count = 0;
+        flips->overflow = FALSE;
+    }
+
     /* Calcualte the maximum distance between mutations */
     range = (grid->rows * grid->cols) / 5;
     cell = rand() % range;
@@ -601,6 +1544,18 @@ void MutateGrid(GRID *grid, int display)
             grid->cells[cell] = '0';
         }
 
+        if (flips != NULL)
+        {
+            if (flips->count < flips->size)
+            {
+                flips->cells[flips->count++] = cell;
+            }
+            else
+            {
+                flips->overflow = TRUE;
+            }
+        }
+
         if (display)
         {
             mvaddch((cell / grid->cols) + 2, (cell % grid->cols),
@@ -620,7 +1575,12 @@ void MutateGrid(GRID *grid, int display)
 *   Function   : ShowGrid
 *   Description: Writes a copy of the grid cells to stdscr.  In order for
 *                this to work, the curses screen must be initialized by
-*                InitScreen.
+*                InitScreen.  Only the cells that differ from the last
+*                grid shown are written, so the terminal output follows
+*                the number of changes, not the size of the grid, and the
+*                screen is refreshed once.  With the status log on, the
+*                refresh is left to DrainStatus, and a headless log
+*                leaves the grid undrawn.
 *   Parameters : grid - pointer to cell grid structure containing it's
 *                       dimensions and a character array of grid cells.
 *   Effects    : grid cells are dumped to stdout
@@ -628,33 +1588,165 @@ void MutateGrid(GRID *grid, int display)
 **************************************************************************/
 void ShowGrid(GRID *grid)
 {
-    int row, col;
+    if (statusFile != NULL)
+    {
+        return;
+    }
 
-    PutFormattedLine(0, (Cols - 13) / 2,
-        "%02d by %02d grid", grid->rows, grid->cols);
+    pthread_mutex_lock(&screenLock);
+
+    ShowLine(0, (Cols - 13) / 2, "%02d by %02d grid",
+        grid->rows, grid->cols);
 
     /* Display grid */
-    for (row = 0; row < grid->rows; row++)
-    {
-        for (col = 0; col < grid->cols; col++)
-        {
-            mvaddch(row + 2, col, grid->cells[(row * grid->cols) + col]);
-            clrtoeol();
-        }
-    }
+    DrawGrid(grid);
 
-    PutFormattedLine(grid->rows + 4, 0, "Sequence Number: %u",
+    ShowLine(grid->rows + 4, 0, "Sequence Number: %u",
         grid->sequenceNumber);
 
-    PutFormattedLine(grid->rows + 5, 0, "Seconds: %ld\tMicrosecods: %ld\n",
+    ShowLine(grid->rows + 5, 0, "Seconds: %ld\tMicrosecods: %ld\n",
         grid->timeStamp.tv_sec, grid->timeStamp.tv_usec);
+
+    if (!statusLogging)
+    {
+        refresh();
+    }
+
+    pthread_mutex_unlock(&screenLock);
+}
+
+/**************************************************************************
+*   Function   : DrawGrid
+*   Description: Draws the cells of a grid that differ from the cells
+*                last drawn, a row at a time.  Rows are compared a word at
+*                a time, and changes less than DRAW_GAP cells apart are
+*                drawn as one run with a single mvaddnstr.  Everything is
+*                drawn when the size of the grid changes, or the screen
+*                may have been drawn over.  Cells off the screen are left
+*                out.  The caller holds screenLock.
+*   Parameters : grid - grid to draw
+*   Effects    : The grid is on stdscr, not yet refreshed, and its cells
+*                are kept in drawnCells.
+*   Returned   : None
+**************************************************************************/
+static void DrawGrid(GRID *grid)
+{
+    unsigned long long word, drawnWord;
+    int row, col, rows, cols, start, last;
+    char *cells, *drawn;
+
+    rows = (grid->rows < Rows - 2) ? grid->rows : (Rows - 2);
+    cols = (grid->cols < Cols) ? grid->cols : Cols;
+
+    if ((rows <= 0) || (cols <= 0))
+    {
+        return;
+    }
+
+    if ((rows * cols) > drawnSize)
+    {
+        free(drawnCells);
+        drawnCells = (char *)CountedMalloc(rows * cols);
+        drawnSize = (drawnCells == NULL) ? 0 : (rows * cols);
+        drawnRows = 0;
+    }
+
+    if ((rows != drawnRows) || (cols != drawnCols))
+    {
+        /* Clear what the last grid left, then draw every cell */
+        for (row = 0; (row < drawnRows) || (row < rows); row++)
+        {
+            move(row + 2, 0);
+            clrtoeol();
+        }
+
+        for (row = 0; row < rows; row++)
+        {
+            mvaddnstr(row + 2, 0, &grid->cells[row * grid->cols], cols);
+        }
+
+        if (drawnCells != NULL)
+        {
+            for (row = 0; row < rows; row++)
+            {
+                memcpy(&drawnCells[row * cols],
+                    &grid->cells[row * grid->cols], cols);
+            }
+
+            drawnRows = rows;
+            drawnCols = cols;
+        }
+
+        return;
+    }
+
+    for (row = 0; row < rows; row++)
+    {
+        cells = &grid->cells[row * grid->cols];
+        drawn = &drawnCells[row * cols];
+        start = -1;
+        last = -1;
+
+        for (col = 0; col < cols; col++)
+        {
+            /* Skip unchanged words outside a run */
+            if ((start < 0) && (col + (int)sizeof(word) <= cols))
+            {
+                memcpy(&word, &cells[col], sizeof(word));
+                memcpy(&drawnWord, &drawn[col], sizeof(drawnWord));
+
+                if (word == drawnWord)
+                {
+                    col += sizeof(word) - 1;
+                    continue;
+                }
+            }
+
+            if (cells[col] != drawn[col])
+            {
+                start = (start < 0) ? col : start;
+                last = col;
+            }
+            else if ((start >= 0) && (col - last >= DRAW_GAP))
+            {
+                /* Too far to the next change to draw through */
+                DrawRun(row + 2, start, &cells[start], &drawn[start],
+                    last + 1 - start);
+                start = -1;
+            }
+        }
+
+        if (start >= 0)
+        {
+            DrawRun(row + 2, start, &cells[start], &drawn[start],
+                last + 1 - start);
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : DrawRun
+*   Description: Draws a run of cells on one row with a single
+*                mvaddnstr.
+*   Parameters : row - screen row
+*                col - screen column of the first cell
+*                cells - cells to draw
+*                drawn - cells last drawn in the same places
+*                count - number of cells in the run
+*   Effects    : The cells are on stdscr, and copied to drawn.
+*   Returned   : None
+**************************************************************************/
+static void DrawRun(int row, int col, char *cells, char *drawn, int count)
+{
+    mvaddnstr(row, col, cells, count);
+    memcpy(drawn, cells, count);
 }
 
 /**************************************************************************
 *   Function   : UnpackBitsToBuffer
-*   Description: Unpacks each bit from a packed grid into a floating point
-*                cell in a newly malloced grid. 0 is unpacked as 0.0, and
-*                1 is unpacked as 1.0.
+*   Description: Unpacks each bit from a packed grid into a fixed point
+*                cell in a newly malloced grid. 0 is unpacked as 0, and
+*                1 is unpacked as FIXED_ONE.
 *   Parameters : packed - packed grid
 *   Effects    : packed is freed on sucessful returns.
 *   Returned   : GRID_BUF* - a pointer to a malloced GRID_BUF structure.
@@ -665,141 +1757,287 @@ void ShowGrid(GRID *grid)
 **************************************************************************/
 GRID_BUF *UnpackBitsToBuffer(BYTE *packed)
 {
-    int packedCell, packedCells, cell, overflow;
     GRID_BUF *buffer;
-    TIME_CNV timeStamp;
-    SN_CNV sequenceNumber;
 
-    buffer = (GRID_BUF *)malloc(sizeof(GRID_BUF));
+    buffer = (GRID_BUF *)CountedMalloc(sizeof(GRID_BUF));
     if (buffer == NULL)
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate grid buffer");
         return(NULL);
     }
 
-    buffer->cells = (float *)malloc(sizeof(float) *
-        (packed[ROW_POS].byte * packed[COL_POS].byte));
+    buffer->size = PACKED_ROWS(packed) * PADDED_COLS(PACKED_COLS(packed));
+    buffer->cells = (FIXED *)CountedAlignedMalloc(sizeof(FIXED) *
+        buffer->size);
+    buffer->bits = (BYTE *)CountedMalloc(sizeof(BYTE) *
+        ((PACKED_ROWS(packed) * PACKED_COLS(packed) + 7) / 8));
 
-    if (buffer->cells == NULL)
+    if ((buffer->cells == NULL) || (buffer->bits == NULL))
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate cell array");
-        free(buffer);
+        FreeBuffer(buffer);
+        return(NULL);
+    }
+
+    if (!UnpackBitsIntoBuffer(packed,
+        PackedBitsSize(PACKED_ROWS(packed), PACKED_COLS(packed)), buffer))
+    {
+        PutFormattedLine(Rows - 2, 0, "Error in grid size calculation");
+        FreeBuffer(buffer);
         return(NULL);
     }
 
-    /* Get timestamp */
-    for(cell = TS_POS; cell < SN_POS; cell++)
+    free(packed);
+    return(buffer);
+}
+
+/**************************************************************************
+*   Function   : UnpackBitsIntoBuffer
+*   Description: Unpacks each bit from a packed grid into a fixed point
+*                cell of a buffer provided by the caller. 0 is unpacked as
+*                0, and 1 is unpacked as FIXED_ONE.
+*   Parameters : packed - packed grid
+*                size - number of bytes in packed
+*                buffer - buffer to unpack into.  buffer->cells must
+*                         already point to a CELL_ALIGN aligned array of
+*                         buffer->size FIXEDs, enough for the rows padded
+*                         by PADDED_COLS, and buffer->bits to an array of
+*                         (rows * cols + 7) / 8 BYTEs.
+*   Effects    : buffer gets the packed time stamp, sequence number,
+*                dimensions, and cells, and is marked updated.  packed is
+*                not freed.
+*   Returned   : Number of bytes written to buffer->cells.  0 indicates
+*                that packed is too short for its dimensions or that
+*                buffer->cells is too small.
+**************************************************************************/
+int UnpackBitsIntoBuffer(BYTE *packed, int size, GRID_BUF *buffer)
+{
+    int numCells;
+
+    if (size < CELL_POS * (int)sizeof(BYTE))
     {
-        timeStamp.byte[cell - TS_POS] = packed[cell].byte;
+        return(0);
     }
-    buffer->timeStamp = timeStamp.timeStamp;
 
-    /* Get sequence number */
-    for(; cell < ROW_POS; cell++)
+    numCells = PACKED_ROWS(packed) * PACKED_COLS(packed);
+
+    if ((size < PackedBitsSize(PACKED_ROWS(packed), PACKED_COLS(packed)))
+        || (buffer->size <
+            PACKED_ROWS(packed) * PADDED_COLS(PACKED_COLS(packed))))
     {
-        sequenceNumber.byte[cell - SN_POS] = packed[cell].byte;
+        return(0);
     }
-    buffer->sequenceNumber = sequenceNumber.sequenceNumber;
 
-    /* Get dimensions */
-    buffer->rows = packed[ROW_POS].byte;
-    buffer->cols = packed[COL_POS].byte;
+    LoadHeader(packed, &buffer->timeStamp, &buffer->sequenceNumber);
+    buffer->rows = PACKED_ROWS(packed);
+    buffer->cols = PACKED_COLS(packed);
+    buffer->stride = PADDED_COLS(buffer->cols);
 
-    packedCells = (packed[ROW_POS].byte * packed[COL_POS].byte) / 8;
+    /* Keep the bits for applying deltas, and expand them into cells */
+    memcpy(buffer->bits, &packed[CELL_POS],
+        sizeof(BYTE) * ((numCells + 7) / 8));
+    ExpandBits(buffer, 0, numCells);
 
-    /* Make sure to account for non-even number of bits */
-    overflow = ((packed[ROW_POS].byte * packed[COL_POS].byte) % 8);
+    buffer->age = 0;
+    buffer->updated = TRUE;
+    return(sizeof(FIXED) * numCells);
+}
 
-    /* Unpack each byte */
-    for (packedCell = CELL_POS, cell = 0;
-         packedCell < (packedCells + CELL_POS);
-         packedCell++)
+/**************************************************************************
+*   Function   : ApplyDeltaToBuffer
+*   Description: Applies a delta packet made by PackBitsToDelta to a
+*                client's buffer in place.  The delta is only applied if
+*                it was coded against the frame held in the buffer, and
+*                only the cells in changed bytes are rewritten.  Aging
+*                never changes the cells, so an aged buffer just has its
+*                age cleared.
+*   Parameters : delta - delta packet
+*                size - number of bytes in delta
+*                buffer - buffer to apply delta to.  buffer->bits must hold
+*                         the bit packed cells of the base frame.
+*                sum - running sum to add the changed cells to, or NULL.
+*                      Only pass a running sum for a buffer with age 0.
+*   Effects    : buffer gets the delta's time stamp, sequence number, and
+*                cells, and is marked updated.  sum gets the difference
+*                for each changed cell.  delta is not freed.
+*   Returned   : Number of changed bytes applied.  -1 indicates that the
+*                delta is malformed, or is not based on the buffer's frame.
+**************************************************************************/
+int ApplyDeltaToBuffer(BYTE *delta, int size, GRID_BUF *buffer,
+    ACCUMULATOR *sum)
+{
+    int pos, limit, cell, numCells, numBytes, changed = 0;
+    unsigned unchanged, run;
+
+    limit = size / sizeof(BYTE);
+
+    if ((limit < DELTA_POS) || (buffer->bits == NULL) ||
+        (PACKED_ROWS(delta) != buffer->rows) ||
+        (PACKED_COLS(delta) != buffer->cols))
     {
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit1;
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit2;
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit3;
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit4;
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit5;
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit6;
-        buffer->cells[cell++] = (float)packed[packedCell].bit.bit7;
+        return(-1);
     }
 
-    /* Fill overflow bits */
-    switch (overflow)
+    /* Make sure we have the frame the delta was made from */
+    if (GetBigEndian(delta, BASE_POS, 4) != buffer->sequenceNumber)
     {
-        case 0:                 /* There are no extra bits */
-            break;
+        return(-1);
+    }
 
-        case 1:
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-            break;
+    numCells = buffer->rows * buffer->cols;
+    numBytes = (numCells + 7) / 8;
 
-        case 2:
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit1;
-            break;
+    /* Check the runs before changing anything.  Each count is checked
+     * against what is left on its own, so no sum of them can wrap. */
+    for (pos = DELTA_POS, cell = 0; cell < numBytes; cell += run, pos += run)
+    {
+        pos = GetVarint(delta, pos, limit, numBytes - cell, &unchanged);
+        if (pos >= 0)
+        {
+            pos = GetVarint(delta, pos, limit, numBytes - cell - unchanged,
+                &run);
+        }
 
-        case 3:
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit1;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit2;
-            break;
+        if ((pos < 0) || (run > (unsigned)(limit - pos)))
+        {
+            return(-1);
+        }
 
-        case 4:
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit1;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit2;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit3;
-            break;
+        cell += unchanged;
+    }
 
-        case 5:
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit1;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit2;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit3;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit4;
-            break;
+    /* Now XOR in the changed bytes */
+    for (pos = DELTA_POS, cell = 0; cell < numBytes;)
+    {
+        pos = GetVarint(delta, pos, limit, numBytes - cell, &unchanged);
+        pos = GetVarint(delta, pos, limit, numBytes - cell - unchanged,
+            &run);
+        cell += unchanged;
 
-        case 6:
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit1;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit2;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit3;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit4;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit5;
-            break;
+        for (; run > 0; run--, cell++, pos++, changed++)
+        {
+            buffer->bits[cell].byte ^= delta[pos].byte;
 
-        case 7:
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit0;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit1;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit2;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit3;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit4;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit5;
-            buffer->cells[cell++] = (float)packed[packedCell].bit.bit6;
-            break;
+            if (sum != NULL)
+            {
+                AccumulateByte(sum, buffer, cell, delta[pos].byte,
+                    buffer->bits[cell].byte);
+            }
 
-        default:
-            PutFormattedLine(Rows - 2, 0, "Error in grid size calculation");
-            FreeBuffer(buffer);
-            return(NULL);
+            ExpandBits(buffer, cell * 8,
+                (numCells - (cell * 8)) < 8 ? numCells - (cell * 8) : 8);
+        }
     }
 
+    buffer->age = 0;
+
+    LoadHeader(delta, &buffer->timeStamp, &buffer->sequenceNumber);
+
     buffer->updated = TRUE;
-    free(packed);
-    return(buffer);
+    return(changed);
+}
+
+/**************************************************************************
+*   Function   : ApplyFlipsToBuffer
+*   Description: Applies a flip packet made by PackFlipsToBuf to a client's
+*                buffer in place.  The flips are only applied if they were
+*                made from the frame held in the buffer.  Only the toggled
+*                cells are rewritten.
+*   Parameters : flips - flip packet
+*                size - number of bytes in flips
+*                buffer - buffer to apply flips to.  buffer->bits must hold
+*                         the bit packed cells of the base frame.
+*                sum - running sum to add the toggled cells to, or NULL.
+*                      Only pass a running sum for a buffer with age 0.
+*   Effects    : buffer gets the packet's time stamp, sequence number, and
+*                cells, and is marked updated.  sum gets the difference
+*                for each toggled cell.  flips is not freed.
+*   Returned   : Number of cells toggled.  -1 indicates that the packet is
+*                malformed, or is not based on the buffer's frame.
+**************************************************************************/
+int ApplyFlipsToBuffer(BYTE *flips, int size, GRID_BUF *buffer,
+    ACCUMULATOR *sum)
+{
+    int pos, start, limit, flip, numCells;
+    unsigned count, gap, cell;
+
+    limit = size / sizeof(BYTE);
+
+    if ((limit < DELTA_POS) || (buffer->bits == NULL) ||
+        (PACKED_ROWS(flips) != buffer->rows) ||
+        (PACKED_COLS(flips) != buffer->cols))
+    {
+        return(-1);
+    }
+
+    /* Make sure we have the frame the flips were made from */
+    if (GetBigEndian(flips, BASE_POS, 4) != buffer->sequenceNumber)
+    {
+        return(-1);
+    }
+
+    numCells = buffer->rows * buffer->cols;
+
+    /* Check every flip is in the grid before changing anything */
+    start = pos = GetVarint(flips, DELTA_POS, limit, numCells, &count);
+
+    for (flip = 0, cell = 0; (flip < (int)count) && (pos >= 0); flip++)
+    {
+        pos = (cell < (unsigned)numCells) ?
+            GetVarint(flips, pos, limit, numCells - cell - 1, &gap) : -1;
+
+        if (pos < 0)
+        {
+            return(-1);
+        }
+
+        cell += gap + 1;
+    }
+
+    if (pos < 0)
+    {
+        return(-1);
+    }
+
+    /* Now toggle the cells */
+    for (flip = 0, cell = 0, pos = start; flip < (int)count; flip++)
+    {
+        pos = GetVarint(flips, pos, limit, numCells - cell - 1, &gap);
+        cell += gap;
+
+        buffer->bits[cell / 8].byte ^= CellMask[cell % 8];
+
+        if (sum != NULL)
+        {
+            AccumulateByte(sum, buffer, cell / 8, CellMask[cell % 8],
+                buffer->bits[cell / 8].byte);
+        }
+
+        buffer->cells[((cell / buffer->cols) * buffer->stride) +
+            (cell % buffer->cols)] =
+            (buffer->bits[cell / 8].byte & CellMask[cell % 8]) ?
+            FIXED_ONE : 0;
+
+        cell++;
+    }
+
+    buffer->age = 0;
+
+    LoadHeader(flips, &buffer->timeStamp, &buffer->sequenceNumber);
+
+    buffer->updated = TRUE;
+    return(count);
 }
 
 /**************************************************************************
 *   Function   : FreeBuffer
-*   Description: Frees the malloced data space pointed to by buffer->cells
-*                and buffer.
+*   Description: Frees the malloced data space pointed to by buffer->cells,
+*                buffer->bits, and buffer.
 *   Parameters : buffer - pointer to buffered cell grid structure
 *                         containing its dimensions and a character array
 *                         of grid cells.
-*   Effects    : The malloced data space pointed to by buffer->cells and
-*                buffer are returned to the heap.
+*   Effects    : The malloced data space pointed to by buffer->cells,
+*                buffer->bits, and buffer are returned to the heap.
 *   Returned   : None
 **************************************************************************/
 void FreeBuffer(GRID_BUF *buffer)
@@ -810,6 +2048,11 @@ void FreeBuffer(GRID_BUF *buffer)
         {
             free(buffer->cells);
         }
+
+        if (buffer->bits != NULL)
+        {
+            free(buffer->bits);
+        }
         free(buffer);
     }
 }
@@ -828,6 +2071,11 @@ void ShowBuffer(GRID_BUF *buffer)
 {
     int row, col;
 
+    /* The grid is drawn over, ShowGrid must draw all of it again */
+    pthread_mutex_lock(&screenLock);
+    drawnRows = 0;
+    pthread_mutex_unlock(&screenLock);
+
     /* Display grid */
     for (row = 0; row < buffer->rows;)
     {
@@ -837,7 +2085,8 @@ void ShowBuffer(GRID_BUF *buffer)
         for (col = 0; col < buffer->cols;)
         {
             PutFormattedLine((++col) % Rows, 0, "%f",
-                buffer->cells[(row * buffer->cols) + col]);
+                (float)(buffer->cells[(row * buffer->stride) + col] *
+                CellWeight(buffer->age)) / (FIXED_ONE * FIXED_ONE));
         }
 
         if ((++row) < buffer->rows)
@@ -856,383 +2105,1012 @@ void ShowBuffer(GRID_BUF *buffer)
 }
 
 /**************************************************************************
-*   Function   : AddClient
-*   Description: Adds a client buffer item to the client buffer list, if
-*                if one does not already exist.  Otherwise a pointer to
-*                the existing buffer will be returned.
-*   Parameters : head - A pointer to the head of the client buffer linked
-*                       list.  This value may change if the head passed is
-*                       NULL.
-*                id - ID of the client being added to the client buffer
-*                     list.
-*   Effects    : If there is not a client list item for a client with
-*                the ID passed as a parameter, it will be created and
-*                added to the linked list.  If the linked list is empty,
-*                the head will be modified to point to the new list item.
-*   Returned   : Pointer to the allocated (or existing) client list item.
+*   Function   : InitClientStore
+*   Description: Starts an empty client store.  Slots and slabs are
+*                allocated as clients join and their grids grow.
+*   Parameters : store - store to initialize
+*   Effects    : store has no slots.
+*   Returned   : None
+**************************************************************************/
+void InitClientStore(CLIENT_STORE *store)
+{
+    memset(store, 0, sizeof(CLIENT_STORE));
+}
+
+/**************************************************************************
+*   Function   : FreeClientStore
+*   Description: Frees every client in a store, and the store's arrays.
+*   Parameters : store - store started by InitClientStore
+*   Effects    : All of the store's memory is returned to the heap, and
+*                the store is empty again.
+*   Returned   : None
 **************************************************************************/
-BUF_LIST *AddClient(BUF_LIST **head, int id)
+void FreeClientStore(CLIENT_STORE *store)
 {
-    BUF_LIST *here, *prev;
+    int slot;
 
-    /* Handle empty list */
-    if (*head == NULL)
+    for (slot = 0; slot < store->high; slot++)
     {
-        *head = (BUF_LIST *)malloc(sizeof(BUF_LIST));
+        FreeReassembly(store->frames[slot]);
+    }
 
-        if (*head == NULL)
-        {
-            PutFormattedLine(Rows - 2, 0,
-               "Unable to allocate buffer list item");
-            return(NULL);
-        }
+    free(store->freeSlots);
+    free(store->used);
+    free(store->keys);
+    free(store->buffers);
+    free(store->frames);
+    free(store->cells);
+    free(store->bits);
+    free(store->table);
+    InitClientStore(store);
+}
+
+/**************************************************************************
+*   Function   : MakeClientKey
+*   Description: Makes the key that identifies a client from the address
+*                and port it sends from.  IPv4 addresses are stored as IPv4
+*                mapped IPv6 addresses, so both kinds share one key type.
+*   Parameters : key - key to fill in
+*                addr - AF_INET or AF_INET6 address of the client
+*                session - session ID sent by the client, or 0 for none
+*   Effects    : key is set.  Unused bytes are zeroed, so keys can be
+*                hashed and compared as plain memory.
+*   Returned   : None
+**************************************************************************/
+void MakeClientKey(CLIENT_KEY *key, const struct sockaddr *addr,
+    unsigned int session)
+{
+    memset(key, 0, sizeof(CLIENT_KEY));
 
-        /* Initialize new item */
-        (*head)->id = id;
-        (*head)->buffer = NULL;
-        (*head)->next = NULL;
-        here = *head;
+    if (addr->sa_family == AF_INET6)
+    {
+        memcpy(key->addr,
+            &((const struct sockaddr_in6 *)addr)->sin6_addr,
+            CLIENT_ADDR_LEN);
+        key->port = ((const struct sockaddr_in6 *)addr)->sin6_port;
     }
     else
     {
-        here = *head;
-        prev = NULL;
+        /* ::ffff:a.b.c.d */
+        key->addr[10] = 0xFF;
+        key->addr[11] = 0xFF;
+        memcpy(&key->addr[12],
+            &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        key->port = ((const struct sockaddr_in *)addr)->sin_port;
+    }
 
-        /* Go to the end of the list looking for id */
-        while (here != NULL)
-        {
-            if (here->id == id)
-            {
-                /* id already exists bail out */
-                return(here);
-            }
+    key->session = session;
+}
+
+/**************************************************************************
+*   Function   : AddClient
+*   Description: Adds a client to the client store, if it is not already
+*                there.  A freed slot is reused if there is one, otherwise
+*                the next new slot is taken, and the slots are doubled
+*                when they run out.  The client is looked for and put in
+*                the hash table with a single probe.
+*   Parameters : store - client store
+*                key - key of the client being added to the store.
+*   Effects    : If there is no slot for a client with the key passed as a
+*                parameter, one is set up with no frame.
+*   Returned   : Slot of the new (or existing) client.  -1 if there are
+*                no slots left and more can not be allocated.
+**************************************************************************/
+int AddClient(CLIENT_STORE *store, const CLIENT_KEY *key)
+{
+    GRID_BUF *buffer;
+    int slot, entry, mask;
+
+    /* Keep the table at most half full, so probes stay short */
+    if (((store->count + 1) * 2 > store->tableSize) && !GrowTable(store))
+    {
+        PutFormattedLine(Rows - 2, 0, "Unable to allocate client table");
+        return(-1);
+    }
+
+    mask = store->tableSize - 1;
+    entry = HashClientKey(key) & mask;
 
-            prev = here;
-            here = here->next;
+    while (store->table[entry] >= 0)
+    {
+        if (!memcmp(&store->keys[store->table[entry]], key,
+            sizeof(CLIENT_KEY)))
+        {
+            return(store->table[entry]);
         }
 
-        /* Allocate new buffer list item */
-        here = (BUF_LIST *)malloc(sizeof(BUF_LIST));
+        entry = (entry + 1) & mask;
+    }
 
-        if (here == NULL)
+    if (store->freeCount > 0)
+    {
+        slot = store->freeSlots[--store->freeCount];
+    }
+    else
+    {
+        if ((store->high == store->capacity) && !GrowSlots(store))
         {
-            PutFormattedLine(Rows - 2, 0,
-               "Unable to allocate buffer list item");
-            return(NULL);
+            PutFormattedLine(Rows - 2, 0, "Unable to allocate client slot");
+            return(-1);
         }
 
-        /* Initialize new item */
-        prev->next = here;
-        here->id = id;
-        here->buffer = NULL;
-        here->next = NULL;
+        slot = store->high++;
     }
 
-    return(here);
+    /* Initialize new slot, its cells are placed with its first frame */
+    store->table[entry] = slot;
+    store->used[slot] = TRUE;
+    store->keys[slot] = *key;
+    store->frames[slot] = NULL;
+    buffer = &store->buffers[slot];
+    memset(buffer, 0, sizeof(GRID_BUF));
+    buffer->cells = NULL;
+    buffer->bits = NULL;
+    store->count++;
+
+    return(slot);
 }
 
 /**************************************************************************
 *   Function   : FindClient
-*   Description: Searches for a client buffer item with the client ID
-*                matching the value passed as a parameter.  A pointer to
-*                the buffer list item will be returned if found.
-*   Parameters : head - A pointer to the head of the client buffer linked
-*                       list.
-*                id - ID of the client being searched for.
+*   Description: Looks up the slot holding the client with the key passed
+*                as a parameter.
+*   Parameters : store - client store
+*                key - key of the client being searched for.
 *   Effects    : None
-*   Returned   : Pointer to the existing client list item.  NULL will be
-*                returned for a non-existing ID.
+*   Returned   : Slot of the client.  -1 will be returned for a
+*                non-existing key.
 **************************************************************************/
-BUF_LIST *FindClient(BUF_LIST *head, int id)
+int FindClient(CLIENT_STORE *store, const CLIENT_KEY *key)
 {
-    BUF_LIST *here;
-
-    here = head;
-
-    /* Search list for item with matching id */
-    while (here != NULL)
-    {
-        if (here->id == id)
-        {
-            return(here);
-        }
-        else
-        {
-            here = here->next;
-        }
-    }
+    int entry;
 
-    return(NULL);
+    entry = FindEntry(store, key);
+    return((entry < 0) ? -1 : store->table[entry]);
 }
 
 /**************************************************************************
 *   Function   : UpdateClient
-*   Description: Updates the buffered grid for a client.
-*   Parameters : head - Address of pointer to the head of the client
-*                       buffer linked list.
-*                id - ID of the client being searched for.
-*                packed - Packed cells from client
+*   Description: Updates the buffered grid for a client.  A key frame is
+*                unpacked straight into the client's slot, and deltas and
+*                flips are applied to it in place, so the heap is only used
+*                when the store needs more slots or bigger ones.
+*   Parameters : store - client store
+*                key - key of the client being updated.
+*                packed - Packed cells (PKT_KEY), delta (PKT_DELTA),
+*                         flips (PKT_FLIPS), or a fragment of one of them
+*                         (PKT_FRAGMENT) from client.  Nibble packed
+*                         grids (PKT_NIBBLES) are rejected.
+*                size - number of bytes in packed
+*                sum - running sum of all the clients' cells to keep
+*                      current, or NULL.
 *   Effects    : A clients buffered grid is updated, and the updated flag
-*                is set to TRUE.
+*                is set to TRUE.  Fragments are held in the client's
+*                reassembly buffer, and the packet they make up is only
+*                applied once all of them have arrived.  sum gets the
+*                difference between the client's old and new cells.  Only
+*                the changed cells are touched, unless the client's cells
+*                were aged or its grid changed size, in which case all of
+*                its old cells are taken out and its new cells put in.
+*                The weight of every 1 cell changes then, so that costs a
+*                pass over the buffer, but only once for each time a
+*                client comes back after missing a merge.  packed is not
+*                freed.
 *   Returned   : None
 **************************************************************************/
-void UpdateClient(BUF_LIST **head, int id, BYTE* packed)
+void UpdateClient(CLIENT_STORE *store, const CLIENT_KEY *key, BYTE* packed,
+    int size, ACCUMULATOR *sum)
 {
-    BUF_LIST *client;           /* Pointer to client grid buffer list item */
-    GRID_BUF *buffer;           /* Pointer to unpacked buffer */
+    GRID_BUF *buffer;           /* Pointer to client's buffer */
+    ACCUMULATOR *changes;       /* sum, unless it is updated as a whole */
+    int slot, whole, type;
 
-    client = FindClient(*head, id);
-    buffer = UnpackBitsToBuffer(packed);
+    /* Only grid packets update a client */
+    type = ValidateHeader(packed, size);
 
-    if (client != NULL)
+    if (!type || (type > LAST_GRID_TYPE))
     {
-        /*%%% Need to add sequence number rollover logic */
-        if ((buffer != NULL) &&
-            (buffer->sequenceNumber > client->buffer->sequenceNumber))
+        PutFormattedLine(21, 0, "Bad packet header");
+        return;
+    }
+
+    /* Buffers hold a bit per cell, nibbles are only for subscribers */
+    if (type == PKT_NIBBLES)
+    {
+        PutFormattedLine(21, 0, "Nibble packet from client");
+        return;
+    }
+
+    /* Finds the client, or adds it to the store if it is new */
+    slot = AddClient(store, key);
+    if (slot < 0)
+    {
+        return;
+    }
+
+    if (packed[TYPE_POS].byte == PKT_FRAGMENT)
+    {
+        /* Hold fragments until the whole packet is here */
+        size = ReassembleFragment(&store->frames[slot], packed, size);
+
+        if (size < 0)
         {
-            FreeBuffer(client->buffer);
-            client->buffer = buffer;
+            PutFormattedLine(21, 0, "Fragment does not match frame");
         }
-        else
+        else if (size > 0)
         {
-            if (buffer == NULL)
-                PutFormattedLine(21, 0, "Unabel to make buffer");
-            else
+            if (store->frames[slot]->packet[TYPE_POS].byte == PKT_FRAGMENT)
             {
-                PutFormattedLine(21, 0, "Sequence Number too low");
-            FreeBuffer(buffer);
+                PutFormattedLine(21, 0, "Fragment of a fragment");
+                return;
             }
+
+            UpdateClient(store, key, store->frames[slot]->packet, size,
+                sum);
+        }
+        return;
+    }
+
+    buffer = &store->buffers[slot];
+
+    if (buffer->bits != NULL)
+    {
+        /*%%% Need to add sequence number rollover logic */
+        if (GetBigEndian(packed, SN_POS, 4) <= buffer->sequenceNumber)
+        {
+            PutFormattedLine(21, 0, "Sequence Number too low");
+            return;
+        }
+    }
+    else if ((packed[TYPE_POS].byte == PKT_DELTA) ||
+        (packed[TYPE_POS].byte == PKT_FLIPS))
+    {
+        PutFormattedLine(21, 0, "Delta before key frame");
+        return;
+    }
+
+    /* Every cell's weight changes when an aged buffer is updated, and
+     * cells move when the grid changes size, so take the whole buffer
+     * out of the running sum and put it back when the update is done */
+    whole = (sum != NULL) && ((buffer->age != 0) ||
+        (buffer->rows != PACKED_ROWS(packed)) ||
+        (buffer->cols != PACKED_COLS(packed)));
+
+    if (whole)
+    {
+        AccountBuffer(sum, buffer, -1);
+    }
+
+    changes = whole ? NULL : sum;
+
+    if (packed[TYPE_POS].byte == PKT_DELTA)
+    {
+        if (ApplyDeltaToBuffer(packed, size, buffer, changes) < 0)
+        {
+            PutFormattedLine(21, 0, "Delta does not match buffer");
+        }
+    }
+    else if (packed[TYPE_POS].byte == PKT_FLIPS)
+    {
+        if (ApplyFlipsToBuffer(packed, size, buffer, changes) < 0)
+        {
+            PutFormattedLine(21, 0, "Flips do not match buffer");
         }
     }
     else
     {
-        /* New client add to the list */
-        client = AddClient(head, id);
-        client->buffer = buffer;
+        UpdateKeyFrame(store, slot, packed, size, changes);
+    }
+
+    if (whole)
+    {
+        /* A failed update leaves the buffer, and its age, as they were */
+        AccountBuffer(sum, buffer, 1);
     }
 }
 
 /**************************************************************************
-*   Function   : RemoveClient
-*   Description: Removes a client buffer item to the client buffer list.
-*   Parameters : head - A pointer to the head of the client buffer linked
-*                       list.  This value may change if the head passed is
-*                       NULL.
-*                id - ID of the client being added to the client buffer
-*                     list.
-*   Effects    : If there is a client list item for a client with the ID
-*                passed as a parameter, it and its buffer will be freed
-*                and removed from the linked list.
+*   Function   : UpdateKeyFrame
+*   Description: Unpacks a key frame into a client's slot.  The slot only
+*                gets a new extent of the slabs when the grid is bigger
+*                than its old one.  Grids of more than MAX_CLIENT_CELLS
+*                are refused, so no one client can take all the memory.
+*   Parameters : store - client store
+*                slot - client's slot
+*                packed - validated key frame
+*                size - number of bytes in packed
+*                sum - running sum to add the changed cells to, or NULL.
+*                      Only pass a running sum for a buffer with age 0,
+*                      whose grid is the same size as the key frame's.
+*   Effects    : The slot's buffer gets the key frame, and the slabs grow
+*                if needed.  sum gets the difference for each cell that
+*                changed.
 *   Returned   : None
 **************************************************************************/
-void RemoveClient(BUF_LIST **head, int id)
+static void UpdateKeyFrame(CLIENT_STORE *store, int slot, BYTE *packed,
+    int size, ACCUMULATOR *sum)
 {
-    BUF_LIST *here, *prev;
+    GRID_BUF *buffer;
+    int paddedCells, fresh;
+
+    if (PACKED_ROWS(packed) * PACKED_COLS(packed) > MAX_CLIENT_CELLS)
+    {
+        PutFormattedLine(21, 0, "Grid dimensions too large");
+        return;
+    }
 
-    here = *head;
-    prev = NULL;
+    buffer = &store->buffers[slot];
 
-    while (here != NULL)
+    if ((sum != NULL) && (buffer->bits != NULL))
     {
-        if (here->id == id)
+        /* Same grid, so only the cells that differ change the sum */
+        AccumulateFrame(sum, buffer, &packed[CELL_POS]);
+    }
+
+    /* Only this slot moves, and only if its grid has outgrown it */
+    paddedCells = PACKED_ROWS(packed) * PADDED_COLS(PACKED_COLS(packed));
+    fresh = (buffer->bits == NULL);
+
+    if ((fresh || (buffer->size < paddedCells)) &&
+        !PlaceSlot(store, slot, paddedCells))
+    {
+        PutFormattedLine(21, 0, "Unabel to make buffer");
+        return;
+    }
+
+    if (!UnpackBitsIntoBuffer(packed, size, buffer))
+    {
+        PutFormattedLine(21, 0, "Unabel to make buffer");
+
+        if (fresh)
         {
-            /* We found the one to remove.  Adjust the links */
-            if (here == *head)
-            {
-                *head = here->next;
-            }
-            else if (prev == *head)
-            {
-                (*head)->next = here->next;
-            }
-            else
-            {
-                prev->next = here->next;
-            }
+            /* still waiting for a first key frame */
+            buffer->cells = NULL;
+            buffer->bits = NULL;
+        }
+    }
+}
 
-            /* Now free the buffer list item */
-            if (here->buffer != NULL)
-            {
-                FreeBuffer(here->buffer);
-            }
-            free(here);
+/**************************************************************************
+*   Function   : ExpireFragments
+*   Description: Abandons partly reassembled frames that have waited more
+*                than FRAG_TIMEOUT microseconds for their missing
+*                fragments.
+*   Parameters : store - client store
+*   Effects    : Timed out frames are discarded.  Their reassembly
+*                buffers are kept for the client's next frame.
+*   Returned   : Number of frames discarded.
+**************************************************************************/
+int ExpireFragments(CLIENT_STORE *store)
+{
+    REASSEMBLY *frame;
+    struct timeval now;
+    int slot, expired = 0;
 
-            return;
+    gettimeofday(&now, NULL);
+
+    for (slot = 0; slot < store->high; slot++)
+    {
+        frame = store->frames[slot];
+
+        if ((frame != NULL) && (frame->count != 0) &&
+            (ElapsedUsecs(&frame->started, &now) > FRAG_TIMEOUT))
+        {
+            frame->count = 0;
+            expired++;
+        }
+    }
+
+    return(expired);
+}
+
+/**************************************************************************
+*   Function   : RemoveClient
+*   Description: Removes a client from the client store.  Its slot goes on
+*                the free stack, to be reused by the next client to join.
+*                The entries after it in the hash table are shifted back
+*                into the hole, so no deleted markers are left to slow
+*                down later probes.
+*   Parameters : store - client store
+*                key - key of the client being removed from the store.
+*                sum - running sum to take the client's cells out of, or
+*                      NULL.
+*   Effects    : If there is a slot for a client with the key passed as a
+*                parameter, its reassembly buffers are freed, its cells
+*                are taken out of sum, and the slot is freed.
+*   Returned   : None
+**************************************************************************/
+void RemoveClient(CLIENT_STORE *store, const CLIENT_KEY *key,
+    ACCUMULATOR *sum)
+{
+    GRID_BUF *buffer;
+    int slot, hole, entry, home, mask;
+
+    hole = FindEntry(store, key);
+    if (hole < 0)
+    {
+        return;
+    }
+
+    slot = store->table[hole];
+    buffer = &store->buffers[slot];
+
+    if (sum != NULL)
+    {
+        AccountBuffer(sum, buffer, -1);
+    }
+
+    /* Move back each following entry that may not be probed past hole */
+    mask = store->tableSize - 1;
+    entry = hole;
+
+    while (1)
+    {
+        entry = (entry + 1) & mask;
+
+        if (store->table[entry] < 0)
+        {
+            break;
         }
 
-        prev = here;
-        here = here->next;
+        home = HashClientKey(&store->keys[store->table[entry]]) & mask;
+
+        if (((entry - home) & mask) >= ((entry - hole) & mask))
+        {
+            store->table[hole] = store->table[entry];
+            hole = entry;
+        }
     }
+
+    store->table[hole] = -1;
+
+    FreeReassembly(store->frames[slot]);
+    store->frames[slot] = NULL;
+    buffer->cells = NULL;
+    buffer->bits = NULL;
+    store->used[slot] = FALSE;
+    store->freeSlots[store->freeCount++] = slot;
+    store->count--;
 }
 
 /**************************************************************************
 *   Function   : ShowIDs
-*   Description: Writes a copy of the IDs in the client buffer list to
-*                stdout.
-*   Parameters : head - head of client buffer linked list.
+*   Description: Writes the address and port of each client in the client
+*                store to stdout.
+*   Parameters : store - client store
 *   Effects    : The IDs of all the clients being buffered by the proxy
 *                is written to stdout.
 *   Returned   : None
 **************************************************************************/
-void ShowIDs(BUF_LIST *head)
+void ShowIDs(CLIENT_STORE *store)
 {
-    BUF_LIST *here;
-
-    here = head;
+    static const unsigned char mapped[12] =
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+    char text[INET6_ADDRSTRLEN];
+    CLIENT_KEY *key;
+    int slot;
 
-    while (here != NULL)
+    for (slot = 0; slot < store->high; slot++)
     {
-        printf("%d ", here->id);
-        here = here->next;
+        if (store->used[slot])
+        {
+            key = &store->keys[slot];
+
+            if (!memcmp(key->addr, mapped, sizeof(mapped)))
+            {
+                inet_ntop(AF_INET, &key->addr[12], text, sizeof(text));
+            }
+            else
+            {
+                inet_ntop(AF_INET6, key->addr, text, sizeof(text));
+            }
+
+            printf("%s:%u ", text, ntohs(key->port));
+
+            if (key->session != 0)
+            {
+                printf("(%u) ", key->session);
+            }
+        }
     }
     putchar('\n');
 }
 
 /**************************************************************************
 *   Function   : AgeBuffer
-*   Description: Halves all of the buffered grid cell data and updates the
-*                time stamp to the current time.
+*   Description: Ages a buffer that was not updated since the last merge.
+*                Only the age is counted, the cells are left alone, and
+*                merges shift them by the age as they read them.  A
+*                running sum ages the buffer with its age class instead.
+*                Costs the same however big the buffer is.
 *   Parameters : buffer - pointer to buffered cell grid structure
-*                         containing its dimensions and a character array
-*                         of grid cells.
-*   Effects    : All buffered grid cells are halved and the time stamp is
-*                updated to the current time.
+*   Effects    : The buffer's age is counted, saturating at 255.
 *   Returned   : None
 **************************************************************************/
-void AgeBuffer(GRID_BUF *buffer)
+static void AgeBuffer(GRID_BUF *buffer)
 {
-    int cell;
-
-    for(cell = 0; cell < (buffer->rows * buffer->cols); cell++)
+    if (buffer->age < 255)
     {
-        buffer->cells[cell] /= 2.0;
+        buffer->age++;
     }
 }
 
 /**************************************************************************
 *   Function   : MergeBuffers
 *   Description: This function merges the buffered client cell grids into
-*                a single grid.  The size of the merged grid will be sized
-*                so that it has as many rows as the grid with the most
-*                rows and as many columns as the grid with the most
-*                columns.  Since the buffered grids are floating point, and
-*                the regular grids are integer (actually char), after the
-*                buffers are summed, the ceiling of the sum is taken and
-*                then converted to ASCII.  0 - 9 are converted to '0' - '9'
-*                and 10+ are converted to 'A'+.  This works really well for
-*                values between 0 and 15, but it looks strange seeing 'Q'
-*                when the value is 27.  For that reason, I don't recommned
-*                using more than 15 clients.
-*   Parameters : head - head of client buffer linked list.
+*                a single newly malloced grid.  See MergeBuffersInto for
+*                the details of merging.
+*   Parameters : store - client store
 *   Effects    : None
 *   Returned   : GRID* - A pointer to the summed buffered client grids.
 **************************************************************************/
-GRID *MergeBuffers(BUF_LIST *head)
+GRID *MergeBuffers(CLIENT_STORE *store)
 {
-    float *cells;
+    FIXED_SUM *sums;
     GRID *grid;
-    int cell, rows = 0, cols = 0, row, col;
-    BUF_LIST *here;
+    int numCells;
 
-    if (head == NULL)
+    if (store->count == 0)
     {
-        PutFormattedLine(Rows - 2, 0, "Buffer list is empty");
+        PutFormattedLine(Rows - 2, 0, "Client store is empty");
         return(NULL);
     }
 
-    here = head;
-
-    /* first figure out how many cells are in the biggest grid */
-    while (here != NULL)
-    {
-        if (here->buffer != NULL)
-        {
-            if (rows < here->buffer->rows)
-            {
-                rows = here->buffer->rows;
-            }
-
-            if (cols < here->buffer->cols)
-            {
-                cols = here->buffer->cols;
-            }
-        }
-        here = here->next;
-    }
+    numCells = MergedCells(store);
 
-    /* Allocate cells to floating point merge calculation */
-    cells = (float *)malloc((rows * cols) * sizeof(float));
-    if (cells == NULL)
+    /* Allocate cells to fixed point merge calculation */
+    sums = (FIXED_SUM *)CountedAlignedMalloc(numCells * sizeof(FIXED_SUM));
+    if (sums == NULL)
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate cell array");
         return(NULL);
     }
 
-    /* Clear all cells */
-    for (cell = 0; cell < (rows * cols); cell++)
-    {
-        cells[cell] = 0.0;
-    }
-
     /* Allocate grid */
-    grid = (GRID *)malloc(sizeof(GRID));
+    grid = (GRID *)CountedMalloc(sizeof(GRID));
     if (grid == NULL)
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate grid");
-        free(cells);
+        free(sums);
         return(NULL);
     }
 
-    grid->cells = (char *)malloc(sizeof(char) * (rows * cols));
+    grid->cells = (char *)CountedMalloc(sizeof(char) * numCells);
     if (grid->cells == NULL)
     {
         PutFormattedLine(Rows - 2, 0, "Unable to allocate cell array");
-        free(cells);
+        free(sums);
         free(grid);
         return(NULL);
     }
 
+    MergeBuffersInto(store, grid, sums, numCells);
+
+    free(sums);
+    return(grid);
+}
+
+/**************************************************************************
+*   Function   : MergedCells
+*   Description: Computes the number of cells in the grid that merging the
+*                buffered client cell grids will produce, with each row
+*                padded to a multiple of CELL_ALIGN cells.  This is the
+*                size of the arrays passed to MergeBuffersInto.
+*   Parameters : store - client store
+*   Effects    : None
+*   Returned   : Rows of the grid with the most rows times padded columns
+*                of the grid with the most columns.
+**************************************************************************/
+int MergedCells(CLIENT_STORE *store)
+{
+    int rows, cols;
+
+    MergedDims(store, &rows, &cols);
+    return(rows * PADDED_COLS(cols));
+}
+
+/**************************************************************************
+*   Function   : MergeBuffersInto
+*   Description: This function merges the buffered client cell grids into
+*                a single grid provided by the caller.  The size of the
+*                merged grid will be sized so that it has as many rows as
+*                the grid with the most rows and as many columns as the
+*                grid with the most columns.  Since the buffered grids are
+*                fixed point, and the regular grids are integer
+*                (actually char), after the buffers are summed, the sum is
+*                rounded and then converted to ASCII.  0 - 9
+*                are converted to '0' - '9' and 10+ are converted to 'A'+.
+*                This works really well for values between 0 and 15, but
+*                it looks strange seeing 'Q' when the value is 27.  For
+*                that reason, I don't recommned using more than 15 clients.
+*                The sums are made by the engine chosen with
+*                SetMergeEngine.
+*   Parameters : store - client store
+*                grid - grid to hold the merge.  grid->cells must already
+*                       point to an array of cellsSize characters.
+*                sums - CELL_ALIGN aligned scratch array of cellsSize
+*                       FIXED_SUMs, not used by MERGE_BITSLICE.
+*                cellsSize - number of cells in grid->cells and sums.  Use
+*                            MergedCells to find the size needed.
+*   Effects    : Buffers that were not updated since the last merge are
+*                aged.  grid gets the merged dimensions and cells.
+*   Returned   : Number of cells written to grid.  0 indicates an empty
+*                store or arrays that are too small.
+**************************************************************************/
+int MergeBuffersInto(CLIENT_STORE *store, GRID *grid, FIXED_SUM *sums,
+    int cellsSize)
+{
+    int rows, cols, numCells;
+
+    if (store->count == 0)
+    {
+        PutFormattedLine(Rows - 2, 0, "Client store is empty");
+        return(0);
+    }
+
+    /* first figure out how many cells are in the biggest grid */
+    MergedDims(store, &rows, &cols);
+    numCells = rows * cols;
+
+    if (cellsSize < rows * PADDED_COLS(cols))
+    {
+        PutFormattedLine(Rows - 2, 0, "Merge arrays are too small");
+        return(0);
+    }
+
     /* Store grid data */
     grid->rows = rows;
     grid->cols = cols;
 
-    /* Now add buffered cells */
-    here = head;
-    while (here != NULL)
+    if (mergeEngine == MERGE_BITSLICE)
+    {
+        MergeBitSliced(store, grid);
+    }
+    else if (mergeEngine == MERGE_VECTOR)
+    {
+        MergeVector(store, grid, sums);
+    }
+    else
+    {
+        MergeScalar(store, grid, sums);
+    }
+
+    return(numCells);
+}
+
+/**************************************************************************
+*   Function   : MergeBufferSums
+*   Description: Does the summing half of MergeBuffersInto, leaving the
+*                sums unrounded, so that merges of several client stores
+*                can be added together before they are rounded.  The sums
+*                are always made with the vector kernels.
+*   Parameters : store - client store
+*                grid - set to the dimensions of the merge.  grid->cells
+*                       is not used.
+*                sums - CELL_ALIGN aligned array of cellsSize FIXED_SUMs,
+*                       which gets a row of PADDED_COLS(grid->cols) sums for
+*                       each grid row
+*                cellsSize - number of FIXED_SUMs in sums.  Use MergedCells
+*                            to find the size needed.
+*   Effects    : Buffers that were not updated since the last merge are
+*                aged.
+*   Returned   : Number of cells in the merge.  0 indicates an empty store
+*                or a sums array that is too small.
+**************************************************************************/
+int MergeBufferSums(CLIENT_STORE *store, GRID *grid, FIXED_SUM *sums,
+    int cellsSize)
+{
+    int rows, cols;
+
+    MergedDims(store, &rows, &cols);
+
+    if ((rows == 0) || (cellsSize < rows * PADDED_COLS(cols)))
+    {
+        return(0);
+    }
+
+    grid->rows = rows;
+    grid->cols = cols;
+    SumVector(store, grid, sums);
+    return(rows * cols);
+}
+
+/**************************************************************************
+*   Function   : AddMergedSums
+*   Description: Adds the unrounded sums of one merge into a total, which
+*                may have more rows and columns.  Each total is held at
+*                FIXED_SUM_MAX instead of wrapping.
+*   Parameters : total - total with a row of stride FIXED_SUMs for each
+*                        row, at least rows x cols
+*                stride - FIXED_SUMs in each row of total
+*                sums - sums made by MergeBufferSums, with a row of
+*                       PADDED_COLS(cols) FIXED_SUMs for each row
+*                rows - rows of sums
+*                cols - columns of sums
+*   Effects    : sums are added into total.
+*   Returned   : None
+**************************************************************************/
+void AddMergedSums(FIXED_SUM *total, int stride, const FIXED_SUM *sums,
+    int rows, int cols)
+{
+    int row, col;
+    unsigned sum;
+
+    for (row = 0; row < rows; row++)
     {
-        if (here->buffer != NULL)
+        for (col = 0; col < cols; col++)
         {
-            rows = here->buffer->rows;
-            cols = here->buffer->cols;
+            sum = total[(row * stride) + col] +
+                sums[(row * PADDED_COLS(cols)) + col];
+            total[(row * stride) + col] =
+                (sum > FIXED_SUM_MAX) ? FIXED_SUM_MAX : sum;
+        }
+    }
+}
 
-            if (here->buffer->updated == FALSE)
-            {
-                /* Age out of date buffers */
-                AgeBuffer(here->buffer);
-            }
+/**************************************************************************
+*   Function   : AddAccumulatorSums
+*   Description: Adds a running sum into a total, like AddMergedSums.
+*   Parameters : total - total with a row of stride FIXED_SUMs for each
+*                        row, at least as big as sum's grid
+*                stride - FIXED_SUMs in each row of total
+*                sum - running sum published by PublishAccumulator
+*   Effects    : sum is added into total.
+*   Returned   : None
+**************************************************************************/
+void AddAccumulatorSums(FIXED_SUM *total, int stride,
+    const ACCUMULATOR *sum)
+{
+    int row, col;
+    unsigned value;
 
-            for (row = 0; row < rows; row++)
+    for (row = 0; row < sum->grid.rows; row++)
+    {
+        for (col = 0; col < sum->grid.cols; col++)
+        {
+            value = total[(row * stride) + col] +
+                sum->sums[(row * sum->grid.cols) + col];
+            total[(row * stride) + col] =
+                (value > FIXED_SUM_MAX) ? FIXED_SUM_MAX : value;
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : RoundSumsInto
+*   Description: Rounds sums and converts them to ASCII cells, with the
+*                kernel chosen by InitCodec.
+*   Parameters : grid - grid to get the cells, with its dimensions set
+*                sums - a row of PADDED_COLS(grid->cols) FIXED_SUMs for each
+*                       grid row
+*   Effects    : grid gets the rounded cells.
+*   Returned   : None
+**************************************************************************/
+void RoundSumsInto(GRID *grid, const FIXED_SUM *sums)
+{
+    int row;
+
+    for (row = 0; row < grid->rows; row++)
+    {
+        RoundCells(&sums[row * PADDED_COLS(grid->cols)],
+            &grid->cells[row * grid->cols], grid->cols);
+    }
+}
+
+/**************************************************************************
+*   Function   : SetMergeEngine
+*   Description: Chooses how MergeBuffersInto sums the client buffers.
+*                MERGE_SCALAR adds the fixed point cells of each buffer
+*                one at a time, MERGE_BITSLICE adds the bit packed cells
+*                64 at a time (see MergeBitSliced), and MERGE_VECTOR adds
+*                the fixed point cells with the widest vectors the CPU
+*                has (see MergeVector).  All give the same results, sums
+*                saturate at FIXED_SUM_MAX in each.
+*   Parameters : engine - engine to use
+*   Effects    : Later merges use engine.
+*   Returned   : None
+**************************************************************************/
+void SetMergeEngine(MERGE_ENGINE engine)
+{
+    mergeEngine = engine;
+}
+
+/**************************************************************************
+*   Function   : MergeEngineName
+*   Description: Returns the name of the merge engine in use.
+*   Parameters : None
+*   Effects    : None
+*   Returned   : "scalar", "bitslice", or "vector" followed by the
+*                instruction set used.
+**************************************************************************/
+const char *MergeEngineName(void)
+{
+    if (mergeEngine == MERGE_VECTOR)
+    {
+        return(vectorName);
+    }
+
+    return((mergeEngine == MERGE_BITSLICE) ? "bitslice" : "scalar");
+}
+
+/**************************************************************************
+*   Function   : InitAccumulator
+*   Description: Starts an empty running sum of client cells.  A running
+*                sum is kept current by passing it to UpdateClient and
+*                RemoveClient, so a merge only costs as much as the cells
+*                that changed, instead of every cell of every client.
+*   Parameters : sum - running sum to initialize
+*   Effects    : sum has no arrays, and is rebuilt when first published.
+*   Returned   : None
+**************************************************************************/
+void InitAccumulator(ACCUMULATOR *sum)
+{
+    sum->grid.rows = 0;
+    sum->grid.cols = 0;
+    sum->grid.cells = NULL;
+    sum->sums = NULL;
+    sum->counts = NULL;
+    sum->epoch = 0;
+    sum->size = 0;
+    sum->stale = TRUE;
+}
+
+/**************************************************************************
+*   Function   : PublishAccumulator
+*   Description: Finishes a merge kept in a running sum.  Buffers that were
+*                not updated since the last merge are aged.  Buffers that
+*                were already aged are aged a class at a time, see
+*                AgeClasses, so they cost nothing each.  A buffer that
+*                just missed its first merge has the half of its weight
+*                it loses taken out of the sum, and joins the newest age
+*                class.  That is a pass over the buffer, but only once
+*                each time it stops being updated.  The sum is only
+*                rebuilt from every buffer when the merged grid changes
+*                size, or a buffer did not fit it.  The result is the
+*                same as MergeBuffersInto's.
+*   Parameters : store - client store.  Every buffer update and removal
+*                        since the sum was started must have been passed
+*                        the sum.
+*                sum - running sum started by InitAccumulator
+*   Effects    : Out of date buffers are aged, and the updated flags are
+*                cleared.
+*   Returned   : The merged grid, which belongs to sum and stays current
+*                until the next client update.  NULL if there are no
+*                buffers or the sum can not be allocated.
+**************************************************************************/
+GRID *PublishAccumulator(CLIENT_STORE *store, ACCUMULATOR *sum)
+{
+    int rows, cols, slot;
+    GRID_BUF *buffer;
+
+    rows = 0;
+    cols = 0;
+
+    AgeClasses(sum);
+
+    for (slot = 0; slot < store->high; slot++)
+    {
+        buffer = &store->buffers[slot];
+
+        if (buffer->bits == NULL)
+        {
+            continue;
+        }
+
+        if (!buffer->updated)
+        {
+            /* Buffers already in an age class were aged with it */
+            AgeBuffer(buffer);
+
+            if ((buffer->age == 1) && !sum->stale)
             {
-                for (col = 0; col < cols; col++)
-                {
-                    cells[(row * grid->cols) + col] +=
-                        here->buffer->cells[(row * cols) + col];
-                }
+                sum->members[sum->epoch]++;
+                AccumulateBuffer(sum, buffer,
+                    CellWeight(1) - CellWeight(0),
+                    &sum->counts[sum->epoch * sum->size], 1);
             }
         }
 
-        here->buffer->updated = FALSE;
-        here = here->next;
+        buffer->updated = FALSE;
+
+        if (buffer->rows > rows)
+        {
+            rows = buffer->rows;
+        }
+
+        if (buffer->cols > cols)
+        {
+            cols = buffer->cols;
+        }
     }
 
-    /* Copy cells to grid as ASCII */
-    for (cell = 0; cell < (grid->rows * grid->cols); cell++)
+    if ((rows == 0) || (cols == 0))
     {
-        grid->cells[cell] = NibbleToAscii(RoundFloat(cells[cell]));
+        return(NULL);
     }
 
-    free(cells);
-    return(grid);
+    if (sum->stale || (rows != sum->grid.rows) || (cols != sum->grid.cols))
+    {
+        if (!RebuildAccumulator(store, sum, rows, cols))
+        {
+            return(NULL);
+        }
+    }
+
+    return(&sum->grid);
+}
+
+/**************************************************************************
+*   Function   : FreeAccumulator
+*   Description: Frees the arrays of a running sum.
+*   Parameters : sum - running sum started by InitAccumulator
+*   Effects    : sum's arrays are freed, and sum is empty again.
+*   Returned   : None
+**************************************************************************/
+void FreeAccumulator(ACCUMULATOR *sum)
+{
+    free(sum->sums);
+    free(sum->counts);
+    free(sum->grid.cells);
+    InitAccumulator(sum);
+}
+
+/**************************************************************************
+*   Function   : CountedMalloc
+*   Description: This function is a malloc that keeps count of how many
+*                times it has been called, so that heap use on the send,
+*                receive, and merge paths can be watched.  Memory returned
+*                by this function is released with free.
+*   Parameters : size - number of bytes to allocate
+*   Effects    : The malloc count is incremented.
+*   Returned   : Pointer to the allocated memory, NULL on failure.
+**************************************************************************/
+void *CountedMalloc(size_t size)
+{
+    __sync_fetch_and_add(&mallocCount, 1);
+    return(malloc(size));
+}
+
+/**************************************************************************
+*   Function   : CountedAlignedMalloc
+*   Description: This function is CountedMalloc for arrays that vector
+*                kernels load and store a whole aligned vector at a time.
+*                Memory returned by this function is released with free.
+*   Parameters : size - number of bytes to allocate
+*   Effects    : The malloc count is incremented.
+*   Returned   : Pointer to CELL_ALIGN aligned memory, NULL on failure.
+**************************************************************************/
+void *CountedAlignedMalloc(size_t size)
+{
+    void *memory;
+
+    __sync_fetch_and_add(&mallocCount, 1);
+
+    if (posix_memalign(&memory, CELL_ALIGN, (size > 0) ? size : 1) != 0)
+    {
+        return(NULL);
+    }
+
+    return(memory);
+}
+
+/**************************************************************************
+*   Function   : FrameMallocs
+*   Description: This function returns the number of CountedMalloc calls
+*                made since the last time it was called.  Calling it once a
+*                frame gives the mallocs per frame, which should be zero in
+*                the steady state.
+*   Parameters : None
+*   Effects    : The per frame count is restarted.
+*   Returned   : Number of mallocs since the last call.
+**************************************************************************/
+unsigned long FrameMallocs(void)
+{
+    unsigned long count;
+
+    count = mallocCount - frameMallocs;
+    frameMallocs = mallocCount;
+    return(count);
 }
 
 /**************************************************************************
@@ -1317,13 +3195,20 @@ void InitScreen()
 /**************************************************************************
 *   Function   : CloseScreen
 *   Description: This is the function tears down the curses screen, and
-*                makes stdio, the normal screen.
+*                makes stdio, the normal screen.  Headless, there is no
+*                screen, and the last queued lines are written instead.
 *   Parameters : None
 *   Effects    : Curses screen is closed. stdio works normally.
 *   Returned   : None
 **************************************************************************/
 void CloseScreen(void)
 {
+    if (statusFile != NULL)
+    {
+        DrainStatus();
+        return;
+    }
+
     curs_set(1);
     endwin();
 }
@@ -1331,29 +3216,273 @@ void CloseScreen(void)
 /**************************************************************************
 *   Function   : PutFormattedLine
 *   Description: This function will display a formatted sting starting at
-*                (row, col) on the default screen.  The final string must
-*                not be more than 128 characters.  This function does not
-*                do any boundery checking.
+*                (row, col) on the default screen.  Longer strings are cut
+*                to 128 characters, and lines off the screen are not
+*                drawn.  Once StartStatusLog is called, the line is only
+*                queued, without a lock or a system call, and drawn by the
+*                next DrainStatus.
 *   Parameters : row - starting row for the line
 *                col - starting column for the line
 *                *fmt - the formatted string to be displayed.
-*   Effects    : Formatted string is displayed at row, col
+*   Effects    : Formatted string is displayed at row, col, or queued
 *   Returned   : None
 **************************************************************************/
 void PutFormattedLine(int row, int col, char *fmt, ... )
 {
     va_list argptr;                     /* Argument list pointer */
-    char str[129];                      /* Pointer to LCD IORB */
 
-    /* Resolve string formatting and store it in str */
     va_start(argptr, fmt);
-    vsprintf(str, fmt, argptr);
+
+    if (statusLogging)
+    {
+        LogStatus(row, col, fmt, argptr);
+    }
+    else
+    {
+        /* Display string, proxy receive workers share the screen */
+        pthread_mutex_lock(&screenLock);
+        DrawFormattedLine(row, col, fmt, argptr);
+        refresh();
+        pthread_mutex_unlock(&screenLock);
+    }
+
+    va_end(argptr);
+}
+
+/**************************************************************************
+*   Function   : StartStatusLog
+*   Description: Makes PutFormattedLine queue its lines in a ring instead
+*                of drawing them, so threads on a hot path do not wait on
+*                the screen lock or the terminal.  Any number of threads
+*                may queue lines, and the thread that calls DrainStatus,
+*                normally once a frame, draws them.  When the ring is full
+*                lines are dropped and counted.  Called before any other
+*                thread uses the screen.
+*   Parameters : file - file to write lines to instead of the screen, for
+*                       running without curses, or NULL to draw them
+*   Effects    : Lines are queued until drained.
+*   Returned   : None
+**************************************************************************/
+void StartStatusLog(FILE *file)
+{
+    unsigned i;
+
+    for (i = 0; i < STATUS_RECORDS; i++)
+    {
+        statusRing[i].sequence = i;
+    }
+
+    statusHead = 0;
+    statusTail = 0;
+    statusDropped = 0;
+    statusShown = 0;
+    statusFile = file;
+    statusLogging = TRUE;
+}
+
+/**************************************************************************
+*   Function   : LogStatus
+*   Description: Claims the next free record of the status ring and
+*                formats a line into it.  Each record's sequence number
+*                says whether it is free for this turn of the ring, so
+*                writers only contend on statusHead, and the line is
+*                published by storing its sequence number last.
+*   Parameters : row - starting row for the line
+*                col - starting column for the line
+*                *fmt - the formatted string to be displayed.
+*                argptr - arguments for fmt
+*   Effects    : The line is queued, or counted in statusDropped if the
+*                ring is full.
+*   Returned   : None
+**************************************************************************/
+static void LogStatus(int row, int col, char *fmt, va_list argptr)
+{
+    STATUS_RECORD *record;
+    unsigned pos, sequence;
+
+    pos = __atomic_load_n(&statusHead, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        record = &statusRing[pos % STATUS_RECORDS];
+        sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+
+        if ((int)(sequence - pos) < 0)
+        {
+            /* Not drained since the last turn */
+            __atomic_fetch_add(&statusDropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else if (sequence != pos)
+        {
+            /* Another writer took it */
+            pos = __atomic_load_n(&statusHead, __ATOMIC_RELAXED);
+        }
+        else if (__atomic_compare_exchange_n(&statusHead, &pos, pos + 1,
+            FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    record->row = row;
+    record->col = col;
+    vsnprintf(record->text, sizeof(record->text), fmt, argptr);
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**************************************************************************
+*   Function   : DrainStatus
+*   Description: Draws every line queued since the last call, in order,
+*                and the number of lines dropped if it has grown, then
+*                refreshes the screen once.  Headless, the lines are
+*                written to the log file instead, and it is flushed once.
+*   Parameters : None
+*   Effects    : The status ring is empty, up to any line still being
+*                formatted.
+*   Returned   : None
+**************************************************************************/
+void DrainStatus(void)
+{
+    STATUS_RECORD *record;
+    unsigned long dropped;
+    char *end;
+
+    if (!statusLogging)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&screenLock);
+
+    for (;;)
+    {
+        record = &statusRing[statusTail % STATUS_RECORDS];
+
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) !=
+            statusTail + 1)
+        {
+            break;
+        }
+
+        if (statusFile != NULL)
+        {
+            end = strchr(record->text, '\n');
+
+            if (end != NULL)
+            {
+                *end = '\0';
+            }
+
+            fprintf(statusFile, "%s\n", record->text);
+        }
+        else
+        {
+            DrawLine(record->row, record->col, record->text);
+        }
+
+        __atomic_store_n(&record->sequence, statusTail + STATUS_RECORDS,
+            __ATOMIC_RELEASE);
+        statusTail++;
+    }
+
+    dropped = __atomic_load_n(&statusDropped, __ATOMIC_RELAXED);
+
+    if ((dropped != statusShown) && (statusFile != NULL))
+    {
+        fprintf(statusFile, "%lu status lines dropped\n", dropped);
+    }
+    else if (dropped != statusShown)
+    {
+        mvprintw(Rows - 1, 0, "%lu status lines dropped", dropped);
+        clrtoeol();
+    }
+
+    statusShown = dropped;
+
+    if (statusFile != NULL)
+    {
+        fflush(statusFile);
+    }
+    else
+    {
+        refresh();
+    }
+
+    pthread_mutex_unlock(&screenLock);
+}
+
+
+/**************************************************************************
+*   Function   : ShowLine
+*   Description: Displays a formatted string like PutFormattedLine, but
+*                leaves the refresh to the caller, so a whole frame can be
+*                drawn and refreshed once.  The caller holds screenLock.
+*   Parameters : row - starting row for the line
+*                col - starting column for the line
+*                *fmt - the formatted string to be displayed.
+*   Effects    : Formatted string is on stdscr at row, col
+*   Returned   : None
+**************************************************************************/
+static void ShowLine(int row, int col, char *fmt, ... )
+{
+    va_list argptr;                     /* Argument list pointer */
+
+    va_start(argptr, fmt);
+    DrawFormattedLine(row, col, fmt, argptr);
     va_end(argptr);
+}
+
+/**************************************************************************
+*   Function   : DrawFormattedLine
+*   Description: Formats a string of at most 128 characters and draws it
+*                with DrawLine.  The caller holds screenLock, and
+*                refreshes.
+*   Parameters : row - starting row for the line
+*                col - starting column for the line
+*                *fmt - the formatted string to be displayed.
+*                argptr - arguments for fmt
+*   Effects    : Formatted string is on stdscr at row, col
+*   Returned   : None
+**************************************************************************/
+static void DrawFormattedLine(int row, int col, char *fmt, va_list argptr)
+{
+    char str[129];                      /* Pointer to LCD IORB */
 
-    /* Display string */
-    mvaddstr(row, col, str);
-    clrtoeol();
-    refresh();
+    /* Resolve string formatting and store it in str */
+    vsnprintf(str, sizeof(str), fmt, argptr);
+    DrawLine(row, col, str);
+}
+
+
+/**************************************************************************
+*   Function   : DrawLine
+*   Description: Draws a string at (row, col), clearing the rest of the
+*                line.  Nothing is drawn if (row, col) is off the screen.
+*                A line drawn over a row of the grid makes DrawGrid draw
+*                that row again next time.  The caller holds screenLock,
+*                and refreshes.
+*   Parameters : row - starting row for the line
+*                col - starting column for the line
+*                str - string to draw
+*   Effects    : String is on stdscr at row, col, and a grid row under it
+*                is cleared from drawnCells.
+*   Returned   : None
+**************************************************************************/
+static void DrawLine(int row, int col, char *str)
+{
+    /* Off the screen, clrtoeol would clear wherever the cursor was */
+    if (move(row, col) != ERR)
+    {
+        addstr(str);
+        clrtoeol();
+
+        /* No cell is ever 0, so every cell of the row differs */
+        if ((row >= 2) && (row - 2 < drawnRows))
+        {
+            memset(&drawnCells[(row - 2) * drawnCols], 0, drawnCols);
+        }
+    }
 }
 
 /**************************************************************************
@@ -1362,7 +3491,7 @@ void PutFormattedLine(int row, int col, char *fmt, ... )
 *                generated by gcc's rand() functions alternate between odd
 *                and even, causing an altering '1' and '0' pattern in the
 *                grid.  By taking the rand() value and making it a float
-*                between (0, 2], a more random looking pattern is obtained.
+*                between [0, 2), a more random looking pattern is obtained.
 *   Parameters : None
 *   Effects    : None
 *   Returned   : Pseudo-random value of '0' or '1'.
@@ -1374,30 +3503,1914 @@ char RandomCell(void)
     char cell;
 
     randomVal &= 077777;                        /* Look at LS portion */
-    frac =((float)randomVal / 32767.0);         /* Scale between 0 and 1 */
+    frac =((float)randomVal / 32768.0);         /* Scale between 0 and 1 */
     cell = (char)(2.0 * frac) + '0';            /* Convert to cell */
     return cell;
 }
 
 /**************************************************************************
-*   Function   : RoundFloat
-*   Description: This function converts a floating point value to an
-*                unsigned value.  Rounding is to the nearest unsigned
-*                value.  I choes to use the routine, because ceil did not
-*                link on Solaris 2.6 using gcc.
-*   Parameters : value - floating point value.
+*   Function   : RoundFixed
+*   Description: This function converts a fixed point value to an unsigned
+*                value.  Rounding is to the nearest unsigned value, by
+*                adding one half and dropping the fraction bits.
+*   Parameters : value - fixed point value with FIXED_SHIFT fraction bits.
 *   Effects    : None
-*   Returned   : Rounded unsigned value.  Negitive values return 0.
+*   Returned   : Rounded unsigned value.
+**************************************************************************/
+unsigned RoundFixed(FIXED_SUM value)
+{
+    return(((unsigned)value + FIXED_HALF) >> FIXED_SHIFT);
+}
+
+/**************************************************************************
+*   Function   : StoreHeader
+*   Description: Stores the wire version, packet type, time stamp,
+*                sequence number, dimensions of a grid, and payload length
+*                at the start of a packet.
+*   Parameters : packed - packet to store header in
+*                type - packet type (PKT_KEY, PKT_DELTA, ...)
+*                grid - grid the packet is made from
+*                length - number of payload bytes following the header.
+*                         Packers that don't know it yet store it later.
+*   Effects    : packed[VERSION_POS .. CELL_POS - 1] are written.
+*   Returned   : None
+**************************************************************************/
+static void StoreHeader(BYTE *packed, int type, GRID *grid, int length)
+{
+    packed[VERSION_POS].byte = WIRE_VERSION;
+    packed[TYPE_POS].byte = type;
+
+    PutBigEndian(packed, TS_POS, 8,
+        ((unsigned long long)grid->timeStamp.tv_sec * 1000000000ULL) +
+        ((unsigned long long)grid->timeStamp.tv_usec * 1000ULL));
+    PutBigEndian(packed, SN_POS, 4, grid->sequenceNumber);
+    PutBigEndian(packed, ROW_POS, 2, grid->rows);
+    PutBigEndian(packed, COL_POS, 2, grid->cols);
+    PutBigEndian(packed, LEN_POS, 4, length);
+}
+
+/**************************************************************************
+*   Function   : LoadHeader
+*   Description: Reads the time stamp and sequence number stored by
+*                StoreHeader.  Use PACKED_ROWS and PACKED_COLS to read
+*                the dimensions.
+*   Parameters : packed - packet to read header from
+*                timeStamp - where to put the time stamp
+*                sequenceNumber - where to put the sequence number
+*   Effects    : *timeStamp and *sequenceNumber are written.
+*   Returned   : None
+**************************************************************************/
+static void LoadHeader(BYTE *packed, struct timeval *timeStamp,
+    unsigned *sequenceNumber)
+{
+    unsigned long long nsecs;
+
+    nsecs = GetBigEndian(packed, TS_POS, 8);
+    timeStamp->tv_sec = nsecs / 1000000000ULL;
+    timeStamp->tv_usec = (nsecs % 1000000000ULL) / 1000;
+
+    *sequenceNumber = GetBigEndian(packed, SN_POS, 4);
+}
+
+/**************************************************************************
+*   Function   : ReassembleFragment
+*   Description: Copies a fragment made by PackFragmentBuf into a client's
+*                reassembly buffer.  A fragment from a newer frame
+*                abandons the frame being collected, as does a frame that
+*                has waited more than FRAG_TIMEOUT microseconds.  A late
+*                fragment of an older frame is dropped, so reordering
+*                does not cost the newer frame.  Frame ids are compared
+*                as serial numbers, so they may wrap around.  The
+*                reassembly buffers only grow, so frames no bigger than
+*                the last ones don't use the heap.
+*   Parameters : frame - address of pointer to the client's reassembly
+*                        buffer.  It is allocated if it is NULL.
+*                fragment - fragment from client
+*                size - number of bytes in fragment
+*   Effects    : The fragment's piece is copied into (*frame)->packet.
+*   Returned   : Number of bytes in the reassembled packet if this was
+*                its last missing fragment, 0 if fragments are still
+*                missing, -1 if the fragment is malformed or does not
+*                match its frame.
 **************************************************************************/
-unsigned RoundFloat(float value)
+static int ReassembleFragment(REASSEMBLY **frame, BYTE *fragment, int size)
 {
-    if (value < 0.0)
+    REASSEMBLY *here;
+    struct timeval now;
+    unsigned frameID;
+    int index, count, length, chunk, offset, piece;
+
+    if (size <= (int)(FRAG_DATA_POS * sizeof(BYTE)))
+    {
+        return(-1);
+    }
+
+    frameID = GetBigEndian(fragment, FRAG_ID_POS, 4);
+    index = GetBigEndian(fragment, FRAG_INDEX_POS, 2);
+    count = GetBigEndian(fragment, FRAG_COUNT_POS, 2);
+
+    /* Nothing bigger than the largest grid a client may send is
+     * reassembled */
+    if (GetBigEndian(fragment, FRAG_LEN_POS, 4) >
+        (unsigned long long)PackedBitsSize(1, MAX_CLIENT_CELLS))
+    {
+        return(-1);
+    }
+
+    length = GetBigEndian(fragment, FRAG_LEN_POS, 4);
+
+    if ((count < 1) || (index >= count) || (length <= 0))
+    {
+        return(-1);
+    }
+
+    chunk = (length + count - 1) / count;
+    offset = index * chunk;
+    piece = ((length - offset) < chunk) ? (length - offset) : chunk;
+
+    if ((piece <= 0) ||
+        (size - (int)(FRAG_DATA_POS * sizeof(BYTE)) != piece))
+    {
+        return(-1);
+    }
+
+    if (*frame == NULL)
+    {
+        *frame = (REASSEMBLY *)CountedMalloc(sizeof(REASSEMBLY));
+        if (*frame == NULL)
+        {
+            return(-1);
+        }
+
+        memset(*frame, 0, sizeof(REASSEMBLY));
+    }
+
+    here = *frame;
+    gettimeofday(&now, NULL);
+
+    if ((here->count != 0) &&
+        (ElapsedUsecs(&here->started, &now) > FRAG_TIMEOUT))
+    {
+        here->count = 0;        /* waited too long, abandon frame */
+    }
+
+    if ((here->count != 0) && ((int)(frameID - here->frameID) < 0))
+    {
+        return(-1);             /* fragment of an older frame */
+    }
+
+    if ((here->count == 0) || (here->frameID != frameID))
+    {
+        /* Start a new frame, growing the buffers if needed */
+        if (here->size < length)
+        {
+            if (here->packet != NULL)
+            {
+                free(here->packet);
+            }
+
+            here->packet = (BYTE *)CountedMalloc(length);
+            here->size = (here->packet == NULL) ? 0 : length;
+        }
+
+        if (here->haveSize < count)
+        {
+            if (here->have != NULL)
+            {
+                free(here->have);
+            }
+
+            here->have = (unsigned char *)CountedMalloc(count);
+            here->haveSize = (here->have == NULL) ? 0 : count;
+        }
+
+        if ((here->size < length) || (here->haveSize < count))
+        {
+            here->count = 0;
+            return(-1);
+        }
+
+        here->frameID = frameID;
+        here->count = count;
+        here->length = length;
+        here->received = 0;
+        here->started = now;
+        memset(here->have, FALSE, count);
+    }
+    else if ((here->count != count) || (here->length != length))
+    {
+        return(-1);
+    }
+
+    if (!here->have[index])
+    {
+        memcpy((char *)here->packet + offset, &fragment[FRAG_DATA_POS],
+            piece);
+        here->have[index] = TRUE;
+        here->received++;
+    }
+
+    if (here->received < here->count)
     {
         return(0);
     }
-    else
+
+    here->count = 0;            /* frame complete, ready for the next */
+    return(length);
+}
+
+/**************************************************************************
+*   Function   : FreeReassembly
+*   Description: Frees a client's reassembly buffers.
+*   Parameters : frame - reassembly buffer to free, may be NULL
+*   Effects    : frame and the arrays it points to are returned to the
+*                heap.
+*   Returned   : None
+**************************************************************************/
+static void FreeReassembly(REASSEMBLY *frame)
+{
+    if (frame != NULL)
+    {
+        if (frame->packet != NULL)
+        {
+            free(frame->packet);
+        }
+
+        if (frame->have != NULL)
+        {
+            free(frame->have);
+        }
+        free(frame);
+    }
+}
+
+/**************************************************************************
+*   Function   : GrowSlots
+*   Description: Doubles the number of slots in a client store.  The slot
+*                arrays are copied to new ones, so slots stay contiguous.
+*                The slabs are not touched, each slot keeps its extent.
+*   Parameters : store - client store
+*   Effects    : The store's arrays are replaced by bigger ones.  Pointers
+*                into the old arrays are no longer valid.
+*   Returned   : TRUE on success, FALSE if the arrays could not be
+*                allocated, in which case the store is unchanged.
+**************************************************************************/
+static int GrowSlots(CLIENT_STORE *store)
+{
+    unsigned char *used;
+    CLIENT_KEY *keys;
+    GRID_BUF *buffers;
+    REASSEMBLY **frames;
+    int *freeSlots;
+    int capacity;
+
+    capacity = (store->capacity > 0) ? store->capacity * 2 : 8;
+
+    used = (unsigned char *)CountedMalloc(capacity);
+    keys = (CLIENT_KEY *)CountedMalloc(capacity * sizeof(CLIENT_KEY));
+    buffers = (GRID_BUF *)CountedMalloc(capacity * sizeof(GRID_BUF));
+    frames = (REASSEMBLY **)CountedMalloc(capacity * sizeof(REASSEMBLY *));
+    freeSlots = (int *)CountedMalloc(capacity * sizeof(int));
+
+    if ((used == NULL) || (keys == NULL) || (buffers == NULL) ||
+        (frames == NULL) || (freeSlots == NULL))
+    {
+        free(used);
+        free(keys);
+        free(buffers);
+        free(frames);
+        free(freeSlots);
+        return(FALSE);
+    }
+
+    if (store->capacity > 0)
+    {
+        memcpy(used, store->used, store->capacity);
+        memcpy(keys, store->keys, store->capacity * sizeof(CLIENT_KEY));
+        memcpy(buffers, store->buffers, store->capacity * sizeof(GRID_BUF));
+        memcpy(frames, store->frames,
+            store->capacity * sizeof(REASSEMBLY *));
+        memcpy(freeSlots, store->freeSlots, store->freeCount * sizeof(int));
+    }
+
+    free(store->used);
+    free(store->keys);
+    free(store->buffers);
+    free(store->frames);
+    free(store->freeSlots);
+
+    store->used = used;
+    store->keys = keys;
+    store->buffers = buffers;
+    store->frames = frames;
+    store->freeSlots = freeSlots;
+    store->capacity = capacity;
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : PlaceSlot
+*   Description: Gives a slot a new extent of the slabs, for cells FIXED
+*                cells and a bit for each.  Extents are handed out from
+*                the end of the slabs, and the slabs are packed into
+*                bigger ones when there is no room left.
+*   Parameters : store - client store
+*                slot - slot to place, its old extent, if any, is dropped
+*                cells - FIXED cells, a multiple of CELL_ALIGN
+*   Effects    : The slot's buffer points at its new extent, and its size
+*                is cells.  Other buffers may point into new slabs.
+*   Returned   : TRUE on success, FALSE if the slabs could not be grown,
+*                in which case the store is unchanged.
+**************************************************************************/
+static int PlaceSlot(CLIENT_STORE *store, int slot, int cells)
+{
+    GRID_BUF *buffer;
+    size_t bytes;
+
+    bytes = (cells + 7) / 8;
+
+    if (((store->cellsUsed + cells) > store->cellsSize) ||
+        ((store->bitsUsed + bytes) > store->bitsSize))
     {
-        return((unsigned)(value + 0.5));
+        if (!PackSlabs(store, slot, cells))
+        {
+            return(FALSE);
+        }
     }
+
+    buffer = &store->buffers[slot];
+    buffer->cells = &store->cells[store->cellsUsed];
+    buffer->bits = &store->bits[store->bitsUsed];
+    buffer->size = cells;
+    store->cellsUsed += cells;
+    store->bitsUsed += bytes;
+
+    return(TRUE);
 }
 
+/**************************************************************************
+*   Function   : PackSlabs
+*   Description: Copies the extent of every slot holding a frame to the
+*                front of new slabs, leaving out slot, which is about to
+*                be placed again.  Extents of clients that left or moved
+*                are dropped.  The new slabs have room for twice the
+*                extents kept and cells more, so packing is done a
+*                logarithmic number of times as the store grows.
+*   Parameters : store - client store
+*                slot - slot whose extent is not kept
+*                cells - FIXED cells slot is about to be given
+*   Effects    : The store's slabs are replaced, and each buffer kept
+*                points into the new ones.
+*   Returned   : TRUE on success, FALSE if the slabs could not be
+*                allocated, in which case the store is unchanged.
+**************************************************************************/
+static int PackSlabs(CLIENT_STORE *store, int slot, int cells)
+{
+    GRID_BUF *buffer;
+    FIXED *newCells;
+    BYTE *newBits;
+    size_t cellsSize, bitsSize, cellsUsed, bitsUsed, bytes;
+    int i;
+
+    cellsSize = cells;
+    bitsSize = (cells + 7) / 8;
+
+    for (i = 0; i < store->high; i++)
+    {
+        if (store->used[i] && (i != slot) &&
+            (store->buffers[i].bits != NULL))
+        {
+            cellsSize += store->buffers[i].size;
+            bitsSize += (store->buffers[i].size + 7) / 8;
+        }
+    }
+
+    cellsSize *= 2;
+    bitsSize *= 2;
+    newCells = (FIXED *)CountedAlignedMalloc(cellsSize * sizeof(FIXED));
+    newBits = (BYTE *)CountedMalloc(bitsSize * sizeof(BYTE));
+
+    if ((newCells == NULL) || (newBits == NULL))
+    {
+        PutFormattedLine(Rows - 2, 0, "Unable to allocate client slab");
+        free(newCells);
+        free(newBits);
+        return(FALSE);
+    }
+
+    cellsUsed = 0;
+    bitsUsed = 0;
+
+    for (i = 0; i < store->high; i++)
+    {
+        buffer = &store->buffers[i];
+
+        if (!store->used[i] || (i == slot) || (buffer->bits == NULL))
+        {
+            continue;
+        }
+
+        bytes = (buffer->size + 7) / 8;
+        memcpy(&newCells[cellsUsed], buffer->cells,
+            buffer->size * sizeof(FIXED));
+        memcpy(&newBits[bitsUsed], buffer->bits, bytes * sizeof(BYTE));
+        buffer->cells = &newCells[cellsUsed];
+        buffer->bits = &newBits[bitsUsed];
+        cellsUsed += buffer->size;
+        bitsUsed += bytes;
+    }
+
+    free(store->cells);
+    free(store->bits);
+    store->cells = newCells;
+    store->bits = newBits;
+    store->cellsSize = cellsSize;
+    store->bitsSize = bitsSize;
+    store->cellsUsed = cellsUsed;
+    store->bitsUsed = bitsUsed;
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : HashClientKey
+*   Description: Hashes a client key a 64 bit word at a time, multiplying
+*                by a large odd constant and folding the high bits down
+*                after each word.
+*   Parameters : key - key made by MakeClientKey
+*   Effects    : None
+*   Returned   : Hash of the key.  Use the low bits for the table entry.
+**************************************************************************/
+static unsigned int HashClientKey(const CLIENT_KEY *key)
+{
+    unsigned long long words[(sizeof(CLIENT_KEY) + 7) / 8];
+    unsigned long long hash;
+    int i;
+
+    words[(sizeof(CLIENT_KEY) - 1) / 8] = 0;
+    memcpy(words, key, sizeof(CLIENT_KEY));
+    hash = 0;
+
+    for (i = 0; i < (int)(sizeof(words) / sizeof(words[0])); i++)
+    {
+        hash = (hash ^ words[i]) * KEY_HASH_MULT;
+        hash ^= hash >> 32;
+    }
+
+    return((unsigned int)hash);
+}
+
+/**************************************************************************
+*   Function   : FindEntry
+*   Description: Probes the client hash table for a key, starting at the
+*                key's hash and stepping forward until the key or an empty
+*                entry is found.
+*   Parameters : store - client store
+*                key - key of the client being searched for.
+*   Effects    : None
+*   Returned   : Hash table entry holding the client's slot.  -1 will be
+*                returned for a non-existing key.
+**************************************************************************/
+static int FindEntry(CLIENT_STORE *store, const CLIENT_KEY *key)
+{
+    int entry, mask;
+
+    if (store->count == 0)
+    {
+        return(-1);
+    }
+
+    mask = store->tableSize - 1;
+    entry = HashClientKey(key) & mask;
+
+    while (store->table[entry] >= 0)
+    {
+        if (!memcmp(&store->keys[store->table[entry]], key,
+            sizeof(CLIENT_KEY)))
+        {
+            return(entry);
+        }
+
+        entry = (entry + 1) & mask;
+    }
+
+    return(-1);
+}
+
+/**************************************************************************
+*   Function   : GrowTable
+*   Description: Doubles the size of the client hash table, and puts every
+*                client back into the bigger table.
+*   Parameters : store - client store
+*   Effects    : The store's hash table is replaced by a bigger one.
+*   Returned   : TRUE on success, FALSE if the table could not be
+*                allocated, in which case the store is unchanged.
+**************************************************************************/
+static int GrowTable(CLIENT_STORE *store)
+{
+    int *table;
+    int size, mask, slot, entry;
+
+    size = (store->tableSize > 0) ? store->tableSize * 2 : MIN_TABLE_SIZE;
+    table = (int *)CountedMalloc(size * sizeof(int));
+
+    if (table == NULL)
+    {
+        return(FALSE);
+    }
+
+    memset(table, 0xFF, size * sizeof(int));     /* every entry -1 */
+    mask = size - 1;
+
+    for (slot = 0; slot < store->high; slot++)
+    {
+        if (store->used[slot])
+        {
+            entry = HashClientKey(&store->keys[slot]) & mask;
+
+            while (table[entry] >= 0)
+            {
+                entry = (entry + 1) & mask;
+            }
+
+            table[entry] = slot;
+        }
+    }
+
+    free(store->table);
+    store->table = table;
+    store->tableSize = size;
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : ElapsedUsecs
+*   Description: Computes the time from start to now.
+*   Parameters : start - start time
+*                now - end time
+*   Effects    : None
+*   Returned   : Microseconds from start to now.
+**************************************************************************/
+static long ElapsedUsecs(struct timeval *start, struct timeval *now)
+{
+    return(((now->tv_sec - start->tv_sec) * 1000000L) +
+        (now->tv_usec - start->tv_usec));
+}
+
+/**************************************************************************
+*   Function   : PutVarint
+*   Description: Stores an unsigned value in a packed array seven bits per
+*                BYTE, least significant bits first.  The high bit of each
+*                BYTE is set if more BYTEs follow.
+*   Parameters : packed - array to store value in
+*                pos - index of the first BYTE to store
+*                limit - number of BYTEs in packed
+*                value - value to store
+*   Effects    : BYTEs starting at pos are written
+*   Returned   : Index of the BYTE following the value, -1 if the value
+*                does not fit or pos is already -1.
+**************************************************************************/
+static int PutVarint(BYTE *packed, int pos, int limit, unsigned value)
+{
+    if (pos < 0)
+    {
+        return(-1);
+    }
+
+    do
+    {
+        if (pos >= limit)
+        {
+            return(-1);
+        }
+
+        packed[pos++].byte = (value & 0x7F) | ((value > 0x7F) ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+
+    return(pos);
+}
+
+/**************************************************************************
+*   Function   : GetVarint
+*   Description: Reads an unsigned value stored by PutVarint.  Values
+*                come from the network, so anything larger than the
+*                caller can use is rejected here, before it is added to
+*                anything.
+*   Parameters : packed - array to read value from
+*                pos - index of the first BYTE to read
+*                limit - number of BYTEs in packed
+*                max - largest value the caller accepts
+*                value - pointer to where the value will be stored
+*   Effects    : *value is set
+*   Returned   : Index of the BYTE following the value, -1 if the value
+*                runs past limit or is larger than max.
+**************************************************************************/
+static int GetVarint(BYTE *packed, int pos, int limit, unsigned max,
+    unsigned *value)
+{
+    unsigned long long whole;
+    int shift;
+
+    whole = 0;
+    *value = 0;
+
+    for (shift = 0; (pos < limit) && (shift < 35); shift += 7)
+    {
+        whole |= (unsigned long long)(packed[pos].byte & 0x7F) << shift;
+
+        if (!(packed[pos++].byte & 0x80))
+        {
+            if (whole > max)
+            {
+                return(-1);
+            }
+
+            *value = (unsigned)whole;
+            return(pos);
+        }
+    }
+
+    return(-1);
+}
+
+/**************************************************************************
+*   Function   : MergedDims
+*   Description: Finds the dimensions of the grid that merging the
+*                buffered client cell grids will produce.
+*   Parameters : store - client store
+*                rows - set to the rows of the grid with the most rows
+*                cols - set to the columns of the grid with the most
+*                       columns
+*   Effects    : None
+*   Returned   : None
+**************************************************************************/
+static void MergedDims(CLIENT_STORE *store, int *rows, int *cols)
+{
+    GRID_BUF *buffer;
+    int slot;
+
+    *rows = 0;
+    *cols = 0;
+
+    for (slot = 0; slot < store->high; slot++)
+    {
+        buffer = &store->buffers[slot];
+
+        if (buffer->bits != NULL)
+        {
+            if (*rows < buffer->rows)
+            {
+                *rows = buffer->rows;
+            }
+
+            if (*cols < buffer->cols)
+            {
+                *cols = buffer->cols;
+            }
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : MergeScalar
+*   Description: Sums the fixed point cells of the client buffers into
+*                grid, one cell at a time.  This is the reference merge
+*                engine.  Each buffer's cells are shifted by its age, and
+*                buffers aged to 0 are skipped.  Sums saturate at
+*                FIXED_SUM_MAX.
+*   Parameters : store - client store
+*                grid - grid to hold the merge, with its dimensions set
+*                sums - scratch array with a row of PADDED_COLS(grid->cols)
+*                       FIXED_SUMs for each grid row
+*   Effects    : Buffers that were not updated since the last merge are
+*                aged.  grid gets the merged cells.
+*   Returned   : None
+**************************************************************************/
+static void MergeScalar(CLIENT_STORE *store, GRID *grid, FIXED_SUM *sums)
+{
+    int rows, cols, stride, row, col, age, slot;
+    unsigned sum;
+    GRID_BUF *buffer;
+
+    /* Clear all cells */
+    memset(sums, 0, grid->rows * PADDED_COLS(grid->cols) * sizeof(FIXED_SUM));
+
+    /* Now add buffered cells */
+    for (slot = 0; slot < store->high; slot++)
+    {
+        buffer = &store->buffers[slot];
+
+        if (buffer->bits == NULL)
+        {
+            continue;
+        }
+
+        rows = buffer->rows;
+        cols = buffer->cols;
+        stride = buffer->stride;
+
+        if (buffer->updated == FALSE)
+        {
+            /* Age out of date buffers */
+            AgeBuffer(buffer);
+        }
+
+        buffer->updated = FALSE;
+        age = buffer->age;
+
+        if (CellWeight(age) == 0)
+        {
+            continue;
+        }
+
+        for (row = 0; row < rows; row++)
+        {
+            for (col = 0; col < cols; col++)
+            {
+                sum = sums[(row * PADDED_COLS(grid->cols)) + col] +
+                    (buffer->cells[(row * stride) + col] >> age);
+                sums[(row * PADDED_COLS(grid->cols)) + col] =
+                    (sum > FIXED_SUM_MAX) ? FIXED_SUM_MAX : sum;
+            }
+        }
+    }
+
+    /* Copy cells to grid as ASCII */
+    for (row = 0; row < grid->rows; row++)
+    {
+        for (col = 0; col < grid->cols; col++)
+        {
+            grid->cells[(row * grid->cols) + col] = NibbleToAscii(
+                RoundFixed(sums[(row * PADDED_COLS(grid->cols)) + col]));
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : MergeVector
+*   Description: Sums the fixed point cells of the client buffers into
+*                grid, a vector at a time, with the kernels chosen by
+*                InitCodec.  The sums match MergeScalar's, as long as they
+*                stay under 256 whole cells.
+*   Parameters : store - client store
+*                grid - grid to hold the merge, with its dimensions set
+*                sums - CELL_ALIGN aligned scratch array with a row of
+*                       PADDED_COLS(grid->cols) FIXED_SUMs for each grid
+*                       row
+*   Effects    : Buffers that were not updated since the last merge are
+*                aged.  grid gets the merged cells.
+*   Returned   : None
+**************************************************************************/
+static void MergeVector(CLIENT_STORE *store, GRID *grid, FIXED_SUM *sums)
+{
+    SumVector(store, grid, sums);
+    RoundSumsInto(grid, sums);
+}
+
+/**************************************************************************
+*   Function   : SumVector
+*   Description: Sums the fixed point cells of the client buffers into an
+*                array of sums, a vector at a time, with the kernels chosen
+*                by InitCodec.  Buffer rows and sum rows both start on
+*                CELL_ALIGN boundaries and are padded with 0 cells, so
+*                every row is added with whole aligned vectors.  Buffers
+*                aged to 0 are skipped.
+*   Parameters : store - client store
+*                grid - dimensions of the merge
+*                sums - CELL_ALIGN aligned array with a row of
+*                       PADDED_COLS(grid->cols) FIXED_SUMs for each grid
+*                       row
+*   Effects    : Buffers that were not updated since the last merge are
+*                aged.  sums gets the unrounded sums.
+*   Returned   : None
+**************************************************************************/
+static void SumVector(CLIENT_STORE *store, GRID *grid, FIXED_SUM *sums)
+{
+    int row, sumStride, slot;
+    GRID_BUF *buffer;
+
+    sumStride = PADDED_COLS(grid->cols);
+    memset(sums, 0, grid->rows * sumStride * sizeof(FIXED_SUM));
+
+    for (slot = 0; slot < store->high; slot++)
+    {
+        buffer = &store->buffers[slot];
+
+        if (buffer->bits == NULL)
+        {
+            continue;
+        }
+
+        if (!buffer->updated)
+        {
+            /* Age out of date buffers */
+            AgeBuffer(buffer);
+        }
+
+        buffer->updated = FALSE;
+
+        if (CellWeight(buffer->age) == 0)
+        {
+            continue;
+        }
+
+        for (row = 0; row < buffer->rows; row++)
+        {
+            AddCells(&sums[row * sumStride],
+                &buffer->cells[row * buffer->stride], buffer->stride,
+                buffer->age);
+        }
+    }
+
+}
+
+/**************************************************************************
+*   Function   : MergeBitSliced
+*   Description: Sums the client buffers without expanding their cells.
+*                Each client's bits are read 64 cells at a time, and added
+*                into a bit sliced sum: plane n of the sum holds bit n of
+*                64 cell totals, so one word operation adds 64 cells.  A
+*                buffer aged k times holds its bits times 2^-k, so its bits
+*                are added at plane MERGE_FRACTION_PLANES - k.  Bits for
+*                the same plane are held until a second word for it comes,
+*                and the pair is added to the plane with a full adder,
+*                whose carry word is rippled into the higher planes.  Sums
+*                that overflow the planes saturate at FIXED_SUM_MAX, as in
+*                the other engines.  When every client is in, one half is
+*                added and the whole cell planes give the rounded totals.
+*                The sum for a word is MERGE_PLANES words, so it stays in
+*                registers, and each client's bits are 1/8 the size of
+*                its FIXED cells.
+*   Parameters : store - client store
+*                grid - grid to hold the merge, with its dimensions set
+*   Effects    : Buffers that were not updated since the last merge are
+*                aged.  grid gets the merged cells.
+*   Returned   : None
+**************************************************************************/
+static void MergeBitSliced(CLIENT_STORE *store, GRID *grid)
+{
+    unsigned long long planes[MERGE_PLANES];    /* sum of 64 cells */
+    unsigned long long pending[MERGE_PLANES];   /* bits waiting for a pair */
+    unsigned long long bits, sum, carry;
+    int row, col, count, plane, cell, value, slot;
+    GRID_BUF *buffer;
+
+    /* Age out of date buffers */
+    for (slot = 0; slot < store->high; slot++)
+    {
+        buffer = &store->buffers[slot];
+
+        if (buffer->bits != NULL)
+        {
+            if (!buffer->updated)
+            {
+                AgeBuffer(buffer);
+            }
+
+            buffer->updated = FALSE;
+        }
+    }
+
+    for (row = 0; row < grid->rows; row++)
+    {
+        for (col = 0; col < grid->cols; col += 64)
+        {
+            count = ((grid->cols - col) < 64) ? (grid->cols - col) : 64;
+            memset(planes, 0, sizeof(planes));
+            memset(pending, 0, sizeof(pending));
+
+            for (slot = 0; slot < store->high; slot++)
+            {
+                buffer = &store->buffers[slot];
+
+                if ((buffer->bits == NULL) ||
+                    (buffer->age > MERGE_FRACTION_PLANES) ||
+                    (row >= buffer->rows) || (col >= buffer->cols))
+                {
+                    continue;
+                }
+
+                bits = LoadCellWord(buffer->bits, (row * buffer->cols) + col,
+                    ((buffer->cols - col) < count) ?
+                    (buffer->cols - col) : count);
+                plane = MERGE_FRACTION_PLANES - buffer->age;
+
+                if (!pending[plane])
+                {
+                    pending[plane] = bits;
+                    continue;
+                }
+
+                /* Full add the pair into the plane, and ripple the carry */
+                sum = planes[plane] ^ pending[plane];
+                carry = (planes[plane] & pending[plane]) | (sum & bits);
+                planes[plane] = sum ^ bits;
+                pending[plane] = 0;
+                AddToPlanes(planes, plane + 1, carry);
+            }
+
+            for (plane = 0; plane < MERGE_SUM_PLANES; plane++)
+            {
+                AddToPlanes(planes, plane, pending[plane]);
+            }
+
+            /* Sums that overflowed become FIXED_SUM_MAX */
+            for (plane = 0; plane < MERGE_SUM_PLANES; plane++)
+            {
+                planes[plane] |= planes[MERGE_SUM_PLANES];
+            }
+
+            /* Add one half to round */
+            AddToPlanes(planes, MERGE_FRACTION_PLANES - 1, ~0ULL);
+
+            /* Cell n of the word is bit 63 - n of each plane */
+            for (cell = 0; cell < count; cell++)
+            {
+                value = 0;
+
+                for (plane = MERGE_PLANES - 1; plane >= MERGE_FRACTION_PLANES;
+                     plane--)
+                {
+                    value = (value << 1) | ((planes[plane] >> (63 - cell)) & 1);
+                }
+
+                grid->cells[(row * grid->cols) + col + cell] =
+                    NibbleToAscii(value);
+            }
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : LoadCellWord
+*   Description: Reads up to 64 cells from a bit packed grid, starting at
+*                any cell.  Packed cells are stored most significant bit
+*                first, so the word is built the same way.
+*   Parameters : bits - bit packed cells
+*                first - first cell to read
+*                count - number of cells to read, 1 to 64
+*   Effects    : None
+*   Returned   : The cells, with cell first in bit 63.  Bits after count
+*                cells are 0.  No byte after the last cell is read.
+**************************************************************************/
+static unsigned long long LoadCellWord(const BYTE *bits, int first, int count)
+{
+    unsigned long long word = 0;
+    int i, shift, needed;
+
+    bits += first / 8;
+    shift = first % 8;
+    needed = (shift + count + 7) / 8;
+
+    for (i = 0; i < 8; i++)
+    {
+        word = (word << 8) | ((i < needed) ? bits[i].byte : 0);
+    }
+
+    if (shift)
+    {
+        word <<= shift;
+
+        if (needed > 8)
+        {
+            word |= bits[8].byte >> (8 - shift);
+        }
+    }
+
+    if (count < 64)
+    {
+        word &= ~0ULL << (64 - count);
+    }
+
+    return(word);
+}
+
+/**************************************************************************
+*   Function   : AddToPlanes
+*   Description: Adds a word of bits to a bit sliced sum, rippling the
+*                carries into the higher planes.
+*   Parameters : planes - MERGE_PLANES words of bit sliced sums
+*                plane - plane to add bits at, below MERGE_SUM_PLANES
+*                bits - bits to add
+*   Effects    : planes is updated.  Carries out of the top sum plane
+*                are kept in the overflow plane, planes[MERGE_SUM_PLANES].
+*   Returned   : None
+**************************************************************************/
+static void AddToPlanes(unsigned long long *planes, int plane,
+    unsigned long long bits)
+{
+    unsigned long long carry;
+
+    for (; bits && (plane < MERGE_SUM_PLANES); plane++)
+    {
+        carry = planes[plane] & bits;
+        planes[plane] ^= bits;
+        bits = carry;
+    }
+
+    planes[MERGE_SUM_PLANES] |= bits;
+}
+
+/**************************************************************************
+*   Function   : ExpandBits
+*   Description: Expands a run of a buffer's bit packed cells into its
+*                fixed point cells, 0 is expanded to 0, and 1 is expanded
+*                to FIXED_ONE.  Cells are numbered as in the packed grid,
+*                and land in the buffer's padded rows.
+*   Parameters : buffer - buffer with bits, dimensions and stride set
+*                first - first cell to expand
+*                count - number of cells to expand
+*   Effects    : The buffer's cells first to first + count - 1 are
+*                written.  When a whole row is expanded, its padding is
+*                cleared too.
+*   Returned   : None
+**************************************************************************/
+static void ExpandBits(GRID_BUF *buffer, int first, int count)
+{
+    unsigned long long word;
+    FIXED *cells;
+    int row, col, run, cell;
+
+    row = first / buffer->cols;
+    col = first % buffer->cols;
+
+    while (count > 0)
+    {
+        run = buffer->cols - col;
+        run = (run < count) ? run : count;
+        run = (run < 64) ? run : 64;
+
+        word = LoadCellWord(buffer->bits, first, run);
+        cells = &buffer->cells[(row * buffer->stride) + col];
+
+        for (cell = 0; cell < run; cell++)
+        {
+            cells[cell] = ((word >> (63 - cell)) & 1) << FIXED_SHIFT;
+        }
+
+        first += run;
+        count -= run;
+        col += run;
+
+        if (col == buffer->cols)
+        {
+            memset(&cells[run], 0, buffer->stride - buffer->cols);
+            col = 0;
+            row++;
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : CellWeight
+*   Description: Finds what a 1 cell adds to a merge after it has been aged
+*                age times.  Aging halves and truncates, so this is a 1
+*                cell shifted by age.
+*   Parameters : age - merges since the buffer was last updated
+*   Effects    : None
+*   Returned   : FIXED_ONE >> age, 0 once every bit is shifted out
+**************************************************************************/
+static int CellWeight(int age)
+{
+    return((age > FIXED_SHIFT) ? 0 : FIXED_ONE >> age);
+}
+
+/**************************************************************************
+*   Function   : AccumulateCell
+*   Description: Adds weight to one running sum, and updates the merged
+*                cell it is shown as.  The shown cell saturates at
+*                FIXED_SUM_MAX like the merge engines.
+*   Parameters : sum - running sum
+*                cell - index of the cell in sum->grid
+*                weight - signed amount to add
+*   Effects    : The sum and merged cell are updated.
+*   Returned   : None
+**************************************************************************/
+static void AccumulateCell(ACCUMULATOR *sum, int cell, int weight)
+{
+    unsigned value;
+
+    value = sum->sums[cell] += weight;
+    sum->grid.cells[cell] = NibbleToAscii(RoundFixed(
+        (value > FIXED_SUM_MAX) ? FIXED_SUM_MAX : value));
+}
+
+/**************************************************************************
+*   Function   : AccumulateByte
+*   Description: Adds the cells of one byte of a buffer's bits that changed
+*                to a running sum.  Cells that became 1 add FIXED_ONE, and
+*                cells that became 0 take it away.
+*   Parameters : sum - running sum
+*                buffer - buffer with age 0 that the byte belongs to
+*                index - index of the byte in buffer->bits
+*                change - bits of the cells that changed
+*                now - new value of the byte
+*   Effects    : sum is updated.  If the buffer does not fit the running
+*                sum, it is marked stale instead.
+*   Returned   : None
+**************************************************************************/
+static void AccumulateByte(ACCUMULATOR *sum, GRID_BUF *buffer, int index,
+    unsigned char change, unsigned char now)
+{
+    int bit, cell;
+
+    if (sum->stale)
+    {
+        return;
+    }
+
+    if ((buffer->rows > sum->grid.rows) || (buffer->cols > sum->grid.cols))
+    {
+        sum->stale = TRUE;
+        return;
+    }
+
+    for (bit = 0; (bit < 8) && (change != 0); bit++)
+    {
+        cell = (index * 8) + bit;
+
+        if (!(change & CellMask[bit]) ||
+            (cell >= (buffer->rows * buffer->cols)))
+        {
+            continue;
+        }
+
+        change &= ~CellMask[bit];
+        AccumulateCell(sum,
+            ((cell / buffer->cols) * sum->grid.cols) + (cell % buffer->cols),
+            (now & CellMask[bit]) ? FIXED_ONE : -FIXED_ONE);
+    }
+}
+
+/**************************************************************************
+*   Function   : AccumulateFrame
+*   Description: Adds the cells a key frame changes to a running sum.  The
+*                bits are compared a word at a time, and only the bytes of
+*                words that differ are looked at more closely.
+*   Parameters : sum - running sum
+*                buffer - buffer with age 0, holding the last frame
+*                bits - bits of the new frame, the same size
+*   Effects    : sum is updated, the buffer is not changed.
+*   Returned   : None
+**************************************************************************/
+static void AccumulateFrame(ACCUMULATOR *sum, GRID_BUF *buffer, BYTE *bits)
+{
+    unsigned long long was, now;
+    int index, numBytes, step, byte;
+
+    numBytes = ((buffer->rows * buffer->cols) + 7) / 8;
+
+    for (index = 0; index < numBytes; index += step)
+    {
+        step = numBytes - index;
+        step = (step < (int)sizeof(was)) ? step : (int)sizeof(was);
+
+        was = 0;
+        now = 0;
+        memcpy(&was, &buffer->bits[index], step);
+        memcpy(&now, &bits[index], step);
+
+        if (was == now)
+        {
+            continue;
+        }
+
+        for (byte = index; byte < (index + step); byte++)
+        {
+            if (buffer->bits[byte].byte != bits[byte].byte)
+            {
+                AccumulateByte(sum, buffer, byte,
+                    buffer->bits[byte].byte ^ bits[byte].byte,
+                    bits[byte].byte);
+            }
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : AccumulateBuffer
+*   Description: Adds weight to the running sum of every 1 cell of a
+*                buffer, and count to its count in an age class.  Used to
+*                put a buffer into a sum or take it out, and to age it.
+*                The bits are read 64 cells at a time, and only the 1
+*                cells are visited.
+*   Parameters : sum - running sum
+*                buffer - buffer to add
+*                weight - signed amount to add for each 1 cell
+*                counts - counts of the age class the buffer is joining
+*                         or leaving, or NULL
+*                count - 1 to join counts, -1 to leave it
+*   Effects    : sum is updated.  If the buffer does not fit the running
+*                sum, it is marked stale instead.
+*   Returned   : None
+**************************************************************************/
+static void AccumulateBuffer(ACCUMULATOR *sum, GRID_BUF *buffer, int weight,
+    unsigned *counts, int count)
+{
+    unsigned long long word;
+    int row, col, bits, cell;
+
+    if (sum->stale || (weight == 0) || (buffer->bits == NULL))
+    {
+        return;
+    }
+
+    if ((buffer->rows > sum->grid.rows) || (buffer->cols > sum->grid.cols))
+    {
+        sum->stale = TRUE;
+        return;
+    }
+
+    for (row = 0; row < buffer->rows; row++)
+    {
+        for (col = 0; col < buffer->cols; col += 64)
+        {
+            bits = buffer->cols - col;
+            bits = (bits < 64) ? bits : 64;
+            word = LoadCellWord(buffer->bits, (row * buffer->cols) + col,
+                bits);
+
+            while (word != 0)
+            {
+                cell = __builtin_clzll(word);
+                word &= ~(1ULL << (63 - cell));
+                cell += (row * sum->grid.cols) + col;
+                AccumulateCell(sum, cell, weight);
+
+                if (counts != NULL)
+                {
+                    counts[cell] += count;
+                }
+            }
+        }
+    }
+}
+
+/**************************************************************************
+*   Function   : AgeClass
+*   Description: Finds the age class of a buffer in a running sum.  The
+*                classes are used round robin, the newest one is
+*                sum->epoch, and a class is used again once its buffers
+*                have been aged more than AGE_CLASSES times.
+*   Parameters : sum - running sum
+*                age - buffer's age, 1 to AGE_CLASSES
+*   Effects    : None
+*   Returned   : Index of the buffer's class in sum's counts and members
+**************************************************************************/
+static int AgeClass(const ACCUMULATOR *sum, int age)
+{
+    return((sum->epoch + AGE_CLASSES + 1 - age) % AGE_CLASSES);
+}
+
+/**************************************************************************
+*   Function   : AccountBuffer
+*   Description: Puts a buffer into a running sum at its age, or takes it
+*                out.  A buffer aged 1 to AGE_CLASSES times also joins or
+*                leaves its age class.  Buffers aged more times are in no
+*                class and add nothing.
+*   Parameters : sum - running sum
+*                buffer - buffer to put in or take out
+*                sign - 1 to put the buffer in, -1 to take it out
+*   Effects    : sum is updated.  If the buffer does not fit the running
+*                sum, it is marked stale instead.
+*   Returned   : None
+**************************************************************************/
+static void AccountBuffer(ACCUMULATOR *sum, GRID_BUF *buffer, int sign)
+{
+    int class;
+
+    if (sum->stale || (buffer->bits == NULL))
+    {
+        return;
+    }
+
+    if ((buffer->age == 0) || (buffer->age > AGE_CLASSES))
+    {
+        AccumulateBuffer(sum, buffer, sign * CellWeight(buffer->age),
+            NULL, 0);
+        return;
+    }
+
+    class = AgeClass(sum, buffer->age);
+    sum->members[class] += sign;
+    AccumulateBuffer(sum, buffer, sign * CellWeight(buffer->age),
+        &sum->counts[class * sum->size], sign);
+}
+
+/**************************************************************************
+*   Function   : AgeClasses
+*   Description: Ages every buffer already in an age class of a running
+*                sum, by taking the weight the class loses out of each
+*                cell it has 1 cells in.  That is one pass over the counts
+*                of each class with buffers in it, however many buffers
+*                there are.  The oldest class has aged out, so it is
+*                emptied and becomes the newest.
+*   Parameters : sum - running sum
+*   Effects    : sum is aged, and its epoch moves to the emptied class.
+*                Buffers in a class must have their ages counted by the
+*                caller.
+*   Returned   : None
+**************************************************************************/
+static void AgeClasses(ACCUMULATOR *sum)
+{
+    unsigned *counts;
+    int class, age, weight, numCells, cell;
+
+    if (!sum->stale)
+    {
+        numCells = sum->grid.rows * sum->grid.cols;
+
+        for (age = 1; age <= AGE_CLASSES; age++)
+        {
+            class = AgeClass(sum, age);
+
+            if (sum->members[class] == 0)
+            {
+                continue;
+            }
+
+            counts = &sum->counts[class * sum->size];
+            weight = CellWeight(age) - CellWeight(age + 1);
+
+            for (cell = 0; cell < numCells; cell++)
+            {
+                if (counts[cell] != 0)
+                {
+                    AccumulateCell(sum, cell, -(int)counts[cell] * weight);
+                }
+            }
+        }
+
+        /* The oldest class only holds buffers that now add nothing */
+        class = AgeClass(sum, AGE_CLASSES);
+        memset(&sum->counts[class * sum->size], 0,
+            numCells * sizeof(unsigned));
+        sum->members[class] = 0;
+    }
+
+    sum->epoch = AgeClass(sum, AGE_CLASSES);
+}
+
+/**************************************************************************
+*   Function   : RebuildAccumulator
+*   Description: Lays a running sum out for a merged grid of rows x cols,
+*                and sums every buffer into it again at its current age,
+*                with each aged buffer in its age class.
+*   Parameters : store - client store
+*                sum - running sum
+*                rows - rows of the merged grid
+*                cols - columns of the merged grid
+*   Effects    : sum's arrays grow if needed, and sum is no longer stale.
+*   Returned   : TRUE on success, FALSE if the arrays could not be
+*                allocated.
+**************************************************************************/
+static int RebuildAccumulator(CLIENT_STORE *store, ACCUMULATOR *sum,
+    int rows, int cols)
+{
+    int numCells, slot;
+
+    numCells = rows * cols;
+
+    if (sum->size < numCells)
+    {
+        free(sum->sums);
+        free(sum->counts);
+        free(sum->grid.cells);
+        sum->sums = (unsigned *)CountedMalloc(numCells * sizeof(unsigned));
+        sum->counts = (unsigned *)CountedMalloc((size_t)AGE_CLASSES *
+            numCells * sizeof(unsigned));
+        sum->grid.cells = (char *)CountedMalloc(numCells);
+        sum->size = numCells;
+
+        if ((sum->sums == NULL) || (sum->counts == NULL) ||
+            (sum->grid.cells == NULL))
+        {
+            PutFormattedLine(Rows - 2, 0, "Unable to allocate running sum");
+            FreeAccumulator(sum);
+            return(FALSE);
+        }
+    }
+
+    sum->grid.rows = rows;
+    sum->grid.cols = cols;
+    memset(sum->sums, 0, numCells * sizeof(unsigned));
+    memset(sum->counts, 0, (size_t)AGE_CLASSES * sum->size *
+        sizeof(unsigned));
+    memset(sum->members, 0, sizeof(sum->members));
+    memset(sum->grid.cells, NibbleToAscii(0), numCells);
+    sum->stale = FALSE;
+
+    for (slot = 0; slot < store->high; slot++)
+    {
+        AccountBuffer(sum, &store->buffers[slot], 1);
+    }
+
+    return(TRUE);
+}
+
+/**************************************************************************
+*   Function   : KernelsMatch
+*   Description: Packs and unpacks a test pattern with a pair of kernels
+*                and with the scalar kernels, and compares the results.
+*   Parameters : pack - packing kernel to test
+*                unpack - unpacking kernel to test
+*   Effects    : None
+*   Returned   : TRUE if the kernels produce the same output as the scalar
+*                kernels, otherwise FALSE.
+**************************************************************************/
+static int KernelsMatch(PACK_KERNEL pack, UNPACK_KERNEL unpack)
+{
+    char cells[KERNEL_TEST_CELLS], expected[KERNEL_TEST_CELLS];
+    char unpacked[KERNEL_TEST_CELLS];
+    BYTE packed[(KERNEL_TEST_CELLS + 7) / 8];
+    BYTE reference[(KERNEL_TEST_CELLS + 7) / 8];
+    unsigned pattern = 0x2545F491;
+    int cell;
+
+    /* Make a repeatable pattern that sets every bit position */
+    for (cell = 0; cell < KERNEL_TEST_CELLS; cell++)
+    {
+        pattern = (pattern * 1103515245) + 12345;
+        cells[cell] = ((pattern >> 16) & 1) + '0';
+    }
+
+    PackCellsScalar(cells, reference, KERNEL_TEST_CELLS);
+    pack(cells, packed, KERNEL_TEST_CELLS);
+
+    for (cell = 0; cell < (KERNEL_TEST_CELLS + 7) / 8; cell++)
+    {
+        if (packed[cell].byte != reference[cell].byte)
+        {
+            return(FALSE);
+        }
+    }
+
+    UnpackCellsScalar(reference, expected, KERNEL_TEST_CELLS);
+    unpack(reference, unpacked, KERNEL_TEST_CELLS);
+
+    return(!memcmp(expected, unpacked, KERNEL_TEST_CELLS) &&
+        !memcmp(expected, cells, KERNEL_TEST_CELLS));
+}
+
+/**************************************************************************
+*   Function   : PackCellsScalar
+*   Description: Packs '0'/'1' cells into bits, one OCTET at a time.  This
+*                is the reference kernel, and the tail handler for the
+*                other kernels.  A partial last byte is padded with 0 bits.
+*   Parameters : cells - cells to pack
+*                packed - packed output, (numCells + 7) / 8 BYTEs
+*                numCells - number of cells to pack
+*   Effects    : packed is filled
+*   Returned   : None
+**************************************************************************/
+static void PackCellsScalar(const char *cells, BYTE *packed, int numCells)
+{
+    char tail[8];
+    int cell;
+
+    for (cell = 0; (cell + 8) <= numCells; cell += 8, packed++)
+    {
+        packed->bit.bit0 = cells[cell] - '0';
+        packed->bit.bit1 = cells[cell + 1] - '0';
+        packed->bit.bit2 = cells[cell + 2] - '0';
+        packed->bit.bit3 = cells[cell + 3] - '0';
+        packed->bit.bit4 = cells[cell + 4] - '0';
+        packed->bit.bit5 = cells[cell + 5] - '0';
+        packed->bit.bit6 = cells[cell + 6] - '0';
+        packed->bit.bit7 = cells[cell + 7] - '0';
+    }
+
+    if (cell < numCells)
+    {
+        /* Pad the leftover cells out to a full byte with '0's */
+        memset(tail, '0', sizeof(tail));
+        memcpy(tail, &cells[cell], numCells - cell);
+        PackCellsScalar(tail, packed, 8);
+    }
+}
+
+/**************************************************************************
+*   Function   : UnpackCellsScalar
+*   Description: Unpacks bits into '0'/'1' cells, one OCTET at a time.
+*                This is the reference kernel, and the tail handler for the
+*                other kernels.
+*   Parameters : packed - packed input, (numCells + 7) / 8 BYTEs
+*                cells - unpacked output
+*                numCells - number of cells to unpack
+*   Effects    : cells is filled
+*   Returned   : None
+**************************************************************************/
+static void UnpackCellsScalar(const BYTE *packed, char *cells, int numCells)
+{
+    char tail[8];
+    int cell;
+
+    for (cell = 0; (cell + 8) <= numCells; cell += 8, packed++)
+    {
+        cells[cell] = packed->bit.bit0 + '0';
+        cells[cell + 1] = packed->bit.bit1 + '0';
+        cells[cell + 2] = packed->bit.bit2 + '0';
+        cells[cell + 3] = packed->bit.bit3 + '0';
+        cells[cell + 4] = packed->bit.bit4 + '0';
+        cells[cell + 5] = packed->bit.bit5 + '0';
+        cells[cell + 6] = packed->bit.bit6 + '0';
+        cells[cell + 7] = packed->bit.bit7 + '0';
+    }
+
+    if (cell < numCells)
+    {
+        /* Unpack the whole last byte and keep the cells we need */
+        UnpackCellsScalar(packed, tail, 8);
+        memcpy(&cells[cell], tail, numCells - cell);
+    }
+}
+
+/**************************************************************************
+*   Function   : PackCellsSwar
+*   Description: Packs '0'/'1' cells into bits eight at a time, by loading
+*                the cells as one 64 bit word, masking off the low bit of
+*                each byte, and gathering those bits into the top byte with
+*                a multiply.  The low bits are all distinct powers of two,
+*                so the multiply never carries.  Assumes the OCTET layout
+*                puts bit0 in the most significant bit of the byte.
+*   Parameters : cells - cells to pack
+*                packed - packed output, (numCells + 7) / 8 BYTEs
+*                numCells - number of cells to pack
+*   Effects    : packed is filled
+*   Returned   : None
+**************************************************************************/
+static void PackCellsSwar(const char *cells, BYTE *packed, int numCells)
+{
+    unsigned long long word;
+    int cell;
+
+    for (cell = 0; (cell + 8) <= numCells; cell += 8)
+    {
+        memcpy(&word, &cells[cell], sizeof(word));
+        packed[cell / 8].byte = ((word & SWAR_LSBS) * SWAR_GATHER) >> 56;
+    }
+
+    PackCellsScalar(&cells[cell], &packed[cell / 8], numCells - cell);
+}
+
+/**************************************************************************
+*   Function   : UnpackCellsSwar
+*   Description: Unpacks bits into '0'/'1' cells eight at a time, by
+*                copying a packed byte into every byte of a 64 bit word,
+*                keeping a different bit in each byte, and turning each
+*                non-zero byte into a '1'.
+*   Parameters : packed - packed input, (numCells + 7) / 8 BYTEs
+*                cells - unpacked output
+*                numCells - number of cells to unpack
+*   Effects    : cells is filled
+*   Returned   : None
+**************************************************************************/
+static void UnpackCellsSwar(const BYTE *packed, char *cells, int numCells)
+{
+    unsigned long long word;
+    int cell;
+
+    for (cell = 0; (cell + 8) <= numCells; cell += 8)
+    {
+        word = (packed[cell / 8].byte * SWAR_LSBS) & SWAR_SPREAD;
+        word = (((word + SWAR_HIGHS) >> 7) & SWAR_LSBS) | SWAR_ZEROS;
+        memcpy(&cells[cell], &word, sizeof(word));
+    }
+
+    UnpackCellsScalar(&packed[cell / 8], &cells[cell], numCells - cell);
+}
+
+/**************************************************************************
+*   Function   : AddCellsScalar
+*   Description: Adds a row of fixed point cells, aged by a shift, to a
+*                row of sums, one cell at a time, saturating at
+*                FIXED_SUM_MAX.  Used by MERGE_VECTOR on CPUs without
+*                vector kernels.
+*   Parameters : sums - row of sums
+*                cells - row of cells
+*                count - number of cells
+*                shift - age of the cells, 0 to FIXED_SHIFT
+*   Effects    : sums is updated
+*   Returned   : None
+**************************************************************************/
+static void AddCellsScalar(FIXED_SUM *sums, const FIXED *cells, int count,
+    int shift)
+{
+    unsigned sum;
+    int cell;
+
+    for (cell = 0; cell < count; cell++)
+    {
+        sum = sums[cell] + (cells[cell] >> shift);
+        sums[cell] = (sum > FIXED_SUM_MAX) ? FIXED_SUM_MAX : sum;
+    }
+}
+
+/**************************************************************************
+*   Function   : RoundCellsScalar
+*   Description: Rounds a row of sums and converts them to ASCII, one cell
+*                at a time.
+*   Parameters : sums - row of sums
+*                cells - row of ASCII cells
+*                count - number of cells
+*   Effects    : cells is filled
+*   Returned   : None
+**************************************************************************/
+static void RoundCellsScalar(const FIXED_SUM *sums, char *cells, int count)
+{
+    int cell;
+
+    for (cell = 0; cell < count; cell++)
+    {
+        cells[cell] = NibbleToAscii(RoundFixed(sums[cell]));
+    }
+}
+
+#ifdef X86_KERNELS
+/**************************************************************************
+*   Function   : PackCellsSse2
+*   Description: Packs '0'/'1' cells into bits sixteen at a time.  The low
+*                bit of each cell is shifted up to the sign bit and
+*                collected with movemask, which puts cell 0 in bit 0, so
+*                each byte of the mask is bit reversed on the way out.
+*   Parameters : cells - cells to pack
+*                packed - packed output, (numCells + 7) / 8 BYTEs
+*                numCells - number of cells to pack
+*   Effects    : packed is filled
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("sse2")))
+static void PackCellsSse2(const char *cells, BYTE *packed, int numCells)
+{
+    __m128i block;
+    unsigned mask;
+    int cell;
+
+    for (cell = 0; (cell + 16) <= numCells; cell += 16)
+    {
+        block = _mm_loadu_si128((const __m128i *)&cells[cell]);
+        mask = _mm_movemask_epi8(_mm_slli_epi64(block, 7));
+        packed[cell / 8].byte = BitReverse[mask & 0xFF];
+        packed[(cell / 8) + 1].byte = BitReverse[mask >> 8];
+    }
+
+    PackCellsScalar(&cells[cell], &packed[cell / 8], numCells - cell);
+}
+
+/**************************************************************************
+*   Function   : UnpackCellsSse2
+*   Description: Unpacks bits into '0'/'1' cells sixteen at a time.  Two
+*                packed bytes are each spread across eight lanes, every
+*                lane is compared against its own bit, and the all ones
+*                result is subtracted from '0' to make '1'.
+*   Parameters : packed - packed input, (numCells + 7) / 8 BYTEs
+*                cells - unpacked output
+*                numCells - number of cells to unpack
+*   Effects    : cells is filled
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("sse2")))
+static void UnpackCellsSse2(const BYTE *packed, char *cells, int numCells)
+{
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                      1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i zeros = _mm_set1_epi8('0');
+    __m128i block;
+    int cell;
+
+    for (cell = 0; (cell + 16) <= numCells; cell += 16)
+    {
+        block = _mm_cvtsi32_si128(packed[cell / 8].byte |
+            (packed[(cell / 8) + 1].byte << 8));
+        block = _mm_unpacklo_epi8(block, block);
+        block = _mm_unpacklo_epi16(block, block);
+        block = _mm_unpacklo_epi32(block, block);
+        block = _mm_cmpeq_epi8(_mm_and_si128(block, bits), bits);
+        _mm_storeu_si128((__m128i *)&cells[cell], _mm_sub_epi8(zeros, block));
+    }
+
+    UnpackCellsScalar(&packed[cell / 8], &cells[cell], numCells - cell);
+}
+
+/**************************************************************************
+*   Function   : AddCellsSse2
+*   Description: Adds a row of fixed point cells, aged by a shift, to a
+*                row of sums sixteen at a time.  The cells are widened to
+*                16 bits by unpacking them with zeros, shifted, and added
+*                with unsigned saturation.
+*   Parameters : sums - CELL_ALIGN aligned row of sums
+*                cells - CELL_ALIGN aligned row of cells
+*                count - number of cells, a multiple of CELL_ALIGN
+*                shift - age of the cells, 0 to FIXED_SHIFT
+*   Effects    : sums is updated
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("sse2")))
+static void AddCellsSse2(FIXED_SUM *sums, const FIXED *cells, int count,
+    int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i age = _mm_cvtsi32_si128(shift);
+    __m128i block, low, high;
+    int cell;
+
+    for (cell = 0; cell < count; cell += 16)
+    {
+        block = _mm_load_si128((const __m128i *)&cells[cell]);
+        low = _mm_load_si128((const __m128i *)&sums[cell]);
+        high = _mm_load_si128((const __m128i *)&sums[cell + 8]);
+        low = _mm_adds_epu16(low,
+            _mm_srl_epi16(_mm_unpacklo_epi8(block, zero), age));
+        high = _mm_adds_epu16(high,
+            _mm_srl_epi16(_mm_unpackhi_epi8(block, zero), age));
+        _mm_store_si128((__m128i *)&sums[cell], low);
+        _mm_store_si128((__m128i *)&sums[cell + 8], high);
+    }
+}
+
+/**************************************************************************
+*   Function   : RoundCellsSse2
+*   Description: Rounds a row of sums and converts them to ASCII sixteen at
+*                a time.  Half is added and the fraction shifted out, the
+*                results are packed to bytes, and '0' is added, plus 7
+*                more for values of 10 and up to reach 'A'.
+*   Parameters : sums - CELL_ALIGN aligned row of sums
+*                cells - row of ASCII cells, any alignment
+*                count - number of cells
+*   Effects    : cells is filled
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("sse2")))
+static void RoundCellsSse2(const FIXED_SUM *sums, char *cells, int count)
+{
+    const __m128i half = _mm_set1_epi16(FIXED_HALF);
+    const __m128i ten = _mm_set1_epi8(10);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letters = _mm_set1_epi8('A' - '0' - 10);
+    __m128i low, high, value, big;
+    int cell;
+
+    for (cell = 0; (cell + 16) <= count; cell += 16)
+    {
+        low = _mm_load_si128((const __m128i *)&sums[cell]);
+        high = _mm_load_si128((const __m128i *)&sums[cell + 8]);
+        low = _mm_srli_epi16(_mm_adds_epu16(low, half), FIXED_SHIFT);
+        high = _mm_srli_epi16(_mm_adds_epu16(high, half), FIXED_SHIFT);
+        value = _mm_packus_epi16(low, high);
+        big = _mm_cmpeq_epi8(_mm_max_epu8(value, ten), value);
+        value = _mm_add_epi8(_mm_add_epi8(value, zero),
+            _mm_and_si128(big, letters));
+        _mm_storeu_si128((__m128i *)&cells[cell], value);
+    }
+
+    RoundCellsScalar(&sums[cell], &cells[cell], count - cell);
+}
+
+/**************************************************************************
+*   Function   : PackCellsAvx2
+*   Description: Packs '0'/'1' cells into bits thirty-two at a time.  Works
+*                the same way as PackCellsSse2 on 256 bit registers.
+*   Parameters : cells - cells to pack
+*                packed - packed output, (numCells + 7) / 8 BYTEs
+*                numCells - number of cells to pack
+*   Effects    : packed is filled
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("avx2")))
+static void PackCellsAvx2(const char *cells, BYTE *packed, int numCells)
+{
+    __m256i block;
+    unsigned mask;
+    int cell;
+
+    for (cell = 0; (cell + 32) <= numCells; cell += 32)
+    {
+        block = _mm256_loadu_si256((const __m256i *)&cells[cell]);
+        mask = _mm256_movemask_epi8(_mm256_slli_epi64(block, 7));
+        packed[cell / 8].byte = BitReverse[mask & 0xFF];
+        packed[(cell / 8) + 1].byte = BitReverse[(mask >> 8) & 0xFF];
+        packed[(cell / 8) + 2].byte = BitReverse[(mask >> 16) & 0xFF];
+        packed[(cell / 8) + 3].byte = BitReverse[mask >> 24];
+    }
+
+    PackCellsScalar(&cells[cell], &packed[cell / 8], numCells - cell);
+}
+
+/**************************************************************************
+*   Function   : UnpackCellsAvx2
+*   Description: Unpacks bits into '0'/'1' cells thirty-two at a time.
+*                Four packed bytes are broadcast and shuffled so each one
+*                fills eight lanes, then handled as in UnpackCellsSse2.
+*   Parameters : packed - packed input, (numCells + 7) / 8 BYTEs
+*                cells - unpacked output
+*                numCells - number of cells to unpack
+*   Effects    : cells is filled
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("avx2")))
+static void UnpackCellsAvx2(const BYTE *packed, char *cells, int numCells)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                            1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2,
+                                            3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bits = _mm256_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+                                          -128, 64, 32, 16, 8, 4, 2, 1,
+                                          -128, 64, 32, 16, 8, 4, 2, 1,
+                                          -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m256i zeros = _mm256_set1_epi8('0');
+    __m256i block;
+    int cell, word;
+
+    for (cell = 0; (cell + 32) <= numCells; cell += 32)
+    {
+        word = packed[cell / 8].byte |
+            (packed[(cell / 8) + 1].byte << 8) |
+            (packed[(cell / 8) + 2].byte << 16) |
+            ((unsigned)packed[(cell / 8) + 3].byte << 24);
+        block = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+        block = _mm256_cmpeq_epi8(_mm256_and_si256(block, bits), bits);
+        _mm256_storeu_si256((__m256i *)&cells[cell],
+            _mm256_sub_epi8(zeros, block));
+    }
+
+    UnpackCellsScalar(&packed[cell / 8], &cells[cell], numCells - cell);
+}
+
+/**************************************************************************
+*   Function   : AddCellsAvx2
+*   Description: Adds a row of fixed point cells, aged by a shift, to a
+*                row of sums thirty-two at a time.  Works the same way as
+*                AddCellsSse2 on 256 bit registers, widening each half of
+*                the cells with a zero extending move.
+*   Parameters : sums - CELL_ALIGN aligned row of sums
+*                cells - CELL_ALIGN aligned row of cells
+*                count - number of cells, a multiple of CELL_ALIGN
+*                shift - age of the cells, 0 to FIXED_SHIFT
+*   Effects    : sums is updated
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("avx2")))
+static void AddCellsAvx2(FIXED_SUM *sums, const FIXED *cells, int count,
+    int shift)
+{
+    const __m128i age = _mm_cvtsi32_si128(shift);
+    __m256i block, low, high;
+    int cell;
+
+    for (cell = 0; cell < count; cell += 32)
+    {
+        block = _mm256_load_si256((const __m256i *)&cells[cell]);
+        low = _mm256_load_si256((const __m256i *)&sums[cell]);
+        high = _mm256_load_si256((const __m256i *)&sums[cell + 16]);
+        low = _mm256_adds_epu16(low, _mm256_srl_epi16(
+            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(block)), age));
+        high = _mm256_adds_epu16(high, _mm256_srl_epi16(
+            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(block, 1)), age));
+        _mm256_store_si256((__m256i *)&sums[cell], low);
+        _mm256_store_si256((__m256i *)&sums[cell + 16], high);
+    }
+}
+
+/**************************************************************************
+*   Function   : RoundCellsAvx2
+*   Description: Rounds a row of sums and converts them to ASCII thirty-two
+*                at a time.  Works the same way as RoundCellsSse2 on 256
+*                bit registers.  The byte pack works within 128 bit lanes,
+*                so the 64 bit quarters are put back in order after it.
+*   Parameters : sums - CELL_ALIGN aligned row of sums
+*                cells - row of ASCII cells, any alignment
+*                count - number of cells
+*   Effects    : cells is filled
+*   Returned   : None
+**************************************************************************/
+__attribute__((target("avx2")))
+static void RoundCellsAvx2(const FIXED_SUM *sums, char *cells, int count)
+{
+    const __m256i half = _mm256_set1_epi16(FIXED_HALF);
+    const __m256i ten = _mm256_set1_epi8(10);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i letters = _mm256_set1_epi8('A' - '0' - 10);
+    __m256i low, high, value, big;
+    int cell;
+
+    for (cell = 0; (cell + 32) <= count; cell += 32)
+    {
+        low = _mm256_load_si256((const __m256i *)&sums[cell]);
+        high = _mm256_load_si256((const __m256i *)&sums[cell + 16]);
+        low = _mm256_srli_epi16(_mm256_adds_epu16(low, half), FIXED_SHIFT);
+        high = _mm256_srli_epi16(_mm256_adds_epu16(high, half), FIXED_SHIFT);
+        value = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high),
+            0xD8);
+        big = _mm256_cmpeq_epi8(_mm256_max_epu8(value, ten), value);
+        value = _mm256_add_epi8(_mm256_add_epi8(value, zero),
+            _mm256_and_si256(big, letters));
+        _mm256_storeu_si256((__m256i *)&cells[cell], value);
+    }
+
+    RoundCellsScalar(&sums[cell], &cells[cell], count - cell);
+}
+#endif
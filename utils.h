@@ -14,6 +14,9 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 /**************************************************************************
 *                                 Definitions
@@ -25,20 +28,20 @@
 
 typedef struct          /* 8 bit structure of bits */
 {
-    unsigned bit7:1;
-    unsigned bit6:1;
-    unsigned bit5:1;
-    unsigned bit4:1;
-    unsigned bit3:1;
-    unsigned bit2:1;
-    unsigned bit1:1;
-    unsigned bit0:1;
+    unsigned char bit7:1;
+    unsigned char bit6:1;
+    unsigned char bit5:1;
+    unsigned char bit4:1;
+    unsigned char bit3:1;
+    unsigned char bit2:1;
+    unsigned char bit1:1;
+    unsigned char bit0:1;
 } OCTET;
 
 typedef struct          /* 2 nibble structure */
 {
-    unsigned nibble1:4;
-    unsigned nibble0:4;
+    unsigned char nibble1:4;
+    unsigned char nibble0:4;
 } NIBBLES;
 
 typedef union           /* Union for converting character into bits */
@@ -52,67 +55,360 @@ typedef struct          /* Structure for storing clients cell grid */
 {
     struct timeval timeStamp;   /* time when data was last updated */
     unsigned sequenceNumber;    /* sequence number */
-    unsigned char rows;         /* number of rows in grid*/
-    unsigned char cols;         /* number of columns in grid */
+    unsigned short rows;        /* number of rows in grid*/
+    unsigned short cols;        /* number of columns in grid */
     char *cells;                /* actual grid data cells */
 } GRID;
 
-/* Define positions of data in packed structure */
-#define SIZE_POS        0
-#define TS_POS          1
-#define SN_POS          (TS_POS + sizeof(struct timeval))
-#define ROW_POS         (SN_POS + sizeof(unsigned))
-#define COL_POS         (ROW_POS + sizeof(unsigned char))
-#define CELL_POS        (COL_POS + sizeof(unsigned char))
+typedef struct          /* Cells toggled by MutateGrid */
+{
+    int *cells;                 /* indices of toggled cells, ascending */
+    int size;                   /* number of indices allocated */
+    int count;                  /* number of indices stored */
+    int overflow;               /* TRUE if there were more than size */
+} FLIP_LIST;
+
+/* Define positions of data in packed structure.  Every packet starts
+ * with this header, and multi-byte values are stored most significant
+ * byte first, so the layout is the same on every host. */
+#define VERSION_POS     0       /* WIRE_VERSION */
+#define TYPE_POS        1       /* packet type */
+#define TS_POS          2       /* 8 byte time stamp, ns since the epoch */
+#define SN_POS          10      /* 4 byte sequence number */
+#define ROW_POS         14      /* 2 byte number of rows */
+#define COL_POS         16      /* 2 byte number of columns */
+#define LEN_POS         18      /* 4 byte payload length */
+#define CELL_POS        22      /* payload */
+
+#define WIRE_VERSION    1       /* bumped when the layout changes */
+
+#define PACKED_ROWS(p)  (((p)[ROW_POS].byte << 8) | (p)[ROW_POS + 1].byte)
+#define PACKED_COLS(p)  (((p)[COL_POS].byte << 8) | (p)[COL_POS + 1].byte)
+
+#define MAX_DIM         65535           /* largest number of rows or cols */
+#define MAX_CELLS       (1 << 24)       /* largest number of cells in grid */
+#define MAX_CLIENT_CELLS (1 << 22)      /* most cells the proxy buffers for */
+                                        /* one client */
+
+/* Delta and flip packets replace the cell data with these */
+#define BASE_POS        CELL_POS        /* 4 byte base sequence number */
+#define DELTA_POS       (BASE_POS + 4)  /* coded changes */
+
+/* Packet types stored at TYPE_POS */
+#define PKT_KEY         1       /* every cell, 1 bit per cell */
+#define PKT_DELTA       2       /* run length coded XOR with base frame */
+#define PKT_NIBBLES     3       /* every cell, 4 bits per cell */
+#define PKT_FLIPS       4       /* list of cells toggled since base frame */
+#define PKT_FRAGMENT    5       /* piece of a packet too big for a datagram */
+#define PKT_JOIN        6       /* client is starting to send */
+#define PKT_LEAVE       7       /* client is leaving the mix */
+#define PKT_TICK        8       /* mix now, from the tick program */
+#define PKT_SUBSCRIBE   9       /* send mixed grids to the sender */
+#define PKT_UNSUBSCRIBE 10      /* stop sending mixed grids to the sender */
+#define PKT_REGION      11      /* send the sender tiles in rectangles */
+#define PKT_TILE        12      /* part of a mixed grid, 4 bits per cell */
+#define PKT_LEVEL       13      /* send the sender a reduced mixed grid */
+#define PKT_COOKIE      14      /* cookie to repeat in a subscription */
+#define PKT_TYPES       15      /* one more than the largest type */
+
+#define LAST_GRID_TYPE  PKT_FRAGMENT    /* types up to this carry grids */
+
+/* Join, leave, tick and unsubscribe packets are only VERSION_POS and
+ * TYPE_POS */
+#define CONTROL_SIZE    2
+
+/* Subscribe, region and level packets follow the control header with a
+ * 4 byte cookie.  The proxy only takes a subscription whose cookie it
+ * sent to the same address, in a PKT_COOKIE packet the size of a
+ * subscribe packet, so a request with a forged source address only
+ * gets a packet no bigger than itself sent to that address. */
+#define COOKIE_POS      CONTROL_SIZE            /* 4 byte cookie */
+#define COOKIE_SIZE     (COOKIE_POS + 4)        /* bytes in subscribe and */
+                                                /* cookie packets */
+
+/* A region packet follows the cookie with 1 to MAX_REGIONS rectangles
+ * of the mixed grid, each a 2 byte row, column, number of rows and
+ * number of columns */
+#define REGION_POS      COOKIE_SIZE     /* first rectangle */
+#define REGION_SIZE     8               /* bytes per rectangle */
+#define MAX_REGIONS     8               /* most rectangles per subscriber */
+
+/* A level packet follows the cookie with the number of times the mixed
+ * grid is halved in each direction, 0 for the whole grid */
+#define LEVEL_POS       COOKIE_SIZE     /* 1 byte level */
+#define LEVEL_SIZE      (LEVEL_POS + 1) /* bytes in a level packet */
+#define MAX_LEVEL       8               /* most halvings */
+
+/* Tile packets have the header of a grid the size of the tile, then */
+#define TILE_ROW_POS    CELL_POS                /* 2 byte row of tile */
+#define TILE_COL_POS    (TILE_ROW_POS + 2)      /* 2 byte column of tile */
+#define GRID_ROWS_POS   (TILE_COL_POS + 2)      /* 2 byte rows of mix */
+#define GRID_COLS_POS   (GRID_ROWS_POS + 2)     /* 2 byte columns of mix */
+#define TILE_CELL_POS   (GRID_COLS_POS + 2)     /* cells, 4 bits per cell */
+
+/* Define positions of data in a fragment, after VERSION_POS & TYPE_POS */
+#define FRAG_ID_POS     2                       /* frame id */
+#define FRAG_INDEX_POS  (FRAG_ID_POS + 4)       /* index of this fragment */
+#define FRAG_COUNT_POS  (FRAG_INDEX_POS + 2)    /* fragments in frame */
+#define FRAG_LEN_POS    (FRAG_COUNT_POS + 2)    /* bytes in whole packet */
+#define FRAG_DATA_POS   (FRAG_LEN_POS + 4)      /* piece of packet */
+
+#define MAX_FRAGMENTS   65535   /* most fragments a packet may be cut into */
+#define FRAG_TIMEOUT    500000  /* usecs to wait for a frame's fragments */
+#define MAX_DATAGRAM    65536   /* largest UDP datagram the proxy receives */
+
+#define KEY_INTERVAL    10      /* default frames between key frames */
+#define MAX_FLIPS       256     /* flips recorded before falling back */
+
+/* Proxy buffers hold cells as fixed point numbers with FIXED_SHIFT bits
+ * after the binary point, so aging is a shift and rounding is an add and
+ * a shift.  Cells are kept as they arrived, and a buffer's age is applied
+ * as a shift when a merge reads them, or to its whole age class by a
+ * running sum.  A cell aged more than FIXED_SHIFT times is 0. */
+#define FIXED_SHIFT     7
+#define FIXED_ONE       (1 << FIXED_SHIFT)      /* 1.0 */
+#define FIXED_HALF      (FIXED_ONE >> 1)        /* 0.5, for rounding */
+#define FIXED_SUM_MAX   0xFFFF                  /* largest FIXED_SUM */
+
+/* Each row of buffered cells starts on a CELL_ALIGN byte boundary, and is
+ * padded with 0 cells to a multiple of CELL_ALIGN, so whole vectors of
+ * cells can be loaded without a partial tail */
+#define CELL_ALIGN      32
+#define PADDED_COLS(c)  (((c) + CELL_ALIGN - 1) & ~(CELL_ALIGN - 1))
+
+typedef unsigned char FIXED;            /* buffered cell, 0 .. FIXED_ONE */
+typedef unsigned short FIXED_SUM;       /* sum of buffered cells */
 
 typedef struct          /* Structure for proxy buffering of cell grid */
 {
     struct timeval timeStamp;   /* time when data was last updated */
     unsigned sequenceNumber;    /* sequence number */
     unsigned char updated;      /* updated since last add */
-    unsigned char rows;         /* number of rows in grid*/
-    unsigned char cols;         /* number of columns in grid */
-    float *cells;               /* actual grid data cells */
+    unsigned char age;          /* merges since last update, cells are */
+                                /* worth cells >> age */
+    unsigned short rows;        /* number of rows in grid*/
+    unsigned short cols;        /* number of columns in grid */
+    int size;                   /* number of cells allocated */
+    int stride;                 /* cells from one row to the next */
+    FIXED *cells;               /* actual grid data cells, row padded */
+    BYTE *bits;                 /* last frame bit packed, for deltas */
 } GRID_BUF;
 
-typedef struct BUF_LIST         /* Linked list of cell grid buffers */
+typedef enum            /* Cell packing and unpacking kernels */
+{
+    CODEC_SCALAR,               /* one OCTET bit field at a time */
+    CODEC_SWAR,                 /* 8 cells at a time in a 64 bit word */
+    CODEC_SSE2,                 /* 16 cells at a time */
+    CODEC_AVX2                  /* 32 cells at a time */
+} CODEC_KERNEL;
+
+typedef enum            /* Ways of merging client buffers */
+{
+    MERGE_SCALAR,               /* add fixed point cells one at a time */
+    MERGE_BITSLICE,             /* add packed bits with bit sliced adders */
+    MERGE_VECTOR                /* add fixed point cells a vector at a time */
+} MERGE_ENGINE;
+
+/* Bit-sliced merge sums have the same fraction bits as FIXED cells, and
+ * as many bits in all as a FIXED_SUM.  One more plane marks the sums that
+ * overflowed, which saturate at FIXED_SUM_MAX like the other engines. */
+#define MERGE_FRACTION_PLANES   FIXED_SHIFT
+#define MERGE_SUM_PLANES        (int)(sizeof(FIXED_SUM) * 8)
+#define MERGE_PLANES    (MERGE_SUM_PLANES + 1)
+
+typedef struct          /* Structure for reassembling fragmented packets */
+{
+    unsigned frameID;           /* frame id of fragments being collected */
+    int count;                  /* number of fragments in the frame */
+    int received;               /* number of fragments received */
+    int length;                 /* number of bytes in the whole packet */
+    struct timeval started;     /* time first fragment arrived */
+    unsigned char *have;        /* TRUE for each fragment received */
+    int haveSize;               /* number of flags allocated */
+    BYTE *packet;               /* packet being reassembled */
+    int size;                   /* number of bytes allocated for packet */
+} REASSEMBLY;
+
+#define CLIENT_ADDR_LEN 16      /* IPv6 address, IPv4 is mapped into one */
+
+typedef struct          /* Identifies a client to the proxy */
 {
-    GRID_BUF *buffer;           /* actual buffer */
-    unsigned int id;            /* client ID */
-    struct BUF_LIST *next;      /* pointer to next client's buffer */
-} BUF_LIST;
+    unsigned char addr[CLIENT_ADDR_LEN];    /* IPv6 or IPv4 mapped address */
+    unsigned short port;        /* UDP port, network byte order */
+    unsigned short pad;         /* always 0, so keys compare with memcmp */
+    unsigned int session;       /* session ID, 0 if the client has none */
+} CLIENT_KEY;
+
+/* Every client's buffer lives in a slot of a CLIENT_STORE.  Slots are
+ * numbered densely from 0, and freed slots are reused before new ones,
+ * so a merge walks the slot arrays from the front.  The cells and bits of
+ * all the slots are kept in two slabs.  Each slot has its own extent of
+ * the slabs, sized for its own grid and handed out from the end of the
+ * slabs.  A slot whose grid outgrows its extent gets a new one, and when
+ * the slabs are full the extents still in use are packed into new slabs
+ * twice their size.  Clients are found by their key in an open
+ * addressing hash table of slots, which is kept at most half full. */
+typedef struct          /* Slab of client buffers, one slot per client */
+{
+    int capacity;               /* number of slots allocated */
+    int high;                   /* slots from here up have never been used */
+    int count;                  /* number of clients in the store */
+    int *freeSlots;             /* stack of freed slots below high */
+    int freeCount;              /* number of slots on the free stack */
+    size_t cellsUsed;           /* FIXED cells handed out from the slab */
+    size_t cellsSize;           /* FIXED cells allocated in the slab */
+    size_t bitsUsed;            /* BYTEs handed out from the bits slab */
+    size_t bitsSize;            /* BYTEs allocated in the bits slab */
+    unsigned char *used;        /* TRUE for each slot holding a client */
+    CLIENT_KEY *keys;           /* client key of each slot */
+    GRID_BUF *buffers;          /* buffer of each slot, bits NULL until */
+                                /* its first key frame */
+    REASSEMBLY **frames;        /* fragmented packet of each slot */
+    FIXED *cells;               /* CELL_ALIGN aligned slab of cells */
+    BYTE *bits;                 /* slab of bit packed cells */
+    int *table;                 /* hash table of slots, -1 if empty */
+    int tableSize;              /* entries in table, a power of 2 */
+} CLIENT_STORE;
+
+/* A running sum keeps the buffers that have not been updated for 1 to
+ * FIXED_SHIFT merges apart in age classes, one for each merge they
+ * stopped being updated at.  Each class counts the 1 cells of its
+ * buffers, so a merge ages a whole class with one pass over its counts,
+ * however many buffers are in it. */
+#define AGE_CLASSES     FIXED_SHIFT     /* classes kept by a running sum */
+
+typedef struct          /* Running sum of every client's cells */
+{
+    GRID grid;                  /* merge, kept current with the sums */
+    unsigned *sums;             /* fixed point sum of each grid cell */
+    unsigned *counts;           /* AGE_CLASSES grids of size counts of */
+                                /* the 1 cells in each age class */
+    int members[AGE_CLASSES];   /* buffers in each age class */
+    int epoch;                  /* age class of buffers aged by the last */
+                                /* merge */
+    int size;                   /* number of cells allocated */
+    unsigned char stale;        /* TRUE if sums must be rebuilt */
+} ACCUMULATOR;
 
 /**************************************************************************
 *                           Function Prototypes
 **************************************************************************/
 
+/* Codec kernel selection */
+void InitCodec(void);                           /* Pick pack/unpack kernels */
+const char *CodecKernelName(void);              /* Name of kernels in use */
+int SetCodecKernel(CODEC_KERNEL kernel);        /* Force pack/unpack kernels */
+
+/* Wire format */
+void PutBigEndian(BYTE *packed, int pos,        /* Store value MSB first */
+                  int bytes, unsigned long long value);
+unsigned long long GetBigEndian(BYTE *packed,   /* Read value MSB first */
+                                int pos, int bytes);
+int ValidateHeader(BYTE *packed, int size);     /* Check packet header */
+int PackControl(BYTE *packed, int type);        /* Join, leave or tick */
+
 /* Client grid operations */
 GRID *InitGrid(int rows, int cols);             /* Create and fill grid */
+int PackedBitsSize(int rows, int cols);         /* Size of bit packed grid */
 BYTE *PackGridToBits(GRID *grid, int *size);    /* Pack grid cells in bits */
+int PackGridToBitsBuf(GRID *grid,               /* Pack into caller's array */
+                      BYTE *packed, int size);
+int PackBitsToDelta(BYTE *packed,              /* Code packed grid as XOR */
+                    BYTE *reference,            /* with reference grid */
+                    BYTE *delta, int size);
+int PackNibblesToDelta(BYTE *packed,           /* Same for nibble packed */
+                       BYTE *reference,         /* grids */
+                       BYTE *delta, int size);
+int PackFlipsToBuf(GRID *grid,                  /* Code toggled cells of */
+                   FLIP_LIST *flips,            /* grid as a flip list */
+                   unsigned baseSequence,
+                   BYTE *packed, int size);
+void FlipPackedBits(BYTE *packed,               /* Toggle cells of a packed */
+                    FLIP_LIST *flips,           /* grid */
+                    unsigned sequenceNumber);
+int FragmentCount(int size, int maxDatagram);   /* Fragments to fit packet */
+int PackFragmentBuf(BYTE *packed, int size,     /* Pack one fragment of a */
+                    unsigned frameID,           /* packet too big for a */
+                    int index, int count,       /* datagram */
+                    BYTE *fragment, int fragSize);
 GRID *UnpackBitsToGrid(BYTE *packed);           /* Unpack bit packed grids */
+int UnpackBitsIntoGrid(BYTE *packed, int size,  /* Unpack into caller's grid */
+                       GRID *grid, int cellsSize);
 BYTE *PackGridToNibbles(GRID *grid);            /* Pack grid cells in nibbles */
+int PackedNibblesSize(int rows, int cols);      /* Size of nibble packed grid */
+int PackGridToNibblesBuf(GRID *grid,            /* Pack into caller's array */
+                         BYTE *packed, int size);
+int PackedTileSize(int rows, int cols);         /* Size of packed tile */
+int PackTileToNibblesBuf(GRID *grid,            /* Pack part of a grid in */
+                         int row, int col,      /* nibbles */
+                         int rows, int cols,
+                         BYTE *packed, int size);
 GRID *UnpackNibblesToGrid(BYTE *packed);        /* Unpack nibble packed grids */
+int ReduceCell(GRID *fine, GRID *coarse,        /* Average 2x2 cells into */
+               int row, int col);               /* one */
 void FreeGrid(GRID *grid);                      /* Free malloced grid */
-void MutateGrid(GRID *grid, int display);       /* Toggle random grid bits */
+void MutateGrid(GRID *grid, int display,       /* Toggle random grid bits */
+                FLIP_LIST *flips);
 void ShowGrid(GRID *grid);                      /* Display grid on screen */
 
 /* Proxy grid buffer operations */
 GRID_BUF *UnpackBitsToBuffer(BYTE *packed);     /* Put packed grid in buffer */
+int UnpackBitsIntoBuffer(BYTE *packed,          /* Unpack into caller's */
+                         int size,              /* buffer */
+                         GRID_BUF *buffer);
+int ApplyDeltaToBuffer(BYTE *delta, int size,   /* XOR delta into buffer */
+                       GRID_BUF *buffer, ACCUMULATOR *sum);
+int ApplyFlipsToBuffer(BYTE *flips, int size,   /* Toggle cells in buffer */
+                       GRID_BUF *buffer, ACCUMULATOR *sum);
 void FreeBuffer(GRID_BUF *buffer);              /* Free malloced buffer */
 void ShowBuffer(GRID_BUF *buffer);              /* Display buffer on screen */
 
-/* Proxy grid buffer list functions */
-BUF_LIST *AddClient(BUF_LIST **head, int id);   /* Add client to list */
-void UpdateClient(BUF_LIST **head,              /* Update client with packed */
-                  int id, BYTE *packed);
-void RemoveClient(BUF_LIST **head, int id);     /* Remove client from list */
-void ShowIDs(BUF_LIST *head);                   /* Display clients in list */
-GRID *MergeBuffers(BUF_LIST *head);             /* Merge buffers in list */
+/* Proxy client store functions */
+void InitClientStore(CLIENT_STORE *store);      /* Start an empty store */
+void FreeClientStore(CLIENT_STORE *store);      /* Free store and slabs */
+void MakeClientKey(CLIENT_KEY *key,             /* Key for client address */
+                   const struct sockaddr *addr, unsigned int session);
+int AddClient(CLIENT_STORE *store,              /* Add client to store */
+              const CLIENT_KEY *key);
+int FindClient(CLIENT_STORE *store,             /* Slot of client in store */
+               const CLIENT_KEY *key);
+void UpdateClient(CLIENT_STORE *store,          /* Update client with packed */
+                  const CLIENT_KEY *key, BYTE *packed, int size,
+                  ACCUMULATOR *sum);
+int ExpireFragments(CLIENT_STORE *store);       /* Drop stale fragments */
+void RemoveClient(CLIENT_STORE *store,          /* Remove client from store */
+                  const CLIENT_KEY *key, ACCUMULATOR *sum);
+void ShowIDs(CLIENT_STORE *store);              /* Display clients in store */
+GRID *MergeBuffers(CLIENT_STORE *store);        /* Merge buffers in store */
+int MergedCells(CLIENT_STORE *store);           /* Cells in merged grid */
+int MergeBuffersInto(CLIENT_STORE *store,       /* Merge into caller's grid */
+                     GRID *grid, FIXED_SUM *sums, int cellsSize);
+int MergeBufferSums(CLIENT_STORE *store,        /* Sum buffers, unrounded */
+                    GRID *grid, FIXED_SUM *sums, int cellsSize);
+void AddMergedSums(FIXED_SUM *total, int stride,    /* Add a partial merge */
+                   const FIXED_SUM *sums, int rows, int cols);
+void AddAccumulatorSums(FIXED_SUM *total,       /* Add a running sum */
+                        int stride, const ACCUMULATOR *sum);
+void RoundSumsInto(GRID *grid,                  /* Round sums into grid */
+                   const FIXED_SUM *sums);
+void SetMergeEngine(MERGE_ENGINE engine);       /* Choose merge engine */
+const char *MergeEngineName(void);              /* Name of merge engine */
+void InitAccumulator(ACCUMULATOR *sum);         /* Start empty running sum */
+GRID *PublishAccumulator(CLIENT_STORE *store,   /* Age and publish running */
+                         ACCUMULATOR *sum);     /* sum */
+void FreeAccumulator(ACCUMULATOR *sum);         /* Free running sum arrays */
+
+/* Heap use accounting */
+void *CountedMalloc(size_t size);               /* malloc that is counted */
+void *CountedAlignedMalloc(size_t size);        /* CELL_ALIGN aligned */
+unsigned long FrameMallocs(void);               /* mallocs since last call */
 
 /* Misc utils */
 char NibbleToAscii(unsigned nibble);            /* Convert nibble to hex char */
 void InitScreen(void);                          /* Initialize curses screen */
 void CloseScreen(void);                         /* Close curses screen */
 void PutFormattedLine(int row, int col, char *fmt, ... );  /* Display a line */
+void StartStatusLog(FILE *file);                /* Queue lines, don't draw */
+void DrainStatus(void);                         /* Draw queued lines */
 
 #endif          /*  !defined UTILS_H */